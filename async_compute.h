@@ -0,0 +1,323 @@
+#pragma once
+
+// Compute work on a queue of its own, next to the graphics queue.
+//
+// The workload is a particle simulation (shaders/simulate.comp): every frame dispatches one step
+// that reads the particles of the previous step and writes the next, ping-ponging between two
+// buffers. Each step signals the next value of the compute queue's timeline semaphore. A graphics
+// submit that consumes a step waits for its value on the GPU, the CPU only waits when a frame
+// slot's command buffer comes around again before its step has finished.
+//
+// Whether compute and graphics overlap depends on what the graphics side waits for. Waiting for
+// the previous frame's step lets this frame's step run next to this frame's rendering. Waiting
+// for this frame's step serializes them. Without a compute family of its own the "compute queue"
+// is the graphics queue and the steps are simply submitted in front of the frames.
+//
+// The buffers belong to the family of the queue. setQueue() moves to another queue by starting
+// the simulation over instead of transferring their ownership.
+//
+// Not thread safe, everything is called from the render thread.
+
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "host_allocator.h"
+#include "device_memory.h"
+
+class AsyncCompute
+{
+public:
+  static const uint32_t WORKGROUP_SIZE = 64;
+
+  // Matches the push constant block in simulate.comp
+  struct Constants
+  {
+    uint32_t particleCount;
+    uint32_t iterations;
+    float timeStep;
+    uint32_t reset;
+  };
+
+  struct Stats
+  {
+    uint64_t steps = 0;
+    uint64_t cpuWaits = 0; // A frame slot's command buffer was still in use
+  };
+
+  // The shader module still belongs to the caller
+  void init(VkDevice device, HostAllocator& hostAllocator, DeviceMemoryAllocator& allocator, VkShaderModule simulateShader, VkPipelineCache pipelineCache,
+            uint32_t particleCount, uint32_t framesInFlight)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    this->allocator = &allocator;
+    this->particleCount = particleCount;
+
+    VkDeviceSize size = VkDeviceSize(particleCount) * 8 * sizeof(float);
+    for (auto& buffer : particles)
+      allocator.createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer.buffer, buffer.memory);
+
+    VkDescriptorSetLayoutBinding bindings[2]{};
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+      bindings[i].binding = i; // 0 is the source, 1 the target
+      bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      bindings[i].descriptorCount = 1;
+      bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 2;
+    layoutInfo.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT), &setLayout) != VK_SUCCESS)
+      throw std::runtime_error("failed to create simulation descriptor set layout.");
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(Constants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &setLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, host->callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT), &pipelineLayout) != VK_SUCCESS)
+      throw std::runtime_error("failed to create simulation pipeline layout.");
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = simulateShader;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = pipelineLayout;
+    if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, host->callbacks(VK_OBJECT_TYPE_PIPELINE), &pipeline) != VK_SUCCESS)
+      throw std::runtime_error("failed to create simulation pipeline.");
+
+    VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4};
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = 2;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    if (vkCreateDescriptorPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL), &descriptorPool) != VK_SUCCESS)
+      throw std::runtime_error("failed to create simulation descriptor pool.");
+
+    // Set i reads buffer i and writes the other one
+    VkDescriptorSetLayout layouts[2] = {setLayout, setLayout};
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = 2;
+    allocInfo.pSetLayouts = layouts;
+    if (vkAllocateDescriptorSets(device, &allocInfo, descriptorSets) != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate simulation descriptor sets.");
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+      VkDescriptorBufferInfo bufferInfos[2]{};
+      bufferInfos[0] = {particles[i].buffer, 0, VK_WHOLE_SIZE};
+      bufferInfos[1] = {particles[1 - i].buffer, 0, VK_WHOLE_SIZE};
+      VkWriteDescriptorSet writes[2]{};
+      for (uint32_t binding = 0; binding < 2; ++binding)
+      {
+        writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[binding].dstSet = descriptorSets[i];
+        writes[binding].dstBinding = binding;
+        writes[binding].descriptorCount = 1;
+        writes[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[binding].pBufferInfo = &bufferInfos[binding];
+      }
+      vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+    }
+
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &typeInfo;
+    if (vkCreateSemaphore(device, &semaphoreInfo, host->callbacks(VK_OBJECT_TYPE_SEMAPHORE), &timeline) != VK_SUCCESS)
+      throw std::runtime_error("failed to create compute timeline semaphore.");
+
+    frames.resize(framesInFlight);
+  }
+
+  void shutdown()
+  {
+    destroyCommandPools();
+    frames.clear();
+    vkDestroySemaphore(device, timeline, host->callbacks(VK_OBJECT_TYPE_SEMAPHORE));
+    vkDestroyDescriptorPool(device, descriptorPool, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL));
+    vkDestroyPipeline(device, pipeline, host->callbacks(VK_OBJECT_TYPE_PIPELINE));
+    vkDestroyPipelineLayout(device, pipelineLayout, host->callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT));
+    vkDestroyDescriptorSetLayout(device, setLayout, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT));
+    for (auto& buffer : particles)
+      allocator->destroyBuffer(buffer.buffer, buffer.memory);
+  }
+
+  // The queue the steps are submitted to. dedicated says whether it is a queue of its own or shared
+  // with graphics. Waits for the steps submitted so far, the simulation starts over on the new queue.
+  void setQueue(VkQueue queue, uint32_t family, bool dedicated)
+  {
+    wait(submitted);
+    destroyCommandPools();
+    this->queue = queue;
+    this->dedicated = dedicated;
+    needsReset = true;
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = family;
+    for (auto& frame : frames)
+    {
+      if (vkCreateCommandPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_COMMAND_POOL), &frame.commandPool) != VK_SUCCESS)
+        throw std::runtime_error("failed to create compute command pool.");
+
+      VkCommandBufferAllocateInfo allocInfo{};
+      allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      allocInfo.commandPool = frame.commandPool;
+      allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      allocInfo.commandBufferCount = 1;
+      if (vkAllocateCommandBuffers(device, &allocInfo, &frame.commandBuffer) != VK_SUCCESS)
+        throw std::runtime_error("failed to allocate compute command buffer.");
+    }
+  }
+
+  // Submits one simulation step of the given number of iterations from frameSlot and returns the
+  // timeline value it signals
+  uint64_t submit(uint32_t frameSlot, uint32_t iterations)
+  {
+    Frame& frame = frames[frameSlot];
+    wait(frame.value);
+    vkResetCommandPool(device, frame.commandPool, 0);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(frame.commandBuffer, &beginInfo);
+
+    // The previous step wrote the source on this queue
+    VkMemoryBarrier stepBarrier{};
+    stepBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    stepBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    stepBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(frame.commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         1, &stepBarrier, 0, nullptr, 0, nullptr);
+
+    Constants constants{particleCount, iterations, 0.001f, needsReset ? 1u : 0u};
+    vkCmdBindPipeline(frame.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(frame.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1,
+                            &descriptorSets[source], 0, nullptr);
+    vkCmdPushConstants(frame.commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(frame.commandBuffer, (particleCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+    if (vkEndCommandBuffer(frame.commandBuffer) != VK_SUCCESS)
+      throw std::runtime_error("failed to record simulation step.");
+
+    uint64_t value = submitted + 1;
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &value;
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &frame.commandBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &timeline;
+    if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+      throw std::runtime_error("failed to submit simulation step.");
+
+    frame.value = submitted = value;
+    source = 1 - source;
+    needsReset = false;
+    stats.steps++;
+    return value;
+  }
+
+  // Timeline value of the most recent step, 0 before the first
+  uint64_t lastValue() const { return submitted; }
+  VkSemaphore timelineSemaphore() const { return timeline; }
+  bool isDedicated() const { return dedicated; }
+  uint32_t getParticleCount() const { return particleCount; }
+
+  void printStats(std::ostream& out) const
+  {
+    out << "Compute (" << (dedicated ? "own queue" : "graphics queue") << ", " << particleCount << " particles): "
+        << stats.steps << " steps, " << stats.cpuWaits << " CPU waits for a frame slot" << std::endl;
+  }
+
+private:
+  struct ParticleBuffer
+  {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    DeviceAllocation memory;
+  };
+
+  struct Frame
+  {
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    uint64_t value = 0; // Signaled when the GPU is done with the command buffer
+  };
+
+  void wait(uint64_t value)
+  {
+    if (value <= completed)
+      return;
+    if (vkGetSemaphoreCounterValue(device, timeline, &completed) != VK_SUCCESS)
+      throw std::runtime_error("failed to read compute timeline.");
+    if (value <= completed)
+      return;
+
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &timeline;
+    waitInfo.pValues = &value;
+    if (vkWaitSemaphores(device, &waitInfo, UINT64_MAX) != VK_SUCCESS)
+      throw std::runtime_error("failed to wait for compute.");
+    completed = value;
+    stats.cpuWaits++;
+  }
+
+  void destroyCommandPools()
+  {
+    for (auto& frame : frames)
+    {
+      if (frame.commandPool != VK_NULL_HANDLE)
+        vkDestroyCommandPool(device, frame.commandPool, host->callbacks(VK_OBJECT_TYPE_COMMAND_POOL));
+      frame.commandPool = VK_NULL_HANDLE;
+      frame.commandBuffer = VK_NULL_HANDLE;
+    }
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  DeviceMemoryAllocator* allocator = nullptr;
+  VkQueue queue = VK_NULL_HANDLE;
+  bool dedicated = false;
+  uint32_t particleCount = 0;
+  ParticleBuffer particles[2];
+  uint32_t source = 0; // The buffer the next step reads
+  bool needsReset = true;
+  VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+  VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+  VkDescriptorSet descriptorSets[2] = {};
+  VkSemaphore timeline = VK_NULL_HANDLE;
+  uint64_t submitted = 0;
+  uint64_t completed = 0;
+  std::vector<Frame> frames;
+  Stats stats;
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+// Bindless descriptors.
+//
+// Instead of a descriptor set per draw there is one large descriptor array per resource type,
+// each in its own set: set 0 holds combined image samplers, set 1 storage buffers. Both are
+// bound once per command buffer and a draw picks its resources by pushing their slot indices.
+// Adding a resource writes one descriptor into a free slot of its array.
+//
+// The arrays are created with descriptor indexing (core in 1.2): partially bound, so unused
+// slots don't need a valid descriptor, and update after bind, so slots can be written while
+// the set is bound in command buffers that are still pending. A released slot may still be
+// read by a frame in flight, it only goes back on the free list once that frame has completed
+// (see collect). The count is variable, the same layouts can also back small sets, which is
+// how the bind-per-draw baseline in --bench bindless is made.
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "host_allocator.h"
+
+class BindlessHeap
+{
+public:
+  // Also the set index in the pipeline layout
+  enum Table
+  {
+    IMAGES = 0,
+    BUFFERS = 1,
+    TABLE_COUNT
+  };
+
+  void init(VkDevice device, HostAllocator& hostAllocator, uint32_t maxImages, uint32_t maxBuffers)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    tables[IMAGES].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    tables[IMAGES].capacity = maxImages;
+    tables[BUFFERS].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    tables[BUFFERS].capacity = maxBuffers;
+
+    VkDescriptorPoolSize poolSizes[TABLE_COUNT]{};
+    for (uint32_t i = 0; i < TABLE_COUNT; ++i)
+    {
+      Slots& table = tables[i];
+      VkDescriptorBindingFlags bindingFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+                                              VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+                                              VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT;
+      VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo{};
+      flagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+      flagsInfo.bindingCount = 1;
+      flagsInfo.pBindingFlags = &bindingFlags;
+
+      VkDescriptorSetLayoutBinding binding{};
+      binding.binding = 0;
+      binding.descriptorType = table.type;
+      binding.descriptorCount = table.capacity; // The upper bound, each set picks its own count
+      binding.stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS | VK_SHADER_STAGE_COMPUTE_BIT;
+
+      VkDescriptorSetLayoutCreateInfo layoutInfo{};
+      layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+      layoutInfo.pNext = &flagsInfo;
+      layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+      layoutInfo.bindingCount = 1;
+      layoutInfo.pBindings = &binding;
+      if (vkCreateDescriptorSetLayout(device, &layoutInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT), &table.layout) != VK_SUCCESS)
+        throw std::runtime_error("failed to create bindless descriptor set layout.");
+
+      poolSizes[i] = {table.type, table.capacity};
+    }
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    poolInfo.maxSets = TABLE_COUNT;
+    poolInfo.poolSizeCount = TABLE_COUNT;
+    poolInfo.pPoolSizes = poolSizes;
+    if (vkCreateDescriptorPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL), &pool) != VK_SUCCESS)
+      throw std::runtime_error("failed to create bindless descriptor pool.");
+
+    for (uint32_t i = 0; i < TABLE_COUNT; ++i)
+      tables[i].set = allocateSet(pool, static_cast<Table>(i), tables[i].capacity);
+  }
+
+  void shutdown()
+  {
+    vkDestroyDescriptorPool(device, pool, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL));
+    for (auto& table : tables)
+    {
+      vkDestroyDescriptorSetLayout(device, table.layout, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT));
+      table = Slots{};
+    }
+  }
+
+  // Allocates a set of table's layout with count descriptors from pool, which has to be created
+  // with VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT
+  VkDescriptorSet allocateSet(VkDescriptorPool pool, Table table, uint32_t count)
+  {
+    VkDescriptorSetVariableDescriptorCountAllocateInfo countInfo{};
+    countInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO;
+    countInfo.descriptorSetCount = 1;
+    countInfo.pDescriptorCounts = &count;
+
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.pNext = &countInfo;
+    allocInfo.descriptorPool = pool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &tables[table].layout;
+
+    VkDescriptorSet set;
+    if (vkAllocateDescriptorSets(device, &allocInfo, &set) != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate bindless descriptor set.");
+    return set;
+  }
+
+  // Returns the slot the shaders index with
+  uint32_t addImage(VkImageView view, VkSampler sampler, VkImageLayout layout)
+  {
+    uint32_t slot = allocate(tables[IMAGES]);
+    VkDescriptorImageInfo imageInfo{sampler, view, layout};
+    write(tables[IMAGES].set, slot, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &imageInfo, nullptr);
+    return slot;
+  }
+
+  uint32_t addBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+  {
+    uint32_t slot = allocate(tables[BUFFERS]);
+    writeBuffer(tables[BUFFERS].set, slot, buffer, offset, range);
+    return slot;
+  }
+
+  // Writes a storage buffer descriptor into any set of the BUFFERS layout
+  void writeBuffer(VkDescriptorSet set, uint32_t slot, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+  {
+    VkDescriptorBufferInfo bufferInfo{buffer, offset, range};
+    write(set, slot, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &bufferInfo);
+  }
+
+  // The slot stays reserved until frame lastUsedFrame has completed
+  void release(Table table, uint32_t slot, uint64_t lastUsedFrame)
+  {
+    tables[table].pending.push_back({slot, lastUsedFrame});
+  }
+
+  // Puts the released slots of every completed frame back on the free lists
+  void collect(uint64_t completedFrames)
+  {
+    for (auto& table : tables)
+    {
+      auto done = [&](const PendingSlot& pending) { return pending.lastUsedFrame <= completedFrames; };
+      for (const auto& pending : table.pending)
+      {
+        if (done(pending))
+          table.freeSlots.push_back(pending.slot);
+      }
+      table.pending.erase(std::remove_if(table.pending.begin(), table.pending.end(), done), table.pending.end());
+    }
+  }
+
+  // Binds both tables, once per command buffer. Secondary command buffers don't inherit them.
+  void bind(VkCommandBuffer commandBuffer, VkPipelineBindPoint bindPoint, VkPipelineLayout layout) const
+  {
+    VkDescriptorSet sets[TABLE_COUNT] = {tables[IMAGES].set, tables[BUFFERS].set};
+    vkCmdBindDescriptorSets(commandBuffer, bindPoint, layout, 0, TABLE_COUNT, sets, 0, nullptr);
+  }
+
+  VkDescriptorSetLayout getSetLayout(Table table) const { return tables[table].layout; }
+  uint32_t getCapacity(Table table) const { return tables[table].capacity; }
+  uint32_t getUsed(Table table) const
+  {
+    const Slots& slots = tables[table];
+    return slots.highWater - static_cast<uint32_t>(slots.freeSlots.size());
+  }
+
+private:
+  struct PendingSlot
+  {
+    uint32_t slot;
+    uint64_t lastUsedFrame;
+  };
+
+  struct Slots
+  {
+    VkDescriptorType type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    VkDescriptorSetLayout layout = VK_NULL_HANDLE;
+    VkDescriptorSet set = VK_NULL_HANDLE;
+    uint32_t capacity = 0;
+    uint32_t highWater = 0;          // Slots below this have been handed out at least once
+    std::vector<uint32_t> freeSlots; // Released and reusable, taken before growing highWater
+    std::vector<PendingSlot> pending;
+  };
+
+  uint32_t allocate(Slots& table)
+  {
+    if (!table.freeSlots.empty())
+    {
+      uint32_t slot = table.freeSlots.back();
+      table.freeSlots.pop_back();
+      return slot;
+    }
+    if (table.highWater == table.capacity)
+      throw std::runtime_error("bindless descriptor table is full.");
+    return table.highWater++;
+  }
+
+  void write(VkDescriptorSet set, uint32_t slot, VkDescriptorType type,
+             const VkDescriptorImageInfo* imageInfo, const VkDescriptorBufferInfo* bufferInfo)
+  {
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = 0;
+    write.dstArrayElement = slot;
+    write.descriptorCount = 1;
+    write.descriptorType = type;
+    write.pImageInfo = imageInfo;
+    write.pBufferInfo = bufferInfo;
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  VkDescriptorPool pool = VK_NULL_HANDLE;
+  Slots tables[TABLE_COUNT];
+};
@@ -4,4 +4,15 @@
 
 /home/jh/dev/glslc/bin/glslc shaders/shader.vert -o shaders/vert.spv
 /home/jh/dev/glslc/bin/glslc shaders/shader.frag -o shaders/frag.spv
-g++ vk_glfw_test.cpp -g --std=c++20 -DNDEBUG -o testprogram.out -lglfw -lvulkan
+/home/jh/dev/glslc/bin/glslc shaders/cull.comp -o shaders/cull.spv
+/home/jh/dev/glslc/bin/glslc shaders/hiz.comp -o shaders/hiz.spv
+/home/jh/dev/glslc/bin/glslc shaders/simulate.comp -o shaders/simulate.spv
+# The same SPIR-V as C array initializers, for building with -DEMBED_SHADERS
+/home/jh/dev/glslc/bin/glslc -mfmt=num shaders/shader.vert -o shaders/vert.spv.inc
+/home/jh/dev/glslc/bin/glslc -mfmt=num shaders/shader.frag -o shaders/frag.spv.inc
+/home/jh/dev/glslc/bin/glslc -mfmt=num shaders/cull.comp -o shaders/cull.spv.inc
+/home/jh/dev/glslc/bin/glslc -mfmt=num shaders/hiz.comp -o shaders/hiz.spv.inc
+/home/jh/dev/glslc/bin/glslc -mfmt=num shaders/simulate.comp -o shaders/simulate.spv.inc
+g++ vk_glfw_test.cpp -g --std=c++20 -DNDEBUG -o testprogram.out -lglfw -lvulkan -pthread
+# Profiling build, with the CPU scopes and GPU timestamps of profiler.h compiled in
+g++ vk_glfw_test.cpp -g --std=c++20 -DNDEBUG -DENABLE_PROFILER -o testprogram_profile.out -lglfw -lvulkan -pthread
@@ -0,0 +1,188 @@
+#pragma once
+
+// Records the draws of a render pass on several threads.
+//
+// Command pools can't be used from two threads at once, so every thread gets its own pool per
+// frame in flight. A frame's pools are reset as a whole with vkResetCommandPool once the frame
+// that last used them has finished, the secondary command buffers in them are kept and re-recorded instead of
+// being freed and allocated again. The caller merges the secondaries with vkCmdExecuteCommands.
+// With dynamic rendering there is no render pass to inherit, the secondaries get the attachment
+// formats through VkCommandBufferInheritanceRenderingInfo instead.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "host_allocator.h"
+#include "task_graph.h"
+
+class ParallelRecorder
+{
+public:
+  // Below this many draws per job handing work to another thread costs more than it saves
+  static const uint32_t MIN_DRAWS_PER_JOB = 256;
+
+  // Records draws [first, first + count) into a secondary command buffer that is already begun
+  using RecordFunction = std::function<void(VkCommandBuffer, uint32_t first, uint32_t count)>;
+
+  void init(VkDevice device, HostAllocator& hostAllocator, uint32_t queueFamily, uint32_t threadCount, uint32_t framesInFlight)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    this->threadCount = threadCount;
+    maxJobs = std::max(1u, threadCount);
+    pool = std::make_unique<ThreadPool>(threadCount);
+
+    // Index 0 is the calling thread, which records itself when there is only one job
+    frames.resize(framesInFlight);
+    for (auto& frame : frames)
+    {
+      frame.threads.resize(threadCount + 1);
+      for (auto& thread : frame.threads)
+      {
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; // Reset every frame, never per buffer
+        poolInfo.queueFamilyIndex = queueFamily;
+        if (vkCreateCommandPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_COMMAND_POOL), &thread.commandPool) != VK_SUCCESS)
+          throw std::runtime_error("failed to create recording command pool.");
+      }
+    }
+  }
+
+  void shutdown()
+  {
+    pool.reset();
+    for (auto& frame : frames)
+    {
+      for (auto& thread : frame.threads)
+        vkDestroyCommandPool(device, thread.commandPool, host->callbacks(VK_OBJECT_TYPE_COMMAND_POOL));
+    }
+    frames.clear();
+  }
+
+  // Splits the draws into jobs, records them in parallel and returns the secondaries in draw order.
+  // The slot's previous frame must have finished, its pools are reset here. renderingInfo replaces the
+  // render pass and framebuffer, which are then VK_NULL_HANDLE, when recording for vkCmdBeginRendering.
+  const std::vector<VkCommandBuffer>& record(uint32_t frameSlot, VkRenderPass renderPass, VkFramebuffer framebuffer,
+                                             uint32_t drawCount, const RecordFunction& recordDraws,
+                                             const VkCommandBufferInheritanceRenderingInfo* renderingInfo = nullptr)
+  {
+    auto start = std::chrono::steady_clock::now();
+    Frame& frame = frames[frameSlot];
+    for (auto& thread : frame.threads)
+    {
+      vkResetCommandPool(device, thread.commandPool, 0);
+      thread.used = 0;
+    }
+
+    uint32_t jobs = std::min(maxJobs, std::max(1u, (drawCount + MIN_DRAWS_PER_JOB - 1) / MIN_DRAWS_PER_JOB));
+    if (threadCount == 0)
+      jobs = 1;
+    frame.secondaries.assign(jobs, VK_NULL_HANDLE);
+
+    VkCommandBufferInheritanceInfo inheritance{};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.pNext = renderingInfo;
+    inheritance.renderPass = renderPass;
+    inheritance.subpass = 0;
+    inheritance.framebuffer = framebuffer;
+
+    auto recordJob = [&, drawCount, jobs](uint32_t job) {
+      uint32_t first = static_cast<uint32_t>((uint64_t) drawCount * job / jobs);
+      uint32_t last = static_cast<uint32_t>((uint64_t) drawCount * (job + 1) / jobs);
+      VkCommandBuffer commandBuffer = acquire(frame.threads[ThreadPool::currentThreadIndex()]);
+
+      VkCommandBufferBeginInfo beginInfo{};
+      beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+      beginInfo.pInheritanceInfo = &inheritance;
+      if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+        throw std::runtime_error("failed to begin secondary command buffer.");
+      recordDraws(commandBuffer, first, last - first);
+      if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        throw std::runtime_error("failed to record secondary command buffer.");
+      frame.secondaries[job] = commandBuffer;
+    };
+
+    if (jobs == 1)
+    {
+      recordJob(0);
+    }else{
+      std::latch done(jobs);
+      std::exception_ptr error;
+      std::mutex errorMutex;
+      for (uint32_t job = 0; job < jobs; ++job)
+      {
+        pool->submit([&, job]{
+          try{
+            recordJob(job);
+          }catch(...){
+            std::lock_guard<std::mutex> lock(errorMutex);
+            error = std::current_exception();
+          }
+          done.count_down();
+        });
+      }
+      done.wait();
+      if (error)
+        std::rethrow_exception(error);
+    }
+
+    lastRecordMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return frame.secondaries;
+  }
+
+  // Caps how many jobs a frame is split into, used by the recording benchmark
+  void setMaxJobs(uint32_t jobs) { maxJobs = std::max(1u, std::min(jobs, std::max(1u, threadCount))); }
+  uint32_t getThreadCount() const { return threadCount; }
+
+  // CPU time of the last record() call, from resetting the pools until every secondary is done
+  double lastRecordMs = 0;
+
+private:
+  struct ThreadPools
+  {
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    std::vector<VkCommandBuffer> commandBuffers; // Allocated on demand, kept across resets
+    size_t used = 0;
+  };
+
+  struct Frame
+  {
+    std::vector<ThreadPools> threads; // Indexed by ThreadPool::currentThreadIndex()
+    std::vector<VkCommandBuffer> secondaries;
+  };
+
+  VkCommandBuffer acquire(ThreadPools& thread)
+  {
+    if (thread.used == thread.commandBuffers.size())
+    {
+      VkCommandBufferAllocateInfo allocInfo{};
+      allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      allocInfo.commandPool = thread.commandPool;
+      allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+      allocInfo.commandBufferCount = 1;
+
+      VkCommandBuffer commandBuffer;
+      if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS)
+        throw std::runtime_error("failed to allocate secondary command buffer.");
+      thread.commandBuffers.push_back(commandBuffer);
+    }
+    return thread.commandBuffers[thread.used++];
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  uint32_t threadCount = 0;
+  uint32_t maxJobs = 1;
+  std::unique_ptr<ThreadPool> pool;
+  std::vector<Frame> frames;
+};
@@ -0,0 +1,378 @@
+#pragma once
+
+// Validation messages, written on a thread of their own.
+//
+// The layer calls the messenger on whichever thread made the Vulkan call, recording threads and
+// the render thread included. Writing to a stream right there puts stream I/O, and the lock
+// inside it, on those threads. In async mode the callback only copies the message into a ring
+// and returns, a writer thread drains the ring and does the formatting and the I/O.
+//
+// In sync mode, and before the writer runs, messages are written in the callback as before.
+//
+// - Messages below the minimum severity are dropped before anything is copied.
+// - A message ID that was seen before is only counted. The writer reports the repeats about
+//   once a second, and once more when the log stops.
+// - The ring has a fixed number of fixed size records, nothing is allocated per message. When
+//   it is full the message is dropped and counted, the callback never waits for the writer.
+// - stop() turns new messages away first, they are counted as dropped. The writer then waits for
+//   the callbacks that got in before that and drains everything they claimed.
+//
+// The ring is a bounded multi producer queue (sequence number per cell): a producer claims a
+// cell with a compare and swap on the tail and publishes it by bumping the cell's sequence, the
+// single consumer hands the cell back the same way.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+class DebugLog
+{
+public:
+  enum class Mode
+  {
+    Sync, // Written in the callback, as it used to be
+    Async
+  };
+
+  struct Stats
+  {
+    uint64_t received = 0;
+    uint64_t filtered = 0;     // Below the minimum severity
+    uint64_t deduplicated = 0; // Repeats of a message ID, only counted
+    uint64_t dropped = 0;      // The ring was full, or the log was stopping
+    uint64_t written = 0;
+  };
+
+  static constexpr uint32_t CAPACITY = 256;    // Records in the ring, a power of two
+  static constexpr uint32_t MAX_TEXT = 1024;   // Longer messages are cut off
+  static constexpr uint32_t DEDUP_SLOTS = 1024; // Distinct message IDs that are deduplicated
+
+  DebugLog() : cells(new Cell[CAPACITY]), slots(new Slot[DEDUP_SLOTS])
+  {
+    for (uint32_t i = 0; i < CAPACITY; ++i)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  ~DebugLog() { stop(); }
+
+  DebugLog(const DebugLog&) = delete;
+  DebugLog& operator=(const DebugLog&) = delete;
+
+  // Starts the writer in async mode. Messages that arrive before that are written synchronously.
+  void start(Mode mode, std::ostream& out = std::cerr)
+  {
+    stop();
+    this->out = &out;
+    this->mode = mode;
+    if (mode == Mode::Async)
+    {
+      // Counts and names from an earlier run would be reported as this one's repeats
+      for (uint32_t i = 0; i < DEDUP_SLOTS; ++i)
+      {
+        slots[i].key.store(0, std::memory_order_relaxed);
+        slots[i].count.store(0, std::memory_order_relaxed);
+        slots[i].name[0] = '\0';
+      }
+      reported.assign(DEDUP_SLOTS, 0);
+      stopping.store(false, std::memory_order_relaxed);
+      running.store(true, std::memory_order_release);
+      writer = std::thread([this]{ writerLoop(); });
+    }
+  }
+
+  // Drains the ring and reports the repeats that are left. Afterwards messages are written
+  // synchronously again.
+  void stop()
+  {
+    if (writer.joinable())
+    {
+      stopping.store(true, std::memory_order_seq_cst);
+      running.store(false, std::memory_order_seq_cst);
+      writer.join();
+      stopping.store(false, std::memory_order_release);
+    }
+  }
+
+  // Only severities at least this high get through. Also the mask the messenger is created with,
+  // so the layer doesn't call us for the rest at all.
+  void setMinSeverity(VkDebugUtilsMessageSeverityFlagBitsEXT severity) { minSeverity.store(severity, std::memory_order_relaxed); }
+  VkDebugUtilsMessageSeverityFlagsEXT severityMask() const
+  {
+    VkDebugUtilsMessageSeverityFlagsEXT mask = 0;
+    for (uint32_t bit = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT; bit <= VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT; bit <<= 4)
+    {
+      if (bit >= minSeverity.load(std::memory_order_relaxed))
+        mask |= bit;
+    }
+    return mask;
+  }
+
+  void setDeduplicate(bool enabled) { deduplicate.store(enabled, std::memory_order_relaxed); }
+
+  // Called from the messenger callback, on any thread
+  void log(VkDebugUtilsMessageSeverityFlagBitsEXT severity, const VkDebugUtilsMessengerCallbackDataEXT* data)
+  {
+    counters.received.fetch_add(1, std::memory_order_relaxed);
+    if (severity < minSeverity.load(std::memory_order_relaxed))
+    {
+      counters.filtered.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    // Counted before running is checked, a writer that sees the log stopped waits for every
+    // producer that still saw it running
+    producers.fetch_add(1, std::memory_order_seq_cst);
+    if (running.load(std::memory_order_seq_cst))
+    {
+      enqueue(data);
+      producers.fetch_sub(1, std::memory_order_release);
+      return;
+    }
+    producers.fetch_sub(1, std::memory_order_relaxed);
+
+    if (stopping.load(std::memory_order_acquire))
+      counters.dropped.fetch_add(1, std::memory_order_relaxed); // The writer may already be past it
+    else
+      write(data->pMessage);
+  }
+
+  Stats getStats() const
+  {
+    Stats stats;
+    stats.received = counters.received.load(std::memory_order_relaxed);
+    stats.filtered = counters.filtered.load(std::memory_order_relaxed);
+    stats.deduplicated = counters.deduplicated.load(std::memory_order_relaxed);
+    stats.dropped = counters.dropped.load(std::memory_order_relaxed);
+    stats.written = counters.written.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void printStats(std::ostream& out) const
+  {
+    Stats stats = getStats();
+    out << "Validation messages (" << (mode == Mode::Async ? "async" : "sync") << "): " << stats.received << " received, "
+        << stats.filtered << " filtered, " << stats.deduplicated << " repeats, " << stats.dropped << " dropped, "
+        << stats.written << " written" << std::endl;
+  }
+
+private:
+  static constexpr uint32_t MAX_PROBES = 16;
+
+  struct Record
+  {
+    uint64_t key;
+    char name[64];
+    char text[MAX_TEXT];
+  };
+
+  struct Cell
+  {
+    std::atomic<uint64_t> sequence;
+    Record record;
+  };
+
+  struct Slot
+  {
+    std::atomic<uint64_t> key{0};
+    std::atomic<uint64_t> count{0};
+    char name[64] = {}; // Writer thread only, what the repeat reports call the message
+  };
+
+  struct Counters
+  {
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> filtered{0};
+    std::atomic<uint64_t> deduplicated{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> written{0};
+  };
+
+  // The layer gives every check an ID number and name, messages without one are keyed on the text
+  static uint64_t messageKey(const VkDebugUtilsMessengerCallbackDataEXT* data)
+  {
+    const char* text = data->pMessageIdName ? data->pMessageIdName : data->pMessage;
+    uint64_t hash = 14695981039346656037ull ^ static_cast<uint32_t>(data->messageIdNumber);
+    for (const char* c = text; c && *c; ++c)
+      hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+    return hash ? hash : 1; // 0 marks an empty slot
+  }
+
+  // Open addressing without removal. Null when the ID's neighbourhood is full, it is then not
+  // deduplicated.
+  Slot* findSlot(uint64_t key)
+  {
+    for (uint32_t i = 0; i < MAX_PROBES; ++i)
+    {
+      Slot& slot = slots[(key + i) & (DEDUP_SLOTS - 1)];
+      uint64_t current = slot.key.load(std::memory_order_relaxed);
+      if (current == 0 && slot.key.compare_exchange_strong(current, key, std::memory_order_relaxed))
+        return &slot;
+      if (current == key)
+        return &slot;
+    }
+    return nullptr;
+  }
+
+  void enqueue(const VkDebugUtilsMessengerCallbackDataEXT* data)
+  {
+    uint64_t key = messageKey(data);
+    if (deduplicate.load(std::memory_order_relaxed))
+    {
+      Slot* slot = findSlot(key);
+      if (slot && slot->count.fetch_add(1, std::memory_order_relaxed) > 0)
+      {
+        counters.deduplicated.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+
+    if (!push(key, data))
+      counters.dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  bool push(uint64_t key, const VkDebugUtilsMessengerCallbackDataEXT* data)
+  {
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;)
+    {
+      cell = &cells[position & (CAPACITY - 1)];
+      uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+      int64_t difference = static_cast<int64_t>(sequence - position);
+      if (difference == 0)
+      {
+        if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+          break;
+      }else if (difference < 0){
+        return false; // The writer hasn't freed this cell from the last lap yet
+      }else{
+        position = tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    Record& record = cell->record;
+    record.key = key;
+    copyText(record.name, sizeof(record.name), data->pMessageIdName);
+    copyText(record.text, sizeof(record.text), data->pMessage);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  static void copyText(char* target, size_t capacity, const char* text)
+  {
+    size_t length = text ? strnlen(text, capacity - 1) : 0;
+    std::memcpy(target, text ? text : "", length);
+    target[length] = '\0';
+  }
+
+  void write(const char* text)
+  {
+    *out << "Validation Layer: " << (text ? text : "") << std::endl;
+    counters.written.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Single consumer
+  bool pop()
+  {
+    Cell& cell = cells[head & (CAPACITY - 1)];
+    if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+      return false;
+    const Record& record = cell.record;
+    Slot* slot = lookupSlot(record.key);
+    if (slot && !slot->name[0])
+      copyText(slot->name, sizeof(slot->name), record.name[0] ? record.name : record.text);
+    write(record.text);
+    cell.sequence.store(head + CAPACITY, std::memory_order_release);
+    head++;
+    return true;
+  }
+
+  // Like findSlot, but never claims a slot. Null for keys that aren't deduplicated.
+  Slot* lookupSlot(uint64_t key)
+  {
+    for (uint32_t i = 0; i < MAX_PROBES; ++i)
+    {
+      Slot& slot = slots[(key + i) & (DEDUP_SLOTS - 1)];
+      uint64_t current = slot.key.load(std::memory_order_relaxed);
+      if (current == key)
+        return &slot;
+      if (current == 0)
+        return nullptr;
+    }
+    return nullptr;
+  }
+
+  void reportRepeats()
+  {
+    for (uint32_t i = 0; i < DEDUP_SLOTS; ++i)
+    {
+      uint64_t count = slots[i].count.load(std::memory_order_relaxed);
+      if (count <= 1 || count == reported[i])
+        continue;
+      uint64_t repeats = count - std::max<uint64_t>(reported[i], 1);
+      const char* name = slots[i].name[0] ? slots[i].name : "(dropped message)";
+      *out << "Validation Layer: " << name
+           << " repeated " << repeats << " more time(s)" << std::endl;
+      reported[i] = count;
+    }
+  }
+
+  void writerLoop()
+  {
+    auto lastReport = std::chrono::steady_clock::now();
+    for (;;)
+    {
+      bool stopRequested = !running.load(std::memory_order_seq_cst);
+      if (stopRequested)
+      {
+        // No one gets in anymore. Wait for the producers that did, then everything they claimed
+        // is published and the read index can catch up with the claimed write index.
+        while (producers.load(std::memory_order_seq_cst) != 0)
+          std::this_thread::yield();
+        while (head != tail.load(std::memory_order_acquire))
+        {
+          if (!pop())
+            std::this_thread::yield();
+        }
+      }
+
+      bool any = false;
+      while (pop())
+        any = true;
+
+      auto now = std::chrono::steady_clock::now();
+      if (stopRequested || now - lastReport >= std::chrono::seconds(1))
+      {
+        reportRepeats();
+        lastReport = now;
+      }
+      if (stopRequested)
+        return;
+      // Polling keeps the producers free of any wake up call
+      if (!any)
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  }
+
+  std::unique_ptr<Cell[]> cells;
+  std::unique_ptr<Slot[]> slots;
+  alignas(64) std::atomic<uint64_t> tail{0};
+  alignas(64) uint64_t head = 0; // Writer thread only
+  alignas(64) std::atomic<uint32_t> producers{0}; // Callbacks between the running check and the push
+  std::vector<uint64_t> reported; // Writer thread only, count at the last report per slot
+  Counters counters;
+  std::atomic<VkDebugUtilsMessageSeverityFlagBitsEXT> minSeverity{VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT};
+  std::atomic<bool> deduplicate{true};
+  std::atomic<bool> running{false};
+  std::atomic<bool> stopping{false};
+  std::ostream* out = &std::cerr;
+  Mode mode = Mode::Sync;
+  std::thread writer;
+};
@@ -0,0 +1,332 @@
+#pragma once
+
+// Hierarchical depth (Hi-Z) pyramid for occlusion culling.
+//
+// Built by compute at the end of every frame from that frame's depth buffer, so the culling
+// pass of the next frame can test objects against it. Level 0 is half the size of the depth
+// buffer and every texel of every level holds the farthest depth of the texels below it. If
+// the nearest point of an object is behind that, whatever covered those pixels last frame
+// hides the object.
+//
+// Level sizes are rounded down like any mip chain. Where a level has an odd size, the last
+// texel of the level above also covers the leftover row or column, so texel x of level k
+// always covers depth pixels [x << (k + 1), (x + 1) << (k + 1)) plus the remainder at the edge.
+//
+// The images are replaced when the depth buffer is, release() hands the old ones to the
+// caller so they can be retired together with the swap chain. Descriptor sets exist per frame
+// in flight and are pointed at the new images when their frame slot comes around again, a set
+// is never updated while an earlier frame may still be using it.
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "host_allocator.h"
+#include "device_memory.h"
+
+class DepthPyramid
+{
+public:
+  static const uint32_t MAX_LEVELS = 16;
+  static const uint32_t WORKGROUP_SIZE = 8; // 8x8, matches hiz.comp
+
+  struct Images
+  {
+    VkImage image = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;      // Every level, sampled by the culling pass
+    std::vector<VkImageView> levelViews;    // One per level, written by the build
+    DeviceAllocation memory;
+    VkExtent2D extent{};                    // Of level 0
+    uint32_t levels = 0;
+  };
+
+  // The shader module still belongs to the caller
+  void init(VkDevice device, HostAllocator& hostAllocator, DeviceMemoryAllocator& allocator, VkShaderModule pyramidShader,
+            VkPipelineCache pipelineCache, uint32_t framesInFlight)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    this->allocator = &allocator;
+
+    // Texels are fetched, never filtered
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_NEAREST;
+    samplerInfo.minFilter = VK_FILTER_NEAREST;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.maxLod = static_cast<float>(MAX_LEVELS);
+    if (vkCreateSampler(device, &samplerInfo, host->callbacks(VK_OBJECT_TYPE_SAMPLER), &sampler) != VK_SUCCESS)
+      throw std::runtime_error("failed to create depth pyramid sampler.");
+
+    VkDescriptorSetLayoutBinding bindings[2]{};
+    bindings[0].binding = 0; // The level below, or the depth buffer for level 0
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    bindings[1].binding = 1; // The level being built
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    bindings[1].descriptorCount = 1;
+    bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 2;
+    layoutInfo.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT), &setLayout) != VK_SUCCESS)
+      throw std::runtime_error("failed to create depth pyramid descriptor set layout.");
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(LevelConstants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &setLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, host->callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT), &pipelineLayout) != VK_SUCCESS)
+      throw std::runtime_error("failed to create depth pyramid pipeline layout.");
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = pyramidShader;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = pipelineLayout;
+    if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, host->callbacks(VK_OBJECT_TYPE_PIPELINE), &pipeline) != VK_SUCCESS)
+      throw std::runtime_error("failed to create depth pyramid pipeline.");
+
+    VkDescriptorPoolSize poolSizes[2]{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[0].descriptorCount = framesInFlight * MAX_LEVELS;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSizes[1].descriptorCount = framesInFlight * MAX_LEVELS;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = framesInFlight * MAX_LEVELS;
+    poolInfo.poolSizeCount = 2;
+    poolInfo.pPoolSizes = poolSizes;
+    if (vkCreateDescriptorPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL), &descriptorPool) != VK_SUCCESS)
+      throw std::runtime_error("failed to create depth pyramid descriptor pool.");
+
+    frames.resize(framesInFlight);
+    std::vector<VkDescriptorSetLayout> layouts(MAX_LEVELS, setLayout);
+    for (auto& frame : frames)
+    {
+      frame.levelSets.resize(MAX_LEVELS);
+      VkDescriptorSetAllocateInfo allocInfo{};
+      allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+      allocInfo.descriptorPool = descriptorPool;
+      allocInfo.descriptorSetCount = MAX_LEVELS;
+      allocInfo.pSetLayouts = layouts.data();
+      if (vkAllocateDescriptorSets(device, &allocInfo, frame.levelSets.data()) != VK_SUCCESS)
+        throw std::runtime_error("failed to allocate depth pyramid descriptor sets.");
+    }
+  }
+
+  void shutdown()
+  {
+    destroy(current);
+    frames.clear();
+    vkDestroyDescriptorPool(device, descriptorPool, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL));
+    vkDestroyPipeline(device, pipeline, host->callbacks(VK_OBJECT_TYPE_PIPELINE));
+    vkDestroyPipelineLayout(device, pipelineLayout, host->callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT));
+    vkDestroyDescriptorSetLayout(device, setLayout, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT));
+    vkDestroySampler(device, sampler, host->callbacks(VK_OBJECT_TYPE_SAMPLER));
+  }
+
+  // Creates the images for a depth buffer, which must have VK_IMAGE_USAGE_SAMPLED_BIT. Any previous
+  // ones have to be released first.
+  void create(VkImageView depthView, VkExtent2D depthExtent)
+  {
+    if (current.image != VK_NULL_HANDLE)
+      throw std::runtime_error("depth pyramid images have not been released.");
+    this->depthView = depthView;
+
+    this->depthExtent = depthExtent;
+    current.extent = {std::max(1u, depthExtent.width / 2), std::max(1u, depthExtent.height / 2)};
+    current.levels = 1;
+    for (uint32_t size = std::max(current.extent.width, current.extent.height); size > 1 && current.levels < MAX_LEVELS; size /= 2)
+      current.levels++;
+
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = VK_FORMAT_R32_SFLOAT;
+    imageInfo.extent = {current.extent.width, current.extent.height, 1};
+    imageInfo.mipLevels = current.levels;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    allocator->createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, current.image, current.memory);
+
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = current.image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = VK_FORMAT_R32_SFLOAT;
+    viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, current.levels, 0, 1};
+    if (vkCreateImageView(device, &viewInfo, host->callbacks(VK_OBJECT_TYPE_IMAGE_VIEW), &current.view) != VK_SUCCESS)
+      throw std::runtime_error("failed to create depth pyramid view.");
+
+    current.levelViews.resize(current.levels);
+    for (uint32_t level = 0; level < current.levels; ++level)
+    {
+      viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1};
+      if (vkCreateImageView(device, &viewInfo, host->callbacks(VK_OBJECT_TYPE_IMAGE_VIEW), &current.levelViews[level]) != VK_SUCCESS)
+        throw std::runtime_error("failed to create depth pyramid level view.");
+    }
+
+    generation++;
+    built = false;
+  }
+
+  // Hands over the current images, frames in flight may still use them. Free them with destroy().
+  Images release()
+  {
+    Images old = current;
+    current = Images{};
+    return old;
+  }
+
+  void destroy(Images& images)
+  {
+    for (auto view : images.levelViews)
+      vkDestroyImageView(device, view, host->callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+    if (images.view != VK_NULL_HANDLE)
+      vkDestroyImageView(device, images.view, host->callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+    if (images.image != VK_NULL_HANDLE)
+      allocator->destroyImage(images.image, images.memory);
+    images = Images{};
+  }
+
+  // Records the build after the render pass that wrote the depth buffer. The render pass leaves the
+  // depth buffer in DEPTH_STENCIL_READ_ONLY_OPTIMAL and makes its writes visible to compute.
+  void build(VkCommandBuffer commandBuffer, uint32_t frameSlot)
+  {
+    Frame& frame = frames[frameSlot];
+    if (frame.generation != generation)
+      updateDescriptorSets(frame);
+
+    // The pyramid stays in GENERAL, it is written and sampled in turns. Waiting on compute also
+    // keeps this frame's culling pass from reading a level while it is rebuilt.
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.oldLayout = built ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = current.image;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, current.levels, 0, 1};
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &barrier);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    LevelConstants constants{};
+    constants.sourceSize[0] = static_cast<int32_t>(depthExtent.width);
+    constants.sourceSize[1] = static_cast<int32_t>(depthExtent.height);
+    for (uint32_t level = 0; level < current.levels; ++level)
+    {
+      constants.destinationSize[0] = static_cast<int32_t>(std::max(1u, current.extent.width >> level));
+      constants.destinationSize[1] = static_cast<int32_t>(std::max(1u, current.extent.height >> level));
+
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &frame.levelSets[level], 0, nullptr);
+      vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+      vkCmdDispatch(commandBuffer, (constants.destinationSize[0] + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE,
+                    (constants.destinationSize[1] + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1);
+
+      // The next level reads this one, the next frame's culling pass reads all of them
+      barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+      barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1};
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                           0, nullptr, 0, nullptr, 1, &barrier);
+
+      constants.sourceSize[0] = constants.destinationSize[0];
+      constants.sourceSize[1] = constants.destinationSize[1];
+    }
+    built = true;
+  }
+
+  // False until the first build after a resize, there is nothing to test against before that
+  bool isBuilt() const { return built; }
+  uint32_t getGeneration() const { return generation; }
+  uint32_t getLevels() const { return current.levels; }
+  VkExtent2D getExtent() const { return current.extent; }
+  VkExtent2D getDepthExtent() const { return depthExtent; }
+  VkImageView getView() const { return current.view; }
+  VkSampler getSampler() const { return sampler; }
+
+private:
+  // Matches the push constant block in hiz.comp
+  struct LevelConstants
+  {
+    int32_t sourceSize[2];
+    int32_t destinationSize[2];
+  };
+
+  struct Frame
+  {
+    std::vector<VkDescriptorSet> levelSets; // MAX_LEVELS, the first levels are used
+    uint32_t generation = 0;
+  };
+
+  void updateDescriptorSets(Frame& frame)
+  {
+    std::vector<VkDescriptorImageInfo> sources(current.levels), destinations(current.levels);
+    std::vector<VkWriteDescriptorSet> writes;
+    for (uint32_t level = 0; level < current.levels; ++level)
+    {
+      sources[level].sampler = sampler;
+      sources[level].imageView = level == 0 ? depthView : current.levelViews[level - 1];
+      sources[level].imageLayout = level == 0 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+      destinations[level].imageView = current.levelViews[level];
+      destinations[level].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+      VkWriteDescriptorSet write{};
+      write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      write.dstSet = frame.levelSets[level];
+      write.descriptorCount = 1;
+      write.dstBinding = 0;
+      write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+      write.pImageInfo = &sources[level];
+      writes.push_back(write);
+      write.dstBinding = 1;
+      write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+      write.pImageInfo = &destinations[level];
+      writes.push_back(write);
+    }
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+    frame.generation = generation;
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  DeviceMemoryAllocator* allocator = nullptr;
+  VkSampler sampler = VK_NULL_HANDLE;
+  VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+  VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+  std::vector<Frame> frames;
+
+  Images current;
+  VkImageView depthView = VK_NULL_HANDLE;
+  VkExtent2D depthExtent{};
+  uint32_t generation = 0;
+  bool built = false;
+};
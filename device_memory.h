@@ -0,0 +1,489 @@
+#pragma once
+
+// Device memory sub-allocator.
+//
+// vkAllocateMemory is slow and drivers cap the number of live allocations
+// (maxMemoryAllocationCount, often 4096), so resources are carved out of large blocks instead.
+// Each block is managed as a buddy allocator: sizes are rounded up to a power of two and a
+// block of size 2^n is always aligned to 2^n, which also takes care of the resource alignment.
+//
+// Linear resources (buffers, linear images) and optimal-tiling images never share a block,
+// which is the simple way of respecting bufferImageGranularity. Host visible blocks are
+// mapped once when they are created and stay mapped.
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include "host_allocator.h"
+
+enum class ResourceKind : uint32_t
+{
+  Linear = 0,  // Buffers and VK_IMAGE_TILING_LINEAR images
+  Optimal = 1, // VK_IMAGE_TILING_OPTIMAL images
+  Count
+};
+
+struct DeviceAllocation
+{
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;          // Size actually reserved (power of two for sub-allocations)
+  void* mapped = nullptr;         // Points at offset, null if the memory isn't host visible
+  uint32_t memoryType = 0;
+  ResourceKind kind = ResourceKind::Linear;
+  uint32_t block = 0;
+  uint32_t level = 0;
+  bool dedicated = false;
+};
+
+class DeviceMemoryAllocator
+{
+public:
+  static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64ull << 20;
+  static const VkDeviceSize MIN_ALLOCATION = 256;
+
+  void init(VkDevice device, HostAllocator& hostAllocator, VkPhysicalDevice physicalDevice)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    bufferImageGranularity = properties.limits.bufferImageGranularity;
+    nonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+
+    pools.resize(memoryProperties.memoryTypeCount * (uint32_t) ResourceKind::Count);
+    for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; ++type)
+    {
+      // Small heaps (e.g. the 256 MB BAR window) get smaller blocks so one block can't eat most of the heap
+      VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[type].heapIndex].size;
+      VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE;
+      while (blockSize > (1ull << 20) && blockSize > heapSize / 8)
+        blockSize >>= 1;
+
+      for (uint32_t kind = 0; kind < (uint32_t) ResourceKind::Count; ++kind)
+        pools[poolIndex(type, (ResourceKind) kind)].blockSize = blockSize;
+    }
+  }
+
+  void shutdown()
+  {
+    for (auto& pool : pools)
+    {
+      for (auto& block : pool.blocks)
+      {
+        if (block)
+          releaseBlock(*block);
+      }
+      pool.blocks.clear();
+    }
+    if (dedicatedCount)
+      std::cerr << "DeviceMemoryAllocator: " << dedicatedCount << " dedicated allocation(s) leaked" << std::endl;
+  }
+
+  uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0) const
+  {
+    // First try to get everything we'd like, then settle for what we need
+    for (VkMemoryPropertyFlags wanted : {required | preferred, required})
+    {
+      for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
+      {
+        if ((typeFilter & (1u << i)) && (memoryProperties.memoryTypes[i].propertyFlags & wanted) == wanted)
+          return i;
+      }
+    }
+    throw std::runtime_error("failed to find suitable memory type.");
+  }
+
+  DeviceAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags required,
+                            ResourceKind kind, VkMemoryPropertyFlags preferred = 0)
+  {
+    uint32_t type = findMemoryType(requirements.memoryTypeBits, required, preferred);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Pool& pool = pools[poolIndex(type, kind)];
+
+    VkDeviceSize size = roundUpPow2(std::max({requirements.size, requirements.alignment, MIN_ALLOCATION}));
+    // Lazily allocated memory gets its own object, vkGetDeviceMemoryCommitment then tells how much
+    // of that one attachment the driver had to back
+    if (size > pool.blockSize / 2 || isLazilyAllocated(type))
+      return allocateDedicated(requirements.size, type, kind);
+
+    for (uint32_t b = 0; b < pool.blocks.size(); ++b)
+    {
+      if (!pool.blocks[b])
+        continue;
+      DeviceAllocation allocation;
+      if (pool.blocks[b]->allocate(size, allocation))
+        return finishAllocation(allocation, *pool.blocks[b], b, type, kind);
+    }
+
+    // Nothing fits, grab another block. Reuse an empty slot in the list if there is one.
+    auto block = createBlock(pool.blockSize, type);
+    uint32_t b = 0;
+    while (b < pool.blocks.size() && pool.blocks[b])
+      ++b;
+    if (b == pool.blocks.size())
+      pool.blocks.emplace_back();
+    pool.blocks[b] = std::move(block);
+
+    DeviceAllocation allocation;
+    if (!pool.blocks[b]->allocate(size, allocation))
+      throw std::runtime_error("failed to sub-allocate from a fresh memory block.");
+    return finishAllocation(allocation, *pool.blocks[b], b, type, kind);
+  }
+
+  void free(DeviceAllocation& allocation)
+  {
+    if (allocation.memory == VK_NULL_HANDLE)
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (allocation.dedicated)
+    {
+      if (allocation.mapped)
+        vkUnmapMemory(device, allocation.memory);
+      vkFreeMemory(device, allocation.memory, host->callbacks(VK_OBJECT_TYPE_DEVICE_MEMORY));
+      dedicatedCount--;
+      dedicatedBytes -= allocation.size;
+      allocation = {};
+      return;
+    }
+
+    Pool& pool = pools[poolIndex(allocation.memoryType, allocation.kind)];
+    Block& block = *pool.blocks[allocation.block];
+    block.free(allocation.offset, allocation.level);
+
+    // Keep one empty block per pool around so an allocate/free pattern at a block boundary
+    // doesn't hit vkAllocateMemory every frame.
+    if (block.usedBytes == 0)
+    {
+      size_t emptyBlocks = 0;
+      for (const auto& other : pool.blocks)
+        emptyBlocks += other && other->usedBytes == 0;
+      if (emptyBlocks > 1)
+      {
+        releaseBlock(block);
+        pool.blocks[allocation.block].reset();
+      }
+    }
+    allocation = {};
+  }
+
+  // Convenience wrappers that create the resource, allocate and bind in one go
+
+  void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+                    VkBuffer& buffer, DeviceAllocation& allocation, VkMemoryPropertyFlags preferred = 0)
+  {
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (vkCreateBuffer(device, &bufferInfo, host->callbacks(VK_OBJECT_TYPE_BUFFER), &buffer) != VK_SUCCESS)
+      throw std::runtime_error("failed to create buffer.");
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+    allocation = allocate(requirements, properties, ResourceKind::Linear, preferred);
+    vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+  }
+
+  void createImage(const VkImageCreateInfo& imageInfo, VkMemoryPropertyFlags properties,
+                   VkImage& image, DeviceAllocation& allocation, VkMemoryPropertyFlags preferred = 0)
+  {
+    if (vkCreateImage(device, &imageInfo, host->callbacks(VK_OBJECT_TYPE_IMAGE), &image) != VK_SUCCESS)
+      throw std::runtime_error("failed to create image.");
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+    ResourceKind kind = imageInfo.tiling == VK_IMAGE_TILING_OPTIMAL ? ResourceKind::Optimal : ResourceKind::Linear;
+    allocation = allocate(requirements, properties, kind, preferred);
+    vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+  }
+
+  void destroyBuffer(VkBuffer& buffer, DeviceAllocation& allocation)
+  {
+    vkDestroyBuffer(device, buffer, host->callbacks(VK_OBJECT_TYPE_BUFFER));
+    free(allocation);
+    buffer = VK_NULL_HANDLE;
+  }
+
+  void destroyImage(VkImage& image, DeviceAllocation& allocation)
+  {
+    vkDestroyImage(device, image, host->callbacks(VK_OBJECT_TYPE_IMAGE));
+    free(allocation);
+    image = VK_NULL_HANDLE;
+  }
+
+  // Needed for host visible memory without HOST_COHERENT
+  void flush(const DeviceAllocation& allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) const
+  {
+    if (!allocation.mapped || isCoherent(allocation.memoryType))
+      return;
+
+    VkMappedMemoryRange range{};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = allocation.memory;
+    range.offset = (allocation.offset + offset) / nonCoherentAtomSize * nonCoherentAtomSize;
+    VkDeviceSize end = size == VK_WHOLE_SIZE ? allocation.offset + allocation.size : allocation.offset + offset + size;
+    range.size = ((end - range.offset + nonCoherentAtomSize - 1) / nonCoherentAtomSize) * nonCoherentAtomSize;
+    vkFlushMappedMemoryRanges(device, 1, &range);
+  }
+
+  bool isCoherent(uint32_t memoryType) const
+  {
+    return memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  }
+
+  // Transient attachments only get physical pages on first use when this is true, see createDepthResources
+  bool isLazilyAllocated(uint32_t memoryType) const
+  {
+    return memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+  }
+
+  struct Stats
+  {
+    uint64_t blocks = 0;
+    uint64_t allocations = 0;
+    VkDeviceSize reservedBytes = 0;  // Taken from the driver
+    VkDeviceSize usedBytes = 0;      // Handed out to resources (power of two rounded)
+    VkDeviceSize freeBytes = 0;
+    VkDeviceSize largestFreeBlock = 0;
+    uint64_t dedicatedAllocations = 0;
+    VkDeviceSize dedicatedBytes = 0;
+
+    // 0 when all free space is one contiguous range, towards 1 as it splinters
+    double fragmentation() const
+    {
+      return freeBytes ? 1.0 - (double) largestFreeBlock / freeBytes : 0.0;
+    }
+  };
+
+  Stats stats() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats result{};
+    for (const auto& pool : pools)
+      accumulate(pool, result);
+    result.dedicatedAllocations = dedicatedCount;
+    result.dedicatedBytes = dedicatedBytes;
+    return result;
+  }
+
+  void printStats(std::ostream& out) const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "Device memory (bufferImageGranularity " << bufferImageGranularity << ")\n";
+    for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; ++type)
+    {
+      for (uint32_t kind = 0; kind < (uint32_t) ResourceKind::Count; ++kind)
+      {
+        Stats poolStats{};
+        accumulate(pools[poolIndex(type, (ResourceKind) kind)], poolStats);
+        if (!poolStats.blocks)
+          continue;
+
+        out << "  type " << type << (kind == (uint32_t) ResourceKind::Optimal ? " optimal" : " linear ")
+            << ": " << poolStats.blocks << " block(s), " << poolStats.allocations << " allocation(s), "
+            << std::fixed << std::setprecision(2)
+            << poolStats.usedBytes / 1048576.0 << " / " << poolStats.reservedBytes / 1048576.0 << " MiB used, "
+            << "largest free " << poolStats.largestFreeBlock / 1048576.0 << " MiB, "
+            << "fragmentation " << 100.0 * poolStats.fragmentation() << "%" << std::defaultfloat << "\n";
+      }
+    }
+    out << "  dedicated: " << dedicatedCount << " allocation(s), " << dedicatedBytes / 1048576.0 << " MiB" << std::endl;
+  }
+
+private:
+  struct Block
+  {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr;
+    uint32_t levels = 0;                             // Level 0 is the whole block, every level halves the size
+    std::vector<std::set<VkDeviceSize>> freeLists;   // Free offsets per level
+    VkDeviceSize usedBytes = 0;
+    uint64_t allocations = 0;
+
+    VkDeviceSize levelSize(uint32_t level) const { return size >> level; }
+
+    bool allocate(VkDeviceSize request, DeviceAllocation& allocation)
+    {
+      uint32_t target = 0;
+      while (target + 1 < levels && levelSize(target + 1) >= request)
+        ++target;
+
+      // Smallest free range that is still big enough, then split it down to the target size
+      int level = (int) target;
+      while (level >= 0 && freeLists[level].empty())
+        --level;
+      if (level < 0)
+        return false;
+
+      VkDeviceSize offset = *freeLists[level].begin();
+      freeLists[level].erase(freeLists[level].begin());
+      for (uint32_t l = (uint32_t) level; l < target; ++l)
+        freeLists[l + 1].insert(offset + levelSize(l + 1));
+
+      usedBytes += levelSize(target);
+      allocations++;
+      allocation.offset = offset;
+      allocation.size = levelSize(target);
+      allocation.level = target;
+      return true;
+    }
+
+    void free(VkDeviceSize offset, uint32_t level)
+    {
+      usedBytes -= levelSize(level);
+      allocations--;
+
+      // Merge with the buddy as long as it is free too
+      while (level > 0)
+      {
+        VkDeviceSize buddy = offset ^ levelSize(level);
+        auto it = freeLists[level].find(buddy);
+        if (it == freeLists[level].end())
+          break;
+        freeLists[level].erase(it);
+        offset = std::min(offset, buddy);
+        --level;
+      }
+      freeLists[level].insert(offset);
+    }
+
+    VkDeviceSize largestFree() const
+    {
+      for (uint32_t level = 0; level < levels; ++level)
+      {
+        if (!freeLists[level].empty())
+          return levelSize(level);
+      }
+      return 0;
+    }
+  };
+
+  struct Pool
+  {
+    VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE;
+    std::vector<std::unique_ptr<Block>> blocks; // Null entries are released blocks
+  };
+
+  uint32_t poolIndex(uint32_t type, ResourceKind kind) const
+  {
+    return type * (uint32_t) ResourceKind::Count + (uint32_t) kind;
+  }
+
+  bool isHostVisible(uint32_t type) const
+  {
+    return memoryProperties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+  }
+
+  static VkDeviceSize roundUpPow2(VkDeviceSize value)
+  {
+    VkDeviceSize result = 1;
+    while (result < value)
+      result <<= 1;
+    return result;
+  }
+
+  std::unique_ptr<Block> createBlock(VkDeviceSize size, uint32_t type)
+  {
+    auto block = std::make_unique<Block>();
+    block->size = size;
+
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = type;
+    if (vkAllocateMemory(device, &allocInfo, host->callbacks(VK_OBJECT_TYPE_DEVICE_MEMORY), &block->memory) != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate device memory block.");
+
+    if (isHostVisible(type) && vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped) != VK_SUCCESS)
+      throw std::runtime_error("failed to map device memory block.");
+
+    while ((size >> block->levels) >= MIN_ALLOCATION)
+      block->levels++;
+    block->freeLists.resize(block->levels);
+    block->freeLists[0].insert(0);
+    return block;
+  }
+
+  void releaseBlock(Block& block)
+  {
+    if (block.mapped)
+      vkUnmapMemory(device, block.memory);
+    vkFreeMemory(device, block.memory, host->callbacks(VK_OBJECT_TYPE_DEVICE_MEMORY));
+    block.memory = VK_NULL_HANDLE;
+  }
+
+  DeviceAllocation finishAllocation(DeviceAllocation allocation, const Block& block, uint32_t blockIndex,
+                                    uint32_t type, ResourceKind kind)
+  {
+    allocation.memory = block.memory;
+    allocation.mapped = block.mapped ? static_cast<char*>(block.mapped) + allocation.offset : nullptr;
+    allocation.memoryType = type;
+    allocation.kind = kind;
+    allocation.block = blockIndex;
+    return allocation;
+  }
+
+  // Big resources (render targets etc.) get their own vkAllocateMemory
+  DeviceAllocation allocateDedicated(VkDeviceSize size, uint32_t type, ResourceKind kind)
+  {
+    DeviceAllocation allocation;
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = type;
+    if (vkAllocateMemory(device, &allocInfo, host->callbacks(VK_OBJECT_TYPE_DEVICE_MEMORY), &allocation.memory) != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate dedicated device memory.");
+
+    if (isHostVisible(type) && vkMapMemory(device, allocation.memory, 0, VK_WHOLE_SIZE, 0, &allocation.mapped) != VK_SUCCESS)
+      throw std::runtime_error("failed to map dedicated device memory.");
+
+    allocation.size = size;
+    allocation.memoryType = type;
+    allocation.kind = kind;
+    allocation.dedicated = true;
+    dedicatedCount++;
+    dedicatedBytes += size;
+    return allocation;
+  }
+
+  static void accumulate(const Pool& pool, Stats& stats)
+  {
+    for (const auto& block : pool.blocks)
+    {
+      if (!block)
+        continue;
+      stats.blocks++;
+      stats.allocations += block->allocations;
+      stats.reservedBytes += block->size;
+      stats.usedBytes += block->usedBytes;
+      stats.freeBytes += block->size - block->usedBytes;
+      stats.largestFreeBlock = std::max(stats.largestFreeBlock, block->largestFree());
+    }
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  VkPhysicalDeviceMemoryProperties memoryProperties{};
+  VkDeviceSize bufferImageGranularity = 1;
+  VkDeviceSize nonCoherentAtomSize = 1;
+  std::vector<Pool> pools; // Indexed by poolIndex(memory type, resource kind)
+  uint64_t dedicatedCount = 0;
+  VkDeviceSize dedicatedBytes = 0;
+  mutable std::mutex mutex;
+};
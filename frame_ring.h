@@ -0,0 +1,216 @@
+#pragma once
+
+// Per frame shader data: the camera and the objects.
+//
+// Every frame in flight has its own buffer in host visible memory that stays mapped for its
+// whole life. When a frame starts, the slot's previous frame has finished, so the GPU is done
+// with the buffer and the frame rewinds it to the start. The CPU writes straight into the
+// mapping and the shaders find the data through dynamic offsets into the buffer's descriptor
+// set. Nothing is allocated, mapped or unmapped per frame.
+//
+// A frame that needs more than its buffer holds gets one twice the size. The bytes written
+// so far are copied over and the set is pointed at the new buffer, so offsets handed out
+// earlier stay valid. That is only allowed while the set isn't bound yet: a frame allocates
+// everything it needs before it records bind().
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "host_allocator.h"
+#include "device_memory.h"
+
+class FrameRing
+{
+public:
+  struct Allocation
+  {
+    void* data;      // Mapped, write only
+    uint32_t offset; // The dynamic offset for bind()
+  };
+
+  struct Stats
+  {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t peakFrameBytes = 0;
+    uint64_t grows = 0;
+  };
+
+  // Binding 0 is a uniform block of uniformRange bytes, binding 1 a storage buffer reaching to
+  // the end of the frame's buffer. Both take a dynamic offset.
+  void init(VkDevice device, HostAllocator& hostAllocator, DeviceMemoryAllocator& allocator, VkPhysicalDevice physicalDevice,
+            VkDeviceSize initialSize, VkDeviceSize uniformRange, uint32_t framesInFlight)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    this->allocator = &allocator;
+    this->uniformRange = uniformRange;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    alignment = std::max(properties.limits.minUniformBufferOffsetAlignment, properties.limits.minStorageBufferOffsetAlignment);
+
+    VkDescriptorSetLayoutBinding bindings[2]{};
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    bindings[1].descriptorCount = 1;
+    bindings[1].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 2;
+    layoutInfo.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT), &setLayout) != VK_SUCCESS)
+      throw std::runtime_error("failed to create frame ring descriptor set layout.");
+
+    VkDescriptorPoolSize poolSizes[] = {
+      {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, framesInFlight},
+      {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, framesInFlight},
+    };
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = framesInFlight;
+    poolInfo.poolSizeCount = 2;
+    poolInfo.pPoolSizes = poolSizes;
+    if (vkCreateDescriptorPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL), &pool) != VK_SUCCESS)
+      throw std::runtime_error("failed to create frame ring descriptor pool.");
+
+    frames.resize(framesInFlight);
+    for (auto& frame : frames)
+    {
+      VkDescriptorSetAllocateInfo allocInfo{};
+      allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+      allocInfo.descriptorPool = pool;
+      allocInfo.descriptorSetCount = 1;
+      allocInfo.pSetLayouts = &setLayout;
+      if (vkAllocateDescriptorSets(device, &allocInfo, &frame.set) != VK_SUCCESS)
+        throw std::runtime_error("failed to allocate frame ring descriptor set.");
+      createBuffer(frame, std::max(initialSize, uniformRange));
+    }
+  }
+
+  void shutdown()
+  {
+    for (auto& frame : frames)
+      allocator->destroyBuffer(frame.buffer, frame.memory);
+    frames.clear();
+    vkDestroyDescriptorPool(device, pool, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL));
+    vkDestroyDescriptorSetLayout(device, setLayout, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT));
+  }
+
+  // The slot's previous frame must have finished
+  void beginFrame(uint32_t slot)
+  {
+    current = slot;
+    frames[slot].head = 0;
+    stats.frames++;
+  }
+
+  Allocation allocate(VkDeviceSize size)
+  {
+    Frame& frame = frames[current];
+    VkDeviceSize offset = (frame.head + alignment - 1) / alignment * alignment;
+    // The uniform binding always reads uniformRange bytes from the offset
+    VkDeviceSize end = offset + std::max(size, uniformRange);
+    if (end > frame.size)
+      grow(frame, std::max(2 * frame.size, end));
+
+    frame.head = offset + size;
+    stats.bytes += size;
+    stats.peakFrameBytes = std::max<uint64_t>(stats.peakFrameBytes, frame.head);
+    return {static_cast<char*>(frame.memory.mapped) + offset, static_cast<uint32_t>(offset)};
+  }
+
+  template <typename T>
+  T* allocate(uint32_t count, uint32_t& offset)
+  {
+    Allocation allocation = allocate(sizeof(T) * count);
+    offset = allocation.offset;
+    return static_cast<T*>(allocation.data);
+  }
+
+  void bind(VkCommandBuffer commandBuffer, VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t setIndex,
+            uint32_t uniformOffset, uint32_t storageOffset) const
+  {
+    uint32_t offsets[] = {uniformOffset, storageOffset};
+    vkCmdBindDescriptorSets(commandBuffer, bindPoint, layout, setIndex, 1, &frames[current].set, 2, offsets);
+  }
+
+  VkDescriptorSetLayout getSetLayout() const { return setLayout; }
+  const Stats& getStats() const { return stats; }
+
+  void printStats(std::ostream& out) const
+  {
+    VkDeviceSize capacity = 0;
+    for (const auto& frame : frames)
+      capacity += frame.size;
+    out << "Frame ring (" << frames.size() << " buffers, " << capacity / 1024 << " KiB): "
+        << (stats.frames ? stats.bytes / stats.frames : 0) << " bytes per frame on average, "
+        << stats.peakFrameBytes << " at most, " << stats.grows << " grow(s)" << std::endl;
+  }
+
+private:
+  struct Frame
+  {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    DeviceAllocation memory;
+    VkDeviceSize size = 0;
+    VkDeviceSize head = 0;
+    VkDescriptorSet set = VK_NULL_HANDLE;
+  };
+
+  void createBuffer(Frame& frame, VkDeviceSize size)
+  {
+    allocator->createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                            frame.buffer, frame.memory);
+    frame.size = size;
+
+    VkDescriptorBufferInfo uniformInfo{frame.buffer, 0, uniformRange};
+    VkDescriptorBufferInfo storageInfo{frame.buffer, 0, VK_WHOLE_SIZE};
+    VkWriteDescriptorSet writes[2]{};
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = frame.set;
+      writes[i].dstBinding = i;
+      writes[i].descriptorCount = 1;
+    }
+    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    writes[0].pBufferInfo = &uniformInfo;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    writes[1].pBufferInfo = &storageInfo;
+    vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+  }
+
+  // Nothing of this frame is recorded yet and the GPU finished the last frame that used the
+  // old buffer, so it can go right away
+  void grow(Frame& frame, VkDeviceSize size)
+  {
+    VkBuffer oldBuffer = frame.buffer;
+    DeviceAllocation oldMemory = frame.memory;
+    createBuffer(frame, size);
+    std::memcpy(frame.memory.mapped, oldMemory.mapped, frame.head);
+    allocator->destroyBuffer(oldBuffer, oldMemory);
+    stats.grows++;
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  DeviceMemoryAllocator* allocator = nullptr;
+  VkDeviceSize alignment = 256;
+  VkDeviceSize uniformRange = 0;
+  VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+  VkDescriptorPool pool = VK_NULL_HANDLE;
+  std::vector<Frame> frames;
+  uint32_t current = 0;
+  Stats stats;
+};
@@ -0,0 +1,316 @@
+#pragma once
+
+// Frustum culling on the GPU.
+//
+// A compute pass tests one bounding sphere per object against the frustum planes of a
+// view-projection matrix and appends a VkDrawIndexedIndirectCommand for every object that
+// survives. The draw count is bumped with an atomic, so the commands are compacted and the
+// frame draws them with a single vkCmdDrawIndexedIndirectCount. The CPU never looks at the
+// objects, its cost per frame is the same for ten objects as for a million.
+//
+// Objects that pass the frustum test are then tested against the depth pyramid built from the
+// previous frame (see depth_pyramid.h). The test uses this frame's camera on last frame's depth,
+// so while the camera moves an object that just came out from behind something can be missing
+// for a frame.
+//
+// Every frame in flight has its own draw buffer, the compute pass of one frame can't
+// overwrite the commands an earlier frame is still drawing from. How many objects were drawn
+// and culled is copied back to the host along with the draw count.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+
+#include "host_allocator.h"
+#include "device_memory.h"
+#include "depth_pyramid.h"
+
+class GpuCuller
+{
+public:
+  // Matches the buffers in cull.comp. The draw count and the Stats counters live in the first
+  // 16 bytes of the draw buffer, the commands follow.
+  static const VkDeviceSize COUNT_OFFSET = 0;
+  static const VkDeviceSize COMMANDS_OFFSET = 16;
+  static const uint32_t WORKGROUP_SIZE = 64;
+
+  // Matches the push constant block in cull.comp, the frustum planes are taken from the matrix there
+  struct Constants
+  {
+    glm::mat4 viewProjection;
+    uint32_t objectCount;
+    uint32_t pyramidLevels; // 0 skips the occlusion test
+    float depthSize[2];     // Of the depth buffer the pyramid was built from
+  };
+
+  struct Stats
+  {
+    uint32_t drawn = 0;
+    uint32_t frustumCulled = 0;
+    uint32_t occlusionCulled = 0;
+  };
+
+  // The shader module still belongs to the caller
+  void init(VkDevice device, HostAllocator& hostAllocator, DeviceMemoryAllocator& allocator, VkShaderModule cullShader,
+            VkPipelineCache pipelineCache, uint32_t framesInFlight)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    this->allocator = &allocator;
+
+    VkDescriptorSetLayoutBinding bindings[3]{};
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+      bindings[i].binding = i; // 0 is the object bounds, 1 the draw buffer, 2 the depth pyramid
+      bindings[i].descriptorType = i == 2 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      bindings[i].descriptorCount = 1;
+      bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 3;
+    layoutInfo.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT), &setLayout) != VK_SUCCESS)
+      throw std::runtime_error("failed to create culling descriptor set layout.");
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(Constants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &setLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, host->callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT), &pipelineLayout) != VK_SUCCESS)
+      throw std::runtime_error("failed to create culling pipeline layout.");
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = cullShader;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = pipelineLayout;
+    if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, host->callbacks(VK_OBJECT_TYPE_PIPELINE), &pipeline) != VK_SUCCESS)
+      throw std::runtime_error("failed to create culling pipeline.");
+
+    VkDescriptorPoolSize poolSizes[2]{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[0].descriptorCount = 2 * framesInFlight;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[1].descriptorCount = framesInFlight;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = framesInFlight;
+    poolInfo.poolSizeCount = 2;
+    poolInfo.pPoolSizes = poolSizes;
+    if (vkCreateDescriptorPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL), &descriptorPool) != VK_SUCCESS)
+      throw std::runtime_error("failed to create culling descriptor pool.");
+
+    frames.resize(framesInFlight);
+    std::vector<VkDescriptorSetLayout> layouts(framesInFlight, setLayout);
+    std::vector<VkDescriptorSet> sets(framesInFlight);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = framesInFlight;
+    allocInfo.pSetLayouts = layouts.data();
+    if (vkAllocateDescriptorSets(device, &allocInfo, sets.data()) != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate culling descriptor sets.");
+    for (uint32_t i = 0; i < framesInFlight; ++i)
+      frames[i].descriptorSet = sets[i];
+  }
+
+  void shutdown()
+  {
+    releaseFrameBuffers();
+    frames.clear();
+    vkDestroyDescriptorPool(device, descriptorPool, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL));
+    vkDestroyPipeline(device, pipeline, host->callbacks(VK_OBJECT_TYPE_PIPELINE));
+    vkDestroyPipelineLayout(device, pipelineLayout, host->callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT));
+    vkDestroyDescriptorSetLayout(device, setLayout, host->callbacks(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT));
+  }
+
+  // Points the culling pass at objectCount vec4 bounding spheres (xyz center, w radius) and sizes the
+  // draw buffers for the worst case where everything is visible. The GPU must be done with the old ones.
+  void setObjects(VkBuffer boundsBuffer, uint32_t objectCount)
+  {
+    releaseFrameBuffers();
+    this->objectCount = objectCount;
+
+    VkDeviceSize drawBufferSize = COMMANDS_OFFSET + sizeof(VkDrawIndexedIndirectCommand) * std::max(1u, objectCount);
+    for (auto& frame : frames)
+    {
+      allocator->createBuffer(drawBufferSize,
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.drawBuffer, frame.drawMemory);
+      // The counters are copied here at the end of every frame, for statistics only
+      allocator->createBuffer(COMMANDS_OFFSET, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                              frame.readbackBuffer, frame.readbackMemory);
+      std::memset(frame.readbackMemory.mapped, 0, COMMANDS_OFFSET);
+
+      VkDescriptorBufferInfo bufferInfos[2]{};
+      bufferInfos[0].buffer = boundsBuffer;
+      bufferInfos[0].range = VK_WHOLE_SIZE;
+      bufferInfos[1].buffer = frame.drawBuffer;
+      bufferInfos[1].range = VK_WHOLE_SIZE;
+
+      VkWriteDescriptorSet writes[2]{};
+      for (uint32_t i = 0; i < 2; ++i)
+      {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = frame.descriptorSet;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[i].pBufferInfo = &bufferInfos[i];
+      }
+      vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+    }
+  }
+
+  // Every frame is tested against this pyramid. It has to be set before the first record().
+  void setDepthPyramid(const DepthPyramid& pyramid) { this->pyramid = &pyramid; }
+
+  // Records the culling pass, outside of any render pass. Leaves the draw buffer of frameSlot
+  // ready to be read by draw(). Without occlusion only the frustum is tested.
+  void record(VkCommandBuffer commandBuffer, uint32_t frameSlot, const glm::mat4& viewProjection, bool occlusion)
+  {
+    Frame& frame = frames[frameSlot];
+    if (frame.pyramidGeneration != pyramid->getGeneration())
+      updatePyramidDescriptor(frame);
+
+    vkCmdFillBuffer(commandBuffer, frame.drawBuffer, COUNT_OFFSET, COMMANDS_OFFSET, 0);
+
+    // The pyramid was built by the previous frame on the same queue
+    VkMemoryBarrier clearBarrier{};
+    clearBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    clearBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &clearBarrier, 0, nullptr, 0, nullptr);
+
+    Constants constants{};
+    constants.viewProjection = viewProjection;
+    constants.objectCount = objectCount;
+    constants.pyramidLevels = occlusion && pyramid->isBuilt() ? pyramid->getLevels() : 0;
+    constants.depthSize[0] = static_cast<float>(pyramid->getDepthExtent().width);
+    constants.depthSize[1] = static_cast<float>(pyramid->getDepthExtent().height);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &frame.descriptorSet, 0, nullptr);
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(commandBuffer, (objectCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+
+    VkMemoryBarrier drawBarrier{};
+    drawBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    drawBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    drawBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         1, &drawBarrier, 0, nullptr, 0, nullptr);
+  }
+
+  // Draws whatever survived culling in frameSlot. Pipeline, vertex and index buffers are up to the caller,
+  // every command draws one instance, the object index is its firstInstance.
+  void draw(VkCommandBuffer commandBuffer, uint32_t frameSlot) const
+  {
+    const Frame& frame = frames[frameSlot];
+    vkCmdDrawIndexedIndirectCount(commandBuffer, frame.drawBuffer, COMMANDS_OFFSET, frame.drawBuffer, COUNT_OFFSET,
+                                  objectCount, sizeof(VkDrawIndexedIndirectCommand));
+  }
+
+  // Copies the counters to host memory, outside of the render pass after the draws
+  void recordReadback(VkCommandBuffer commandBuffer, uint32_t frameSlot)
+  {
+    Frame& frame = frames[frameSlot];
+    VkBufferCopy region{COUNT_OFFSET, 0, COMMANDS_OFFSET};
+    vkCmdCopyBuffer(commandBuffer, frame.drawBuffer, frame.readbackBuffer, 1, &region);
+
+    VkMemoryBarrier hostBarrier{};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         1, &hostBarrier, 0, nullptr, 0, nullptr);
+  }
+
+  // What the last frame that ran in frameSlot drew and culled, valid once that frame has completed
+  Stats getStats(uint32_t frameSlot) const
+  {
+    const uint32_t* counters = static_cast<const uint32_t*>(frames[frameSlot].readbackMemory.mapped);
+    Stats stats;
+    stats.drawn = counters[0];
+    stats.frustumCulled = counters[1];
+    stats.occlusionCulled = counters[2];
+    return stats;
+  }
+
+  uint32_t getObjectCount() const { return objectCount; }
+
+private:
+  struct Frame
+  {
+    VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+    VkBuffer drawBuffer = VK_NULL_HANDLE;
+    DeviceAllocation drawMemory;
+    VkBuffer readbackBuffer = VK_NULL_HANDLE;
+    DeviceAllocation readbackMemory;
+    uint32_t pyramidGeneration = 0; // The pyramid images the descriptor set points at
+  };
+
+  // Only called once the frame slot's previous frame is done with the set
+  void updatePyramidDescriptor(Frame& frame)
+  {
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.sampler = pyramid->getSampler();
+    imageInfo.imageView = pyramid->getView();
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = frame.descriptorSet;
+    write.dstBinding = 2;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &imageInfo;
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    frame.pyramidGeneration = pyramid->getGeneration();
+  }
+
+  void releaseFrameBuffers()
+  {
+    for (auto& frame : frames)
+    {
+      if (frame.drawBuffer != VK_NULL_HANDLE)
+        allocator->destroyBuffer(frame.drawBuffer, frame.drawMemory);
+      if (frame.readbackBuffer != VK_NULL_HANDLE)
+        allocator->destroyBuffer(frame.readbackBuffer, frame.readbackMemory);
+      frame.drawBuffer = VK_NULL_HANDLE;
+      frame.readbackBuffer = VK_NULL_HANDLE;
+    }
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  DeviceMemoryAllocator* allocator = nullptr;
+  VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+  VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+  std::vector<Frame> frames;
+  const DepthPyramid* pyramid = nullptr;
+  uint32_t objectCount = 0;
+};
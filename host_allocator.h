@@ -0,0 +1,379 @@
+#pragma once
+
+// Host memory for the Vulkan loader, layers and driver (VkAllocationCallbacks).
+//
+// The callbacks don't say which kind of object an allocation belongs to, so there is one set of
+// callbacks per object type, each with its own counters as pUserData. A create call and the
+// matching destroy call have to pass the same set, callbacks(type) always returns it.
+//
+// Where the memory comes from depends on the allocation scope:
+// - COMMAND allocations only live for one vk call. They are bumped out of a per thread arena
+//   that starts over whenever everything in it has been freed, which is after every call.
+// - Everything else lives as long as an object, a cache, a device or the instance. Up to 8 KiB
+//   it comes from size class pools that keep freed blocks on a free list, above that and for
+//   alignments above 16 from the system.
+//
+// Every allocation carries a 16 byte header with its size, scope, type and where it came from,
+// so frees and reallocations find their way back without a lookup.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+class HostAllocator
+{
+public:
+  static constexpr uint32_t SCOPE_COUNT = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+  // Counted per scope and per object type
+  struct Counters
+  {
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    uint64_t bytes = 0;     // Allocated in total, the churn
+    uint64_t liveBytes = 0;
+    uint64_t peakBytes = 0;
+  };
+
+  // A copy of every counter, subtract two to get what happened in between
+  struct Snapshot
+  {
+    Counters scopes[SCOPE_COUNT];
+    Counters internal; // Driver allocations it only reports, e.g. executable memory
+    Counters total;
+  };
+
+  HostAllocator()
+  {
+    for (auto& arena : pools)
+      arena = std::make_unique<Pool>();
+  }
+
+  ~HostAllocator()
+  {
+    for (auto& pool : pools)
+    {
+      for (void* chunk : pool->chunks)
+        std::free(chunk);
+    }
+  }
+
+  HostAllocator(const HostAllocator&) = delete;
+  HostAllocator& operator=(const HostAllocator&) = delete;
+
+  const VkAllocationCallbacks* callbacks(VkObjectType type)
+  {
+    std::lock_guard<std::mutex> lock(typesMutex);
+    for (auto& entry : types)
+    {
+      if (entry->type == type)
+        return &entry->callbacks;
+    }
+    if (types.size() == MAX_TYPES)
+      throw std::runtime_error("too many object types for the host allocator.");
+
+    auto entry = std::make_unique<TypeEntry>();
+    entry->owner = this;
+    entry->type = type;
+    entry->index = static_cast<uint8_t>(types.size());
+    entry->callbacks.pUserData = entry.get();
+    entry->callbacks.pfnAllocation = allocation;
+    entry->callbacks.pfnReallocation = reallocation;
+    entry->callbacks.pfnFree = free;
+    entry->callbacks.pfnInternalAllocation = internalAllocation;
+    entry->callbacks.pfnInternalFree = internalFree;
+    types.push_back(std::move(entry));
+    return &types.back()->callbacks;
+  }
+
+  Snapshot snapshot() const
+  {
+    std::lock_guard<std::mutex> lock(countersMutex);
+    return counters;
+  }
+
+  // What the loader, layers and driver allocated: since startup when given the snapshot taken
+  // after initVulkan, and per frame over the frames since then
+  void printStats(std::ostream& out, const Snapshot& startup, uint64_t framesSinceStartup) const
+  {
+    std::lock_guard<std::mutex> lock(countersMutex);
+    static const char* scopeNames[SCOPE_COUNT] = {"command", "object", "cache", "device", "instance"};
+    auto perFrame = [&](uint64_t now, uint64_t then) {
+      return framesSinceStartup ? static_cast<double>(now - then) / framesSinceStartup : 0.0;
+    };
+
+    out << "Host allocations (" << counters.total.liveBytes / 1024 << " KiB live, " << counters.total.peakBytes / 1024
+        << " KiB peak), at startup and per frame after it:\n";
+    out << std::fixed << std::setprecision(1);
+    for (uint32_t i = 0; i < SCOPE_COUNT; ++i)
+    {
+      const Counters& now = counters.scopes[i];
+      const Counters& then = startup.scopes[i];
+      out << "  " << std::left << std::setw(10) << scopeNames[i] << std::right
+          << std::setw(8) << then.allocations << " allocations " << std::setw(10) << then.bytes / 1024 << " KiB | "
+          << std::setw(8) << perFrame(now.allocations, then.allocations) << " allocations "
+          << std::setw(8) << perFrame(now.bytes, then.bytes) << " bytes\n";
+    }
+    out << "  " << std::left << std::setw(10) << "internal" << std::right << std::setw(8) << counters.internal.allocations
+        << " notifications, " << counters.internal.liveBytes / 1024 << " KiB live\n";
+
+    std::lock_guard<std::mutex> typesLock(typesMutex);
+    out << "  by object type (all time):";
+    for (const auto& entry : types)
+    {
+      out << "\n    " << std::left << std::setw(22) << objectTypeName(entry->type) << std::right
+          << std::setw(8) << entry->counters.allocations << " allocations " << std::setw(10) << entry->counters.bytes / 1024
+          << " KiB, " << std::setw(8) << entry->counters.liveBytes / 1024 << " KiB live";
+    }
+    out << std::defaultfloat << std::endl;
+  }
+
+  static const char* objectTypeName(VkObjectType type)
+  {
+    switch (type)
+    {
+      case VK_OBJECT_TYPE_INSTANCE:                  return "instance";
+      case VK_OBJECT_TYPE_DEVICE:                    return "device";
+      case VK_OBJECT_TYPE_SURFACE_KHR:               return "surface";
+      case VK_OBJECT_TYPE_SWAPCHAIN_KHR:             return "swapchain";
+      case VK_OBJECT_TYPE_DEBUG_UTILS_MESSENGER_EXT: return "debug messenger";
+      case VK_OBJECT_TYPE_BUFFER:                    return "buffer";
+      case VK_OBJECT_TYPE_IMAGE_VIEW:                return "image view";
+      case VK_OBJECT_TYPE_DEVICE_MEMORY:             return "device memory";
+      case VK_OBJECT_TYPE_SHADER_MODULE:             return "shader module";
+      case VK_OBJECT_TYPE_PIPELINE_CACHE:            return "pipeline cache";
+      case VK_OBJECT_TYPE_PIPELINE_LAYOUT:           return "pipeline layout";
+      case VK_OBJECT_TYPE_RENDER_PASS:               return "render pass";
+      case VK_OBJECT_TYPE_FRAMEBUFFER:               return "framebuffer";
+      case VK_OBJECT_TYPE_COMMAND_POOL:              return "command pool";
+      case VK_OBJECT_TYPE_SEMAPHORE:                 return "semaphore";
+      case VK_OBJECT_TYPE_FENCE:                     return "fence";
+      case VK_OBJECT_TYPE_DESCRIPTOR_POOL:           return "descriptor pool";
+      default:                                       return "other";
+    }
+  }
+
+private:
+  static constexpr size_t MAX_TYPES = 64;
+  static constexpr size_t HEADER_SIZE = 16;
+  static constexpr size_t CLASS_COUNT = 9; // 32 bytes to 8 KiB blocks, the header included
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+  static constexpr size_t ARENA_SIZE = 256 * 1024;
+
+  enum Source : uint16_t
+  {
+    SYSTEM = 0xfffe,
+    ARENA = 0xffff // Below that it is a size class
+  };
+
+  struct Header
+  {
+    uint64_t size;
+    uint32_t offset; // From the start of the block to the allocation
+    uint16_t source;
+    uint8_t scope;
+    uint8_t type;
+  };
+  static_assert(sizeof(Header) == HEADER_SIZE);
+
+  struct TypeEntry
+  {
+    HostAllocator* owner;
+    VkObjectType type;
+    uint8_t index;
+    VkAllocationCallbacks callbacks{};
+    Counters counters; // Guarded by the owner's countersMutex
+  };
+
+  struct Pool
+  {
+    std::mutex mutex;
+    std::vector<void*> freeBlocks;
+    std::vector<void*> chunks;
+  };
+
+  // One per thread. live counts allocations not freed yet, at 0 the arena starts over.
+  struct Arena
+  {
+    std::unique_ptr<char[]> memory{new char[ARENA_SIZE]};
+    size_t head = 0;
+    uint32_t live = 0;
+  };
+
+  static size_t classBlockSize(size_t sizeClass) { return size_t(32) << sizeClass; }
+
+  static Arena& threadArena()
+  {
+    static thread_local Arena arena;
+    return arena;
+  }
+
+  static Header* header(void* memory) { return reinterpret_cast<Header*>(static_cast<char*>(memory) - HEADER_SIZE); }
+
+  void* allocate(TypeEntry& entry, size_t size, size_t alignment, VkSystemAllocationScope scope)
+  {
+    alignment = std::max<size_t>(alignment, HEADER_SIZE);
+    char* block = nullptr;
+    uint32_t offset = static_cast<uint32_t>(alignment);
+    uint16_t source = SYSTEM;
+
+    if (scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND)
+    {
+      Arena& arena = threadArena();
+      size_t start = (arena.head + HEADER_SIZE + alignment - 1) / alignment * alignment - HEADER_SIZE;
+      if (start + HEADER_SIZE + size <= ARENA_SIZE)
+      {
+        block = arena.memory.get() + start;
+        offset = HEADER_SIZE;
+        source = ARENA;
+        arena.head = start + HEADER_SIZE + size;
+        arena.live++;
+      }
+    }else if (alignment == HEADER_SIZE && size + HEADER_SIZE <= classBlockSize(CLASS_COUNT - 1)){
+      size_t sizeClass = 0;
+      while (classBlockSize(sizeClass) < size + HEADER_SIZE)
+        sizeClass++;
+      block = static_cast<char*>(takeBlock(sizeClass));
+      offset = HEADER_SIZE;
+      source = static_cast<uint16_t>(sizeClass);
+    }
+
+    if (!block)
+    {
+      block = static_cast<char*>(std::aligned_alloc(alignment, (offset + size + alignment - 1) / alignment * alignment));
+      if (!block)
+        return nullptr;
+    }
+
+    void* memory = block + offset;
+    *header(memory) = {size, offset, source, static_cast<uint8_t>(scope), entry.index};
+    count(entry, scope, static_cast<int64_t>(size));
+    return memory;
+  }
+
+  void release(void* memory)
+  {
+    if (!memory)
+      return;
+    Header info = *header(memory);
+    char* block = static_cast<char*>(memory) - info.offset;
+    TypeEntry* entry;
+    {
+      std::lock_guard<std::mutex> lock(typesMutex);
+      entry = types[info.type].get();
+    }
+    count(*entry, static_cast<VkSystemAllocationScope>(info.scope), -static_cast<int64_t>(info.size));
+
+    if (info.source == ARENA)
+    {
+      // Freed on the thread that allocated it, the allocation only lived for one call
+      Arena& arena = threadArena();
+      if (--arena.live == 0)
+        arena.head = 0;
+    }else if (info.source == SYSTEM){
+      std::free(block);
+    }else{
+      Pool& pool = *pools[info.source];
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      pool.freeBlocks.push_back(block);
+    }
+  }
+
+  void* takeBlock(size_t sizeClass)
+  {
+    Pool& pool = *pools[sizeClass];
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.freeBlocks.empty())
+    {
+      size_t blockSize = classBlockSize(sizeClass);
+      char* chunk = static_cast<char*>(std::aligned_alloc(HEADER_SIZE, CHUNK_SIZE));
+      if (!chunk)
+        return nullptr;
+      pool.chunks.push_back(chunk);
+      for (size_t offset = 0; offset + blockSize <= CHUNK_SIZE; offset += blockSize)
+        pool.freeBlocks.push_back(chunk + offset);
+    }
+    void* block = pool.freeBlocks.back();
+    pool.freeBlocks.pop_back();
+    return block;
+  }
+
+  void count(TypeEntry& entry, VkSystemAllocationScope scope, int64_t size)
+  {
+    std::lock_guard<std::mutex> lock(countersMutex);
+    for (Counters* target : {&counters.scopes[scope], &counters.total, &entry.counters})
+      apply(*target, size);
+  }
+
+  static void apply(Counters& target, int64_t size)
+  {
+    if (size >= 0)
+    {
+      target.allocations++;
+      target.bytes += size;
+      target.liveBytes += size;
+      target.peakBytes = std::max(target.peakBytes, target.liveBytes);
+    }else{
+      target.frees++;
+      target.liveBytes -= static_cast<uint64_t>(-size);
+    }
+  }
+
+  static VKAPI_ATTR void* VKAPI_CALL allocation(void* userData, size_t size, size_t alignment, VkSystemAllocationScope scope)
+  {
+    auto* entry = static_cast<TypeEntry*>(userData);
+    return entry->owner->allocate(*entry, size, alignment, scope);
+  }
+
+  static VKAPI_ATTR void* VKAPI_CALL reallocation(void* userData, void* original, size_t size, size_t alignment,
+                                                  VkSystemAllocationScope scope)
+  {
+    auto* entry = static_cast<TypeEntry*>(userData);
+    if (!original)
+      return entry->owner->allocate(*entry, size, alignment, scope);
+    if (size == 0)
+    {
+      entry->owner->release(original);
+      return nullptr;
+    }
+    void* memory = entry->owner->allocate(*entry, size, alignment, scope);
+    if (!memory)
+      return nullptr; // The original stays valid
+    std::memcpy(memory, original, std::min<size_t>(size, header(original)->size));
+    entry->owner->release(original);
+    return memory;
+  }
+
+  static VKAPI_ATTR void VKAPI_CALL free(void* userData, void* memory)
+  {
+    static_cast<TypeEntry*>(userData)->owner->release(memory);
+  }
+
+  static VKAPI_ATTR void VKAPI_CALL internalAllocation(void* userData, size_t size, VkInternalAllocationType, VkSystemAllocationScope)
+  {
+    HostAllocator* owner = static_cast<TypeEntry*>(userData)->owner;
+    std::lock_guard<std::mutex> lock(owner->countersMutex);
+    apply(owner->counters.internal, static_cast<int64_t>(size));
+  }
+
+  static VKAPI_ATTR void VKAPI_CALL internalFree(void* userData, size_t size, VkInternalAllocationType, VkSystemAllocationScope)
+  {
+    HostAllocator* owner = static_cast<TypeEntry*>(userData)->owner;
+    std::lock_guard<std::mutex> lock(owner->countersMutex);
+    apply(owner->counters.internal, -static_cast<int64_t>(size));
+  }
+
+  std::unique_ptr<Pool> pools[CLASS_COUNT];
+  mutable std::mutex typesMutex;
+  std::vector<std::unique_ptr<TypeEntry>> types; // Never removed, the callbacks point into them
+  mutable std::mutex countersMutex;
+  Snapshot counters;
+};
@@ -0,0 +1,397 @@
+#pragma once
+
+// CPU kernels for per instance work: composing model to world matrices and testing bounding
+// spheres against the frustum.
+//
+// The instances are kept as structure of arrays, one array per component, so a kernel loads
+// 4 (SSE) or 8 (AVX2) instances with one instruction and works on all of them at once. The
+// matrices come out as plain column major mat4s, the layout glm and the vertex buffer use. The
+// vector kernels compute them one element across all lanes and transpose the registers before
+// storing. The instruction set is picked at runtime: the AVX2 kernels are compiled for it with
+// a target attribute, so the program itself doesn't need -mavx2 and still runs on CPUs without
+// it. On other architectures only the scalar kernels exist.
+//
+// Large batches are split into jobs on a pool of worker threads, the same way ParallelRecorder
+// splits the draws.
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "task_graph.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INSTANCE_KERNELS_X86 1
+#include <immintrin.h>
+#else
+#define INSTANCE_KERNELS_X86 0
+#endif
+
+enum class SimdLevel : uint8_t
+{
+  Scalar,
+  SSE,
+  AVX2
+};
+
+inline const char* simdLevelName(SimdLevel level)
+{
+  switch (level)
+  {
+    case SimdLevel::SSE:  return "sse";
+    case SimdLevel::AVX2: return "avx2";
+    default:              return "scalar";
+  }
+}
+
+// The best level this CPU runs. AVX2 kernels use FMA as well, every AVX2 CPU has it.
+inline SimdLevel detectSimdLevel()
+{
+#if INSTANCE_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return SimdLevel::AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return SimdLevel::SSE;
+#endif
+  return SimdLevel::Scalar;
+}
+
+// The instances, each one a translate * scale in the space of a parent matrix
+struct InstanceSoA
+{
+  std::vector<float> x, y, z;
+  std::vector<float> scaleX, scaleY, scaleZ;
+  std::vector<float> radius; // Bounding sphere around the model's origin, before the scale
+
+  void resize(size_t count)
+  {
+    for (auto* component : {&x, &y, &z, &scaleX, &scaleY, &scaleZ, &radius})
+      component->resize(count);
+  }
+
+  size_t size() const { return x.size(); }
+};
+
+// World space planes (a, b, c, d) with unit normals pointing into the frustum
+struct FrustumPlanes
+{
+  float a[6], b[6], c[6], d[6];
+};
+
+// Gribb and Hartmann, as in cull.comp. Depth goes from 0 to 1, the near plane is the z row.
+inline FrustumPlanes extractFrustumPlanes(const float viewProjection[16])
+{
+  auto row = [&](int r, int c) { return viewProjection[c * 4 + r]; };
+  FrustumPlanes planes;
+  for (int i = 0; i < 6; ++i)
+  {
+    int r = i / 2;
+    float sign = i % 2 ? -1.0f : 1.0f;
+    float plane[4];
+    for (int c = 0; c < 4; ++c)
+      plane[c] = i == 4 ? row(2, c) : row(3, c) + sign * row(r, c);
+    float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+    planes.a[i] = plane[0] / length;
+    planes.b[i] = plane[1] / length;
+    planes.c[i] = plane[2] / length;
+    planes.d[i] = plane[3] / length;
+  }
+  return planes;
+}
+
+class InstanceKernels
+{
+public:
+  // Below this many instances per job handing work to another thread costs more than it saves
+  static const size_t MIN_INSTANCES_PER_JOB = 4096;
+
+  // level is capped at what the CPU supports
+  void init(uint32_t threadCount, SimdLevel level)
+  {
+    this->threadCount = threadCount;
+    maxJobs = std::max(1u, threadCount);
+    setLevel(level);
+    pool = std::make_unique<ThreadPool>(threadCount);
+  }
+
+  void setLevel(SimdLevel level) { this->level = std::min(level, detectSimdLevel()); }
+  SimdLevel getLevel() const { return level; }
+  void setMaxJobs(uint32_t jobs) { maxJobs = std::max(1u, std::min(jobs, std::max(1u, threadCount))); }
+  uint32_t getThreadCount() const { return threadCount; }
+
+  // Writes parent * translate(x, y, z) * scale(scaleX, scaleY, scaleZ) of every instance as 16
+  // floats, column major, to out + i * outStride. parent is column major as well.
+  void composeTransforms(const float parent[16], const InstanceSoA& instances, float* out, size_t outStride)
+  {
+    parallel(instances.size(), [&](size_t first, size_t last) {
+      switch (level)
+      {
+#if INSTANCE_KERNELS_X86
+        case SimdLevel::AVX2: composeAVX2(parent, instances, first, last, out, outStride); break;
+        case SimdLevel::SSE:  composeSSE(parent, instances, first, last, out, outStride); break;
+#endif
+        default: composeScalar(parent, instances, first, last, out, outStride); break;
+      }
+      return size_t(0);
+    });
+  }
+
+  // Sets visible[i] to 1 if instance i's bounding sphere, placed by parent, touches the frustum
+  // and to 0 otherwise. Returns the number of visible instances.
+  size_t cullSpheres(const float parent[16], const FrustumPlanes& planes, const InstanceSoA& instances, uint8_t* visible)
+  {
+    // The largest scale of the parent's axes grows every radius
+    float parentScale = 0.0f;
+    for (int c = 0; c < 3; ++c)
+      parentScale = std::max(parentScale, std::sqrt(parent[c * 4] * parent[c * 4] + parent[c * 4 + 1] * parent[c * 4 + 1] +
+                                                     parent[c * 4 + 2] * parent[c * 4 + 2]));
+    return parallel(instances.size(), [&](size_t first, size_t last) {
+      switch (level)
+      {
+#if INSTANCE_KERNELS_X86
+        case SimdLevel::AVX2: return cullAVX2(parent, parentScale, planes, instances, first, last, visible);
+        case SimdLevel::SSE:  return cullSSE(parent, parentScale, planes, instances, first, last, visible);
+#endif
+        default: return cullScalar(parent, parentScale, planes, instances, first, last, visible);
+      }
+    });
+  }
+
+private:
+  // Runs kernel on [first, last) ranges covering [0, count) and sums what they return
+  template <typename Kernel>
+  size_t parallel(size_t count, const Kernel& kernel)
+  {
+    size_t jobs = std::min<size_t>(maxJobs, (count + MIN_INSTANCES_PER_JOB - 1) / MIN_INSTANCES_PER_JOB);
+    if (jobs <= 1)
+      return kernel(0, count);
+
+    std::latch done(static_cast<std::ptrdiff_t>(jobs));
+    std::vector<size_t> results(jobs);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    for (size_t job = 0; job < jobs; ++job)
+    {
+      pool->submit([&, job]{
+        try{
+          results[job] = kernel(count * job / jobs, count * (job + 1) / jobs);
+        }catch(...){
+          std::lock_guard<std::mutex> lock(errorMutex);
+          error = std::current_exception();
+        }
+        done.count_down();
+      });
+    }
+    done.wait();
+    if (error)
+      std::rethrow_exception(error);
+    size_t sum = 0;
+    for (size_t result : results)
+      sum += result;
+    return sum;
+  }
+
+  static void composeScalar(const float* m, const InstanceSoA& in, size_t first, size_t last, float* out, size_t outStride)
+  {
+    for (size_t i = first; i < last; ++i)
+    {
+      float* o = out + i * outStride;
+      for (int r = 0; r < 4; ++r)
+      {
+        o[r] = m[r] * in.scaleX[i];
+        o[4 + r] = m[4 + r] * in.scaleY[i];
+        o[8 + r] = m[8 + r] * in.scaleZ[i];
+        o[12 + r] = m[r] * in.x[i] + m[4 + r] * in.y[i] + m[8 + r] * in.z[i] + m[12 + r];
+      }
+    }
+  }
+
+  static size_t cullScalar(const float* m, float parentScale, const FrustumPlanes& planes, const InstanceSoA& in,
+                           size_t first, size_t last, uint8_t* visible)
+  {
+    size_t count = 0;
+    for (size_t i = first; i < last; ++i)
+    {
+      float cx = m[0] * in.x[i] + m[4] * in.y[i] + m[8] * in.z[i] + m[12];
+      float cy = m[1] * in.x[i] + m[5] * in.y[i] + m[9] * in.z[i] + m[13];
+      float cz = m[2] * in.x[i] + m[6] * in.y[i] + m[10] * in.z[i] + m[14];
+      float radius = in.radius[i] * std::max({in.scaleX[i], in.scaleY[i], in.scaleZ[i]}) * parentScale;
+      bool inside = true;
+      for (int p = 0; p < 6; ++p)
+        inside &= planes.a[p] * cx + planes.b[p] * cy + planes.c[p] * cz + planes.d[p] >= -radius;
+      visible[i] = inside;
+      count += inside;
+    }
+    return count;
+  }
+
+#if INSTANCE_KERNELS_X86
+  // Element e of the 4 lanes' matrices is in e[e]. Column c of lane k ends up at out + k * outStride + 4c.
+  __attribute__((target("sse2")))
+  static void storeSSE(__m128 e[16], float* out, size_t outStride)
+  {
+    for (int c = 0; c < 4; ++c)
+    {
+      __m128 r0 = e[c * 4], r1 = e[c * 4 + 1], r2 = e[c * 4 + 2], r3 = e[c * 4 + 3];
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(out + c * 4, r0);
+      _mm_storeu_ps(out + outStride + c * 4, r1);
+      _mm_storeu_ps(out + 2 * outStride + c * 4, r2);
+      _mm_storeu_ps(out + 3 * outStride + c * 4, r3);
+    }
+  }
+
+  __attribute__((target("sse2")))
+  static void composeSSE(const float* m, const InstanceSoA& in, size_t first, size_t last, float* out, size_t outStride)
+  {
+    size_t i = first;
+    for (; i + 4 <= last; i += 4)
+    {
+      __m128 x = _mm_loadu_ps(&in.x[i]), y = _mm_loadu_ps(&in.y[i]), z = _mm_loadu_ps(&in.z[i]);
+      __m128 sx = _mm_loadu_ps(&in.scaleX[i]), sy = _mm_loadu_ps(&in.scaleY[i]), sz = _mm_loadu_ps(&in.scaleZ[i]);
+      __m128 e[16];
+      for (int r = 0; r < 4; ++r)
+      {
+        e[r] = _mm_mul_ps(_mm_set1_ps(m[r]), sx);
+        e[4 + r] = _mm_mul_ps(_mm_set1_ps(m[4 + r]), sy);
+        e[8 + r] = _mm_mul_ps(_mm_set1_ps(m[8 + r]), sz);
+        e[12 + r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[r]), x), _mm_mul_ps(_mm_set1_ps(m[4 + r]), y)),
+                               _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[8 + r]), z), _mm_set1_ps(m[12 + r])));
+      }
+      storeSSE(e, out + i * outStride, outStride);
+    }
+    composeScalar(m, in, i, last, out, outStride);
+  }
+
+  __attribute__((target("sse2")))
+  static size_t cullSSE(const float* m, float parentScale, const FrustumPlanes& planes, const InstanceSoA& in,
+                        size_t first, size_t last, uint8_t* visible)
+  {
+    size_t count = 0;
+    size_t i = first;
+    for (; i + 4 <= last; i += 4)
+    {
+      __m128 x = _mm_loadu_ps(&in.x[i]), y = _mm_loadu_ps(&in.y[i]), z = _mm_loadu_ps(&in.z[i]);
+      __m128 center[3];
+      for (int r = 0; r < 3; ++r)
+        center[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[r]), x), _mm_mul_ps(_mm_set1_ps(m[4 + r]), y)),
+                               _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[8 + r]), z), _mm_set1_ps(m[12 + r])));
+      __m128 scale = _mm_max_ps(_mm_loadu_ps(&in.scaleX[i]), _mm_max_ps(_mm_loadu_ps(&in.scaleY[i]), _mm_loadu_ps(&in.scaleZ[i])));
+      __m128 negRadius = _mm_mul_ps(_mm_loadu_ps(&in.radius[i]), _mm_mul_ps(scale, _mm_set1_ps(-parentScale)));
+
+      __m128 outside = _mm_setzero_ps();
+      for (int p = 0; p < 6; ++p)
+      {
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes.a[p]), center[0]), _mm_mul_ps(_mm_set1_ps(planes.b[p]), center[1])),
+                                     _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes.c[p]), center[2]), _mm_set1_ps(planes.d[p])));
+        outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negRadius));
+      }
+      int mask = ~_mm_movemask_ps(outside) & 0xf;
+      for (int k = 0; k < 4; ++k)
+        visible[i + k] = (mask >> k) & 1;
+      count += __builtin_popcount(mask);
+    }
+    return count + cullScalar(m, parentScale, planes, in, i, last, visible);
+  }
+
+  // Turns the rows of an 8x8 block into its columns
+  __attribute__((target("avx2,fma")))
+  static void transpose8(__m256 r[8])
+  {
+    __m256 t[8], s[8];
+    for (int k = 0; k < 8; k += 4)
+    {
+      t[k] = _mm256_unpacklo_ps(r[k], r[k + 1]);
+      t[k + 1] = _mm256_unpackhi_ps(r[k], r[k + 1]);
+      t[k + 2] = _mm256_unpacklo_ps(r[k + 2], r[k + 3]);
+      t[k + 3] = _mm256_unpackhi_ps(r[k + 2], r[k + 3]);
+      s[k] = _mm256_shuffle_ps(t[k], t[k + 2], _MM_SHUFFLE(1, 0, 1, 0));
+      s[k + 1] = _mm256_shuffle_ps(t[k], t[k + 2], _MM_SHUFFLE(3, 2, 3, 2));
+      s[k + 2] = _mm256_shuffle_ps(t[k + 1], t[k + 3], _MM_SHUFFLE(1, 0, 1, 0));
+      s[k + 3] = _mm256_shuffle_ps(t[k + 1], t[k + 3], _MM_SHUFFLE(3, 2, 3, 2));
+    }
+    for (int k = 0; k < 4; ++k)
+    {
+      r[k] = _mm256_permute2f128_ps(s[k], s[k + 4], 0x20);
+      r[k + 4] = _mm256_permute2f128_ps(s[k], s[k + 4], 0x31);
+    }
+  }
+
+  __attribute__((target("avx2,fma")))
+  static void composeAVX2(const float* m, const InstanceSoA& in, size_t first, size_t last, float* out, size_t outStride)
+  {
+    size_t i = first;
+    for (; i + 8 <= last; i += 8)
+    {
+      __m256 x = _mm256_loadu_ps(&in.x[i]), y = _mm256_loadu_ps(&in.y[i]), z = _mm256_loadu_ps(&in.z[i]);
+      __m256 sx = _mm256_loadu_ps(&in.scaleX[i]), sy = _mm256_loadu_ps(&in.scaleY[i]), sz = _mm256_loadu_ps(&in.scaleZ[i]);
+      // Columns 0-1 and 2-3 are 8 floats each, one 8x8 transpose per half of the matrices
+      __m256 low[8], high[8];
+      for (int r = 0; r < 4; ++r)
+      {
+        low[r] = _mm256_mul_ps(_mm256_set1_ps(m[r]), sx);
+        low[4 + r] = _mm256_mul_ps(_mm256_set1_ps(m[4 + r]), sy);
+        high[r] = _mm256_mul_ps(_mm256_set1_ps(m[8 + r]), sz);
+        high[4 + r] = _mm256_fmadd_ps(_mm256_set1_ps(m[r]), x,
+                      _mm256_fmadd_ps(_mm256_set1_ps(m[4 + r]), y,
+                      _mm256_fmadd_ps(_mm256_set1_ps(m[8 + r]), z, _mm256_set1_ps(m[12 + r]))));
+      }
+      transpose8(low);
+      transpose8(high);
+      for (int k = 0; k < 8; ++k)
+      {
+        _mm256_storeu_ps(out + (i + k) * outStride, low[k]);
+        _mm256_storeu_ps(out + (i + k) * outStride + 8, high[k]);
+      }
+    }
+    composeScalar(m, in, i, last, out, outStride);
+  }
+
+  __attribute__((target("avx2,fma")))
+  static size_t cullAVX2(const float* m, float parentScale, const FrustumPlanes& planes, const InstanceSoA& in,
+                         size_t first, size_t last, uint8_t* visible)
+  {
+    size_t count = 0;
+    size_t i = first;
+    for (; i + 8 <= last; i += 8)
+    {
+      __m256 x = _mm256_loadu_ps(&in.x[i]), y = _mm256_loadu_ps(&in.y[i]), z = _mm256_loadu_ps(&in.z[i]);
+      __m256 center[3];
+      for (int r = 0; r < 3; ++r)
+        center[r] = _mm256_fmadd_ps(_mm256_set1_ps(m[r]), x,
+                    _mm256_fmadd_ps(_mm256_set1_ps(m[4 + r]), y,
+                    _mm256_fmadd_ps(_mm256_set1_ps(m[8 + r]), z, _mm256_set1_ps(m[12 + r]))));
+      __m256 scale = _mm256_max_ps(_mm256_loadu_ps(&in.scaleX[i]),
+                                   _mm256_max_ps(_mm256_loadu_ps(&in.scaleY[i]), _mm256_loadu_ps(&in.scaleZ[i])));
+      __m256 negRadius = _mm256_mul_ps(_mm256_loadu_ps(&in.radius[i]), _mm256_mul_ps(scale, _mm256_set1_ps(-parentScale)));
+
+      __m256 outside = _mm256_setzero_ps();
+      for (int p = 0; p < 6; ++p)
+      {
+        __m256 distance = _mm256_fmadd_ps(_mm256_set1_ps(planes.a[p]), center[0],
+                          _mm256_fmadd_ps(_mm256_set1_ps(planes.b[p]), center[1],
+                          _mm256_fmadd_ps(_mm256_set1_ps(planes.c[p]), center[2], _mm256_set1_ps(planes.d[p]))));
+        outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, negRadius, _CMP_LT_OQ));
+      }
+      int mask = ~_mm256_movemask_ps(outside) & 0xff;
+      for (int k = 0; k < 8; ++k)
+        visible[i + k] = (mask >> k) & 1;
+      count += __builtin_popcount(mask);
+    }
+    return count + cullScalar(m, parentScale, planes, in, i, last, visible);
+  }
+#endif
+
+  SimdLevel level = SimdLevel::Scalar;
+  uint32_t threadCount = 0;
+  uint32_t maxJobs = 1;
+  std::unique_ptr<ThreadPool> pool;
+};
@@ -0,0 +1,532 @@
+#pragma once
+
+// Graphics pipelines built from a small, hashable description.
+//
+// A PipelineKey holds everything that tells two pipelines apart: the shaders (by a hash of
+// their SPIR-V, so the same code loaded twice is the same shader), the vertex layout, the
+// fixed function state that materials vary and the render target formats. Everything else
+// (dynamic viewport and scissor, one color attachment, no stencil) is the same for all of them.
+//
+// Equal keys share one VkPipeline. A request for a key that is already being built waits for
+// that build instead of starting a second one. prefetch() builds on worker threads, so the
+// variants a scene is about to need can be compiled before a frame asks for them and get()
+// doesn't hitch. The pipelines are kept in an LRU list of at most `capacity` entries. An
+// evicted pipeline may still be bound in a frame in flight, it is destroyed once the last
+// frame that used it has completed (see beginFrame).
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "host_allocator.h"
+#include "task_graph.h"
+
+enum class BlendMode : uint8_t
+{
+  Opaque,
+  Alpha,    // src * a + dst * (1 - a)
+  Additive, // src * a + dst
+};
+
+struct PipelineKey
+{
+  uint64_t vertexShader = 0;   // Content hashes, see PipelineFactory::addShader
+  uint64_t fragmentShader = 0;
+  uint32_t vertexInput = 0;    // Index from PipelineFactory::addVertexInput
+  VkPipelineLayout layout = VK_NULL_HANDLE;
+  VkRenderPass renderPass = VK_NULL_HANDLE; // VK_NULL_HANDLE for dynamic rendering, the formats are used instead
+  VkFormat colorFormat = VK_FORMAT_UNDEFINED;
+  VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+  VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+  VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+  VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+  VkFrontFace frontFace = VK_FRONT_FACE_CLOCKWISE;
+  BlendMode blend = BlendMode::Opaque;
+  bool depthTest = true;
+  bool depthWrite = true;
+  VkCompareOp depthCompare = VK_COMPARE_OP_LESS;
+
+  bool operator==(const PipelineKey&) const = default;
+};
+
+struct PipelineKeyHash
+{
+  size_t operator()(const PipelineKey& key) const
+  {
+    uint64_t hash = 0;
+    auto combine = [&](uint64_t value) { hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2); };
+    combine(key.vertexShader);
+    combine(key.fragmentShader);
+    combine(key.vertexInput);
+    combine(reinterpret_cast<uint64_t>(key.layout));
+    combine(reinterpret_cast<uint64_t>(key.renderPass));
+    combine(key.colorFormat);
+    combine(key.depthFormat);
+    combine(key.samples);
+    combine(key.topology);
+    combine(key.polygonMode);
+    combine(key.cullMode);
+    combine(key.frontFace);
+    combine(static_cast<uint64_t>(key.blend));
+    combine(key.depthTest | key.depthWrite << 1);
+    combine(key.depthCompare);
+    return static_cast<size_t>(hash);
+  }
+};
+
+class PipelineFactory
+{
+public:
+  struct Stats
+  {
+    uint64_t hits = 0;          // get() found the pipeline ready
+    uint64_t misses = 0;        // get() had to build it
+    uint64_t sharedBuilds = 0;  // get() waited for a build that was already running
+    uint64_t backgroundBuilds = 0;
+    uint64_t evictions = 0;
+    double buildMs = 0;         // Summed over all builds, on every thread
+    double stallMs = 0;         // Time get() spent building or waiting
+  };
+
+  // What the driver reports about one build through VK_EXT_pipeline_creation_feedback (core in
+  // 1.3), recorded while setCreationFeedback is on
+  struct BuildFeedback
+  {
+    double ms = 0;              // Measured around vkCreateGraphicsPipelines
+    bool valid = false;         // The driver filled in the rest
+    bool cacheHit = false;      // Came out of the pipeline cache without compiling
+    double driverMs = 0;        // The driver's duration for the whole pipeline
+    double stageMs[2] = {0, 0}; // Vertex and fragment stage, 0 if the driver doesn't report them
+  };
+
+  // threadCount workers build prefetched pipelines, with 0 prefetch builds right away
+  void init(VkDevice device, HostAllocator& hostAllocator, VkPipelineCache pipelineCache, uint32_t capacity, uint32_t threadCount)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    this->pipelineCache = pipelineCache;
+    this->capacity = std::max(1u, capacity);
+    this->threadCount = threadCount;
+    if (threadCount)
+      pool = std::make_unique<ThreadPool>(threadCount);
+  }
+
+  // The device must be idle
+  void shutdown()
+  {
+    pool.reset(); // Finishes the queued builds
+    clear();
+    for (auto& [hash, module] : shaders)
+      vkDestroyShaderModule(device, module, host->callbacks(VK_OBJECT_TYPE_SHADER_MODULE));
+    shaders.clear();
+  }
+
+  // FNV-1a of the SPIR-V, what PipelineKey identifies shaders by
+  static uint64_t hashCode(const void* code, size_t size)
+  {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i)
+      hash = (hash ^ static_cast<const uint8_t*>(code)[i]) * 0x100000001b3ull;
+    return hash;
+  }
+
+  // Takes ownership of the module, hash is its hashCode(). Returns the hash that goes into
+  // PipelineKey, code that was added before keeps its first module and the new one is destroyed.
+  uint64_t addShader(uint64_t hash, VkShaderModule module)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, inserted] = shaders.emplace(hash, module);
+    if (!inserted)
+      vkDestroyShaderModule(device, module, host->callbacks(VK_OBJECT_TYPE_SHADER_MODULE));
+    return hash;
+  }
+
+  uint32_t addVertexInput(std::vector<VkVertexInputBindingDescription> bindings,
+                          std::vector<VkVertexInputAttributeDescription> attributes)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    vertexInputs.push_back({std::move(bindings), std::move(attributes)});
+    return static_cast<uint32_t>(vertexInputs.size() - 1);
+  }
+
+  // Called once per frame before recording. frame is the number of the frame about to be
+  // recorded, every get() until the next call counts as used by it. Evicted pipelines whose
+  // last frame has completed are destroyed.
+  void beginFrame(uint64_t frame, uint64_t completedFrames)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    currentFrame = frame;
+    for (size_t i = 0; i < retired.size();)
+    {
+      if (retired[i].lastUsedFrame <= completedFrames)
+      {
+        vkDestroyPipeline(device, retired[i].pipeline, host->callbacks(VK_OBJECT_TYPE_PIPELINE));
+        retired[i] = retired.back();
+        retired.pop_back();
+      }else{
+        ++i;
+      }
+    }
+  }
+
+  // Returns the pipeline for key, building it on the calling thread if nobody has yet
+  VkPipeline get(const PipelineKey& key)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it != entries.end() && it->second.ready)
+    {
+      stats.hits++;
+      if (it->second.pipeline == VK_NULL_HANDLE)
+        throw std::runtime_error("failed to create graphics pipeline.");
+      return use(it->second);
+    }
+
+    // The entry can't be evicted while it has waiters
+    auto start = std::chrono::steady_clock::now();
+    Entry* entry;
+    if (it != entries.end())
+    {
+      // Someone else is on it, a prefetch or another recording thread
+      stats.sharedBuilds++;
+      entry = &it->second;
+      entry->waiters++;
+      built.wait(lock, [&]{ return entry->ready; });
+    }else{
+      stats.misses++;
+      entry = &insert(key);
+      entry->waiters++;
+      lock.unlock();
+      VkPipeline pipeline = VK_NULL_HANDLE;
+      try{
+        pipeline = build(key);
+      }catch(...){
+        // Reported below, after the waiters have been woken up
+      }
+      lock.lock();
+      finish(*entry, pipeline);
+    }
+    stats.stallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    entry->waiters--;
+    if (entry->pipeline == VK_NULL_HANDLE)
+      throw std::runtime_error("failed to create graphics pipeline.");
+    return use(*entry);
+  }
+
+  // Starts building key in the background unless it is built or being built already
+  void prefetch(const PipelineKey& key)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (entries.count(key))
+      return;
+    Entry* entry = &insert(key);
+    stats.backgroundBuilds++;
+
+    auto job = [this, key, entry]{
+      VkPipeline pipeline = VK_NULL_HANDLE;
+      try{
+        pipeline = build(key);
+      }catch(...){
+        // get() reports it when the pipeline is asked for
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      finish(*entry, pipeline);
+    };
+    lock.unlock();
+    if (pool)
+      pool->submit(job);
+    else
+      job();
+  }
+
+  // Destroys every pipeline and resets the counters. The device must be idle.
+  void clear()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    built.wait(lock, [&]{ return building == 0; });
+    for (auto& [key, entry] : entries)
+      vkDestroyPipeline(device, entry.pipeline, host->callbacks(VK_OBJECT_TYPE_PIPELINE));
+    for (auto& pipeline : retired)
+      vkDestroyPipeline(device, pipeline.pipeline, host->callbacks(VK_OBJECT_TYPE_PIPELINE));
+    entries.clear();
+    lru.clear();
+    retired.clear();
+    buildFeedback.clear();
+    stats = {};
+  }
+
+  void setCreationFeedback(bool enabled) { creationFeedback = enabled; }
+
+  std::vector<BuildFeedback> getBuildFeedback() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return buildFeedback;
+  }
+
+  Stats getStats() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+  }
+
+  void printStats(std::ostream& out) const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t requests = stats.hits + stats.misses + stats.sharedBuilds;
+    out << "Pipeline factory (" << entries.size() << "/" << capacity << " pipelines, " << threadCount << " build thread(s)): "
+        << requests << " request(s), " << stats.hits << " hit(s), " << stats.misses << " miss(es), "
+        << stats.sharedBuilds << " shared build(s), " << stats.backgroundBuilds << " background build(s), "
+        << stats.evictions << " eviction(s), " << stats.buildMs << " ms building, " << stats.stallMs << " ms stalled" << std::endl;
+  }
+
+private:
+  struct Entry
+  {
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    bool ready = false;
+    uint32_t waiters = 0; // get() calls that hold on to the entry
+    uint64_t lastUsedFrame = 0;
+    std::list<PipelineKey>::iterator lruPosition;
+  };
+
+  struct RetiredPipeline
+  {
+    VkPipeline pipeline;
+    uint64_t lastUsedFrame;
+  };
+
+  struct VertexInput
+  {
+    std::vector<VkVertexInputBindingDescription> bindings;
+    std::vector<VkVertexInputAttributeDescription> attributes;
+  };
+
+  // The mutex is held. Elements of an unordered_map keep their address when it rehashes.
+  Entry& insert(const PipelineKey& key)
+  {
+    lru.push_front(key);
+    Entry& entry = entries[key];
+    entry.lruPosition = lru.begin();
+    building++;
+    return entry;
+  }
+
+  // The mutex is held
+  void finish(Entry& entry, VkPipeline pipeline)
+  {
+    entry.pipeline = pipeline;
+    entry.ready = true;
+    building--;
+    built.notify_all();
+    evict();
+  }
+
+  // The mutex is held
+  VkPipeline use(Entry& entry)
+  {
+    entry.lastUsedFrame = currentFrame;
+    lru.splice(lru.begin(), lru, entry.lruPosition);
+    return entry.pipeline;
+  }
+
+  // The mutex is held. Pipelines that are still being built or waited for stay.
+  void evict()
+  {
+    auto candidate = lru.end();
+    while (entries.size() > capacity && candidate != lru.begin())
+    {
+      --candidate;
+      auto it = entries.find(*candidate);
+      if (!it->second.ready || it->second.waiters)
+        continue;
+      if (it->second.pipeline != VK_NULL_HANDLE)
+        retired.push_back({it->second.pipeline, it->second.lastUsedFrame});
+      candidate = lru.erase(candidate);
+      entries.erase(it);
+      stats.evictions++;
+    }
+  }
+
+  // Runs without the mutex, the shaders and vertex inputs it reads are never removed while running
+  VkPipeline build(const PipelineKey& key)
+  {
+    VkShaderModule vertexModule, fragmentModule;
+    const VertexInput* input;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      vertexModule = shaders.at(key.vertexShader);
+      fragmentModule = shaders.at(key.fragmentShader);
+      input = &vertexInputs.at(key.vertexInput);
+    }
+
+    VkPipelineShaderStageCreateInfo shaderStages[2]{};
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].module = vertexModule;
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].module = fragmentModule;
+    shaderStages[1].pName = "main";
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(input->bindings.size());
+    vertexInputInfo.pVertexBindingDescriptions = input->bindings.data();
+    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(input->attributes.size());
+    vertexInputInfo.pVertexAttributeDescriptions = input->attributes.data();
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = key.topology;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+    // Viewport and scissor are dynamic, so no pipeline depends on the swap chain size
+    VkPipelineViewportStateCreateInfo viewportState{};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.scissorCount = 1;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer{};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.depthClampEnable = VK_FALSE;
+    rasterizer.rasterizerDiscardEnable = VK_FALSE;
+    rasterizer.polygonMode = key.polygonMode;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = key.cullMode;
+    rasterizer.frontFace = key.frontFace;
+    rasterizer.depthBiasEnable = VK_FALSE;
+
+    VkPipelineMultisampleStateCreateInfo multisampling{};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.sampleShadingEnable = VK_FALSE;
+    multisampling.rasterizationSamples = key.samples;
+    multisampling.minSampleShading = 1.0f;
+
+    VkPipelineDepthStencilStateCreateInfo depthStencil{};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = key.depthTest;
+    depthStencil.depthWriteEnable = key.depthWrite;
+    depthStencil.depthCompareOp = key.depthCompare;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.stencilTestEnable = VK_FALSE;
+
+    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorBlendAttachment.blendEnable = key.blend != BlendMode::Opaque;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    colorBlendAttachment.dstColorBlendFactor = key.blend == BlendMode::Additive ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    VkPipelineColorBlendStateCreateInfo colorBlending{};
+    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.logicOpEnable = VK_FALSE;
+    colorBlending.attachmentCount = 1;
+    colorBlending.pAttachments = &colorBlendAttachment;
+
+    VkDynamicState dynamicStates[] = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamicState{};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = 2;
+    dynamicState.pDynamicStates = dynamicStates;
+
+    VkPipelineRenderingCreateInfo renderingInfo{};
+    renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+    renderingInfo.colorAttachmentCount = 1;
+    renderingInfo.pColorAttachmentFormats = &key.colorFormat;
+    renderingInfo.depthAttachmentFormat = key.depthFormat;
+
+    VkPipelineCreationFeedback pipelineFeedback{};
+    VkPipelineCreationFeedback stageFeedback[2]{};
+    VkPipelineCreationFeedbackCreateInfo feedbackInfo{};
+    feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO;
+    feedbackInfo.pNext = key.renderPass == VK_NULL_HANDLE ? &renderingInfo : nullptr;
+    feedbackInfo.pPipelineCreationFeedback = &pipelineFeedback;
+    feedbackInfo.pipelineStageCreationFeedbackCount = 2;
+    feedbackInfo.pPipelineStageCreationFeedbacks = stageFeedback;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = creationFeedback ? &feedbackInfo : feedbackInfo.pNext;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pDepthStencilState = &depthStencil;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = key.layout;
+    pipelineInfo.renderPass = key.renderPass;
+    pipelineInfo.subpass = 0;
+    pipelineInfo.basePipelineIndex = -1;
+
+    auto start = std::chrono::steady_clock::now();
+    VkPipeline pipeline;
+    if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, host->callbacks(VK_OBJECT_TYPE_PIPELINE), &pipeline) != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline.");
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.buildMs += ms;
+    if (creationFeedback)
+    {
+      BuildFeedback feedback;
+      feedback.ms = ms;
+      feedback.valid = pipelineFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT;
+      feedback.cacheHit = pipelineFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT;
+      feedback.driverMs = pipelineFeedback.duration / 1e6;
+      for (int i = 0; i < 2; ++i)
+      {
+        if (stageFeedback[i].flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT)
+          feedback.stageMs[i] = stageFeedback[i].duration / 1e6;
+      }
+      buildFeedback.push_back(feedback);
+    }
+    return pipeline;
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  VkPipelineCache pipelineCache = VK_NULL_HANDLE; // Internally synchronized, shared by all build threads
+  uint32_t capacity = 1;
+  uint32_t threadCount = 0;
+  std::unique_ptr<ThreadPool> pool;
+
+  mutable std::mutex mutex;
+  std::condition_variable built;
+  std::unordered_map<uint64_t, VkShaderModule> shaders;
+  std::deque<VertexInput> vertexInputs; // Only appended to, so build() can read them without the lock
+  std::unordered_map<PipelineKey, Entry, PipelineKeyHash> entries;
+  std::list<PipelineKey> lru; // Most recently used first
+  std::vector<RetiredPipeline> retired;
+  uint32_t building = 0;
+  uint64_t currentFrame = 0;
+  bool creationFeedback = false;
+  std::vector<BuildFeedback> buildFeedback;
+  Stats stats;
+};
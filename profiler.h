@@ -0,0 +1,416 @@
+#pragma once
+
+// Frame profiler combining CPU scope timers with GPU timestamp queries.
+//
+// Everything here is behind ENABLE_PROFILER. Without it the PROFILE_* macros at the bottom
+// expand to nothing and none of this code is compiled, so release builds pay nothing.
+//
+// GPU timestamps use one query pool per frame in flight. A pool is only read back after the
+// previous frame of its slot has been waited on, so vkGetQueryPoolResults never stalls.
+// Results are written as Chrome trace-event JSON (load in chrome://tracing or Perfetto) and
+// frame times are kept in a rolling window for p50/p95/p99.
+
+#ifdef ENABLE_PROFILER
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "host_allocator.h"
+
+class Profiler
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  static const uint32_t MAX_GPU_ZONES = 64;       // Per frame
+  static const size_t MAX_TRACE_EVENTS = 1 << 20; // Events past this are counted but not kept
+  static const size_t FRAME_WINDOW = 1024;        // Frames in the rolling percentile window
+  static const uint32_t GPU_THREAD_ID = 1000;     // Chrome trace track for GPU zones
+  static const uint32_t INIT_THREAD_ID = 100;     // Chrome trace tracks for startup workers
+
+  void initGpu(VkDevice device, HostAllocator& hostAllocator, VkPhysicalDevice physicalDevice, uint32_t queueFamily, uint32_t framesInFlight)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    timestampPeriod = properties.limits.timestampPeriod;
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+    uint32_t validBits = queueFamilies[queueFamily].timestampValidBits;
+    if (validBits == 0)
+    {
+      std::cout << "Profiler: queue family has no timestamp support, GPU zones disabled" << std::endl;
+      return;
+    }
+    timestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+
+    slots.resize(framesInFlight);
+    for (auto& slot : slots)
+    {
+      VkQueryPoolCreateInfo createInfo{};
+      createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+      createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+      createInfo.queryCount = MAX_GPU_ZONES * 2;
+
+      if (vkCreateQueryPool(device, &createInfo, host->callbacks(VK_OBJECT_TYPE_QUERY_POOL), &slot.queryPool) != VK_SUCCESS)
+      {
+        std::cout << "Profiler: failed to create query pool, GPU zones disabled" << std::endl;
+        shutdown();
+        return;
+      }
+    }
+    gpuEnabled = true;
+  }
+
+  // Call after the device is idle, the last frame of every slot is collected before the pools go away
+  void shutdown()
+  {
+    for (auto& slot : slots)
+    {
+      if (slot.queryPool == VK_NULL_HANDLE)
+        continue;
+      if (gpuEnabled)
+        collectGpuResults(slot);
+      vkDestroyQueryPool(device, slot.queryPool, host->callbacks(VK_OBJECT_TYPE_QUERY_POOL));
+    }
+    slots.clear();
+    gpuEnabled = false;
+  }
+
+  void addCpuEvent(const char* name, uint32_t thread, clock::time_point start, clock::time_point end)
+  {
+    addEvent(name, thread, toUs(start), toUs(end) - toUs(start));
+  }
+
+  // Imports the per stage timings of a finished TaskGraph run
+  template<typename Graph>
+  void addTaskGraph(const Graph& graph)
+  {
+    graph.forEachNode([this](const char* name, uint32_t thread, clock::time_point start, clock::time_point end){
+      addCpuEvent(name, INIT_THREAD_ID + thread, start, end);
+    });
+  }
+
+  // Must be called at the start of a command buffer, after the slot's previous frame has been waited on.
+  // Collects the timestamps from the slot's previous frame and resets its queries.
+  void beginFrame(VkCommandBuffer commandBuffer, uint32_t frameSlot)
+  {
+    auto now = clock::now();
+    if (frameStarted)
+      recordFrameTime(std::chrono::duration<double, std::milli>(now - lastFrameStart).count());
+    lastFrameStart = now;
+    frameStarted = true;
+
+    if (!gpuEnabled)
+      return;
+
+    currentSlot = frameSlot;
+    FrameSlot& slot = slots[frameSlot];
+    collectGpuResults(slot);
+
+    vkCmdResetQueryPool(commandBuffer, slot.queryPool, 0, MAX_GPU_ZONES * 2);
+    slot.zoneCount = 0;
+    slot.frameZone = beginGpuZone(commandBuffer, "gpuFrame");
+  }
+
+  void endGpuFrame(VkCommandBuffer commandBuffer)
+  {
+    if (gpuEnabled)
+      endGpuZone(commandBuffer, slots[currentSlot].frameZone);
+  }
+
+  // The CPU time the frame was handed to the queue. GPU timestamps have no common clock with
+  // the CPU, so each frame's GPU zones are placed relative to its submit time.
+  void markSubmit(uint32_t frameSlot)
+  {
+    if (gpuEnabled)
+      slots[frameSlot].submitTime = clock::now();
+  }
+
+  uint32_t beginGpuZone(VkCommandBuffer commandBuffer, const char* name)
+  {
+    if (!gpuEnabled)
+      return MAX_GPU_ZONES;
+
+    FrameSlot& slot = slots[currentSlot];
+    uint32_t zone = slot.zoneCount.fetch_add(1);
+    if (zone >= MAX_GPU_ZONES)
+      return MAX_GPU_ZONES;
+
+    slot.zoneNames[zone] = name;
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, slot.queryPool, zone * 2);
+    return zone;
+  }
+
+  void endGpuZone(VkCommandBuffer commandBuffer, uint32_t zone)
+  {
+    if (!gpuEnabled || zone >= MAX_GPU_ZONES)
+      return;
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, slots[currentSlot].queryPool, zone * 2 + 1);
+  }
+
+  void printFrameStats(std::ostream& out) const
+  {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    if (cpuFrameTimes.empty())
+      return;
+
+    out << "  cpu frame ms p50 " << percentile(cpuFrameTimes, 0.50)
+        << " p95 " << percentile(cpuFrameTimes, 0.95)
+        << " p99 " << percentile(cpuFrameTimes, 0.99);
+    if (!gpuFrameTimes.empty())
+      out << " | gpu frame ms p50 " << percentile(gpuFrameTimes, 0.50)
+          << " p95 " << percentile(gpuFrameTimes, 0.95)
+          << " p99 " << percentile(gpuFrameTimes, 0.99);
+    out << std::endl;
+  }
+
+  // Median GPU frame time over the rolling window, 0 until a frame has been collected
+  double gpuFrameMs() const
+  {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return gpuFrameTimes.empty() ? 0.0 : percentile(gpuFrameTimes, 0.50);
+  }
+
+  // Starts the rolling windows over, so benchmarks can measure one configuration at a time
+  void resetFrameStats()
+  {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    cpuFrameTimes.clear();
+    gpuFrameTimes.clear();
+    cpuFrameCursor = 0;
+    gpuFrameCursor = 0;
+  }
+
+  bool writeChromeTrace(const std::string& path) const
+  {
+    std::ofstream file(path);
+    if (!file.is_open())
+    {
+      std::cerr << "Profiler: failed to open " << path << std::endl;
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(eventMutex);
+    file << std::fixed << std::setprecision(3); // Microseconds, keep sub-us precision on long runs
+    file << "{\"traceEvents\":[\n";
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << GPU_THREAD_ID << ",\"args\":{\"name\":\"GPU\"}}";
+    for (const auto& event : events)
+    {
+      file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+           << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs << "}";
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    std::cout << "Wrote " << events.size() << " trace events to " << path;
+    if (droppedEvents)
+      std::cout << " (" << droppedEvents << " dropped)";
+    std::cout << std::endl;
+    return true;
+  }
+
+  static uint32_t threadId()
+  {
+    static std::atomic<uint32_t> nextId{0};
+    thread_local uint32_t id = nextId.fetch_add(1);
+    return id;
+  }
+
+private:
+  struct Event
+  {
+    const char* name;
+    uint32_t thread;
+    double startUs;
+    double durationUs;
+  };
+
+  struct FrameSlot
+  {
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    std::atomic<uint32_t> zoneCount{0};
+    const char* zoneNames[MAX_GPU_ZONES] = {};
+    uint32_t frameZone = MAX_GPU_ZONES;
+    clock::time_point submitTime{};
+
+    FrameSlot() = default;
+    FrameSlot(FrameSlot&& other) noexcept : queryPool(other.queryPool) {}
+  };
+
+  double toUs(clock::time_point t) const
+  {
+    return std::chrono::duration<double, std::micro>(t - epoch).count();
+  }
+
+  void addEvent(const char* name, uint32_t thread, double startUs, double durationUs)
+  {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    if (events.size() >= MAX_TRACE_EVENTS)
+    {
+      droppedEvents++;
+      return;
+    }
+    events.push_back({name, thread, startUs, durationUs});
+  }
+
+  void collectGpuResults(FrameSlot& slot)
+  {
+    uint32_t zoneCount = std::min(slot.zoneCount.load(), MAX_GPU_ZONES);
+    if (zoneCount == 0)
+      return; // Slot hasn't been used yet
+
+    // Value and availability for each query. The frame has finished so everything is
+    // available, the availability bit just guards against zones that were never closed.
+    std::vector<uint64_t> results(zoneCount * 2 * 2);
+    VkResult result = vkGetQueryPoolResults(device, slot.queryPool, 0, zoneCount * 2,
+                                            results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+                                            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (result != VK_SUCCESS && result != VK_NOT_READY)
+      return;
+
+    auto timestamp = [&](uint32_t query){ return results[query * 2] & timestampMask; };
+    auto available = [&](uint32_t query){ return results[query * 2 + 1] != 0; };
+
+    if (slot.frameZone >= zoneCount || !available(slot.frameZone * 2))
+      return;
+
+    const uint64_t frameStart = timestamp(slot.frameZone * 2);
+    const double submitUs = toUs(slot.submitTime);
+    const double nsPerTick = timestampPeriod;
+
+    for (uint32_t zone = 0; zone < zoneCount; ++zone)
+    {
+      if (!available(zone * 2) || !available(zone * 2 + 1))
+        continue;
+
+      uint64_t begin = timestamp(zone * 2);
+      uint64_t end = timestamp(zone * 2 + 1);
+      double startUs = submitUs + (double)(begin - frameStart) * nsPerTick / 1000.0;
+      double durationUs = (double)(end - begin) * nsPerTick / 1000.0;
+      addEvent(slot.zoneNames[zone], GPU_THREAD_ID, startUs, durationUs);
+
+      if (zone == slot.frameZone)
+        recordGpuFrameTime(durationUs / 1000.0);
+    }
+  }
+
+  void recordFrameTime(double ms)
+  {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    pushRolling(cpuFrameTimes, cpuFrameCursor, ms);
+  }
+
+  void recordGpuFrameTime(double ms)
+  {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    pushRolling(gpuFrameTimes, gpuFrameCursor, ms);
+  }
+
+  static void pushRolling(std::vector<double>& window, size_t& cursor, double value)
+  {
+    if (window.size() < FRAME_WINDOW)
+    {
+      window.push_back(value);
+    }else{
+      window[cursor] = value;
+      cursor = (cursor + 1) % FRAME_WINDOW;
+    }
+  }
+
+  static double percentile(std::vector<double> values, double p)
+  {
+    size_t index = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  float timestampPeriod = 1.0f;
+  uint64_t timestampMask = ~0ull;
+  bool gpuEnabled = false;
+  std::vector<FrameSlot> slots;
+  uint32_t currentSlot = 0;
+
+  const clock::time_point epoch = clock::now();
+  mutable std::mutex eventMutex;
+  std::vector<Event> events;
+  size_t droppedEvents = 0;
+
+  mutable std::mutex statsMutex;
+  std::vector<double> cpuFrameTimes;
+  std::vector<double> gpuFrameTimes;
+  size_t cpuFrameCursor = 0;
+  size_t gpuFrameCursor = 0;
+  clock::time_point lastFrameStart{};
+  bool frameStarted = false;
+};
+
+inline Profiler profiler;
+
+struct ProfileScope
+{
+  const char* name;
+  Profiler::clock::time_point start;
+
+  explicit ProfileScope(const char* name) : name(name), start(Profiler::clock::now()) {}
+  ~ProfileScope() { profiler.addCpuEvent(name, Profiler::threadId(), start, Profiler::clock::now()); }
+};
+
+struct GpuProfileScope
+{
+  VkCommandBuffer commandBuffer;
+  uint32_t zone;
+
+  GpuProfileScope(VkCommandBuffer commandBuffer, const char* name)
+    : commandBuffer(commandBuffer), zone(profiler.beginGpuZone(commandBuffer, name)) {}
+  ~GpuProfileScope() { profiler.endGpuZone(commandBuffer, zone); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#define PROFILE_SCOPE(name)                         ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(commandBuffer, name)      GpuProfileScope PROFILE_CONCAT(gpuProfileScope, __LINE__)(commandBuffer, name)
+#define PROFILE_INIT_GPU(device, host, physical, family, frames) profiler.initGpu(device, host, physical, family, frames)
+#define PROFILE_SHUTDOWN()                          profiler.shutdown()
+#define PROFILE_TASK_GRAPH(graph)                   profiler.addTaskGraph(graph)
+#define PROFILE_BEGIN_FRAME(commandBuffer, slot)    profiler.beginFrame(commandBuffer, slot)
+#define PROFILE_END_GPU_FRAME(commandBuffer)        profiler.endGpuFrame(commandBuffer)
+#define PROFILE_SUBMIT(slot)                        profiler.markSubmit(slot)
+#define PROFILE_PRINT_STATS(out)                    profiler.printFrameStats(out)
+#define PROFILE_WRITE_TRACE(path)                   profiler.writeChromeTrace(path)
+#define PROFILE_GPU_FRAME_MS()                      profiler.gpuFrameMs()
+#define PROFILE_RESET_STATS()                       profiler.resetFrameStats()
+
+#else
+
+#define PROFILE_SCOPE(name)                         ((void)0)
+#define PROFILE_GPU_SCOPE(commandBuffer, name)      ((void)0)
+#define PROFILE_INIT_GPU(device, host, physical, family, frames) ((void)0)
+#define PROFILE_SHUTDOWN()                          ((void)0)
+#define PROFILE_TASK_GRAPH(graph)                   ((void)0)
+#define PROFILE_BEGIN_FRAME(commandBuffer, slot)    ((void)0)
+#define PROFILE_END_GPU_FRAME(commandBuffer)        ((void)0)
+#define PROFILE_SUBMIT(slot)                        ((void)0)
+#define PROFILE_PRINT_STATS(out)                    ((void)0)
+#define PROFILE_WRITE_TRACE(path)                   ((void)0)
+#define PROFILE_GPU_FRAME_MS()                      (0.0)
+#define PROFILE_RESET_STATS()                       ((void)0)
+
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+
+// SPIR-V without copies.
+//
+// vkCreateShaderModule wants the code as 32 bit words. A file is mapped into memory instead of
+// read into a buffer: the mapping starts on a page boundary, so the words are aligned without
+// relying on what an allocator happens to return, and the pages come straight from the page
+// cache. Shaders compiled into the program (-DEMBED_SHADERS) are viewed in place the same way,
+// there is no file I/O for them at all.
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class ShaderCode
+{
+public:
+  static const uint32_t SPIRV_MAGIC = 0x07230203;
+
+  ShaderCode() = default;
+  ~ShaderCode() { release(); }
+
+  ShaderCode(ShaderCode&& other) noexcept { *this = std::move(other); }
+  ShaderCode& operator=(ShaderCode&& other) noexcept
+  {
+    if (this != &other)
+    {
+      release();
+      std::swap(words, other.words);
+      std::swap(bytes, other.bytes);
+      std::swap(mapped, other.mapped);
+    }
+    return *this;
+  }
+
+  ShaderCode(const ShaderCode&) = delete;
+  ShaderCode& operator=(const ShaderCode&) = delete;
+
+  static ShaderCode map(const std::string& path)
+  {
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+      throw std::runtime_error("failed to open shader " + path + ".");
+
+    struct stat status;
+    if (fstat(file, &status) != 0 || status.st_size == 0)
+    {
+      close(file);
+      throw std::runtime_error("failed to read shader " + path + ".");
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    void* data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE | MAP_POPULATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("failed to map shader " + path + ".");
+
+    ShaderCode code;
+    code.words = static_cast<const uint32_t*>(data);
+    code.bytes = static_cast<size_t>(status.st_size);
+    code.mapped = true;
+    code.validate(path);
+    return code;
+  }
+
+  // Views words that outlive the ShaderCode, the embedded arrays
+  static ShaderCode view(const uint32_t* words, size_t bytes, const std::string& name)
+  {
+    ShaderCode code;
+    code.words = words;
+    code.bytes = bytes;
+    code.validate(name);
+    return code;
+  }
+
+  void release()
+  {
+    if (mapped)
+      munmap(const_cast<uint32_t*>(words), bytes);
+    words = nullptr;
+    bytes = 0;
+    mapped = false;
+  }
+
+  const uint32_t* data() const { return words; }
+  size_t size() const { return bytes; } // In bytes, what VkShaderModuleCreateInfo::codeSize takes
+  bool empty() const { return bytes == 0; }
+
+private:
+  void validate(const std::string& name)
+  {
+    if (bytes % sizeof(uint32_t) != 0 || bytes < 5 * sizeof(uint32_t) || words[0] != SPIRV_MAGIC)
+    {
+      release();
+      throw std::runtime_error(name + " is not SPIR-V.");
+    }
+  }
+
+  const uint32_t* words = nullptr;
+  size_t bytes = 0;
+  bool mapped = false;
+};
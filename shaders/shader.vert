@@ -1,7 +1,44 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+// Per instance, see createInstanceBuffer. The transform places the triangle inside the
+// cell of its draw, the color tints it.
+layout (location = 0) in mat4 instanceTransform; // Takes locations 0-3
+layout (location = 4) in vec4 instanceColor;
 
 layout (location = 0) out vec3 fragColor;
 
+// Which object and material this draw uses, see recordSceneDraws
+layout (push_constant) uniform DrawConstants
+{
+  uint object;   // Index into objects
+  uint material; // Slot in the bindless buffer table
+} draw;
+
+// Per frame data out of the frame ring, see frame_ring.h. Both are bound with dynamic offsets.
+layout (set = 2, binding = 0) uniform Camera
+{
+  mat4 viewProjection;
+} camera;
+
+// Where a draw puts the triangle
+struct ObjectData
+{
+  vec2 offset;
+  float scale;
+};
+
+layout (std430, set = 2, binding = 1) readonly buffer Objects
+{
+  ObjectData objects[];
+};
+
+// The bindless storage buffer table, see bindless.h. The index is the same for the whole draw.
+layout (std430, set = 1, binding = 0) readonly buffer Material
+{
+  vec4 tint;
+} materials[];
+
 vec2 positions[3] = vec2[](
   vec2( 0.0, -0.5),
   vec2( 0.5,  0.5),
@@ -16,6 +53,9 @@ vec3 colors[3] = vec3[](
 
 void main()
 {
-  gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-  fragColor = colors[gl_VertexIndex];
+  // The instance places the triangle in depth as well, see --layers
+  vec4 position = instanceTransform * vec4(positions[gl_VertexIndex], 0.0, 1.0);
+  ObjectData object = objects[draw.object];
+  gl_Position = camera.viewProjection * vec4(position.xy * object.scale + object.offset, position.z, 1.0);
+  fragColor = colors[gl_VertexIndex] * instanceColor.rgb * materials[draw.material].tint.rgb;
 }
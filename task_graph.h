@@ -0,0 +1,297 @@
+#pragma once
+
+// A small thread pool and a dependency graph that runs on top of it.
+// Used to overlap the independent parts of Vulkan startup (see initVulkan).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+  // A pool with zero threads is valid, TaskGraph then runs everything on the calling thread.
+  explicit ThreadPool(uint32_t threadCount)
+  {
+    for (uint32_t i = 0; i < threadCount; ++i)
+      workers.emplace_back([this, i]{ workerLoop(i + 1); });
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_all();
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void submit(std::function<void()> job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(job));
+    }
+    condition.notify_one();
+  }
+
+  uint32_t size() const { return static_cast<uint32_t>(workers.size()); }
+
+  // 0 for the thread that owns the pool, 1..size() for the workers.
+  static uint32_t currentThreadIndex() { return threadIndex; }
+
+private:
+  void workerLoop(uint32_t index)
+  {
+    threadIndex = index;
+    for (;;)
+    {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]{ return stopping || !jobs.empty(); });
+        if (stopping && jobs.empty())
+          return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+  static inline thread_local uint32_t threadIndex = 0;
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping = false;
+};
+
+// Nodes are added in an order where every dependency already exists, so the insertion order
+// is always a valid serial schedule. run() starts every node as soon as its dependencies are
+// done and records when each one started and finished.
+class TaskGraph
+{
+public:
+  using NodeId = size_t;
+  using clock = std::chrono::steady_clock;
+
+  NodeId addNode(const char* name, std::function<void()> work, std::initializer_list<NodeId> dependencies = {})
+  {
+    NodeId id = nodes.size();
+    nodes.push_back(Node{name, std::move(work), std::vector<NodeId>(dependencies)});
+    for (NodeId dependency : dependencies)
+      nodes[dependency].dependents.push_back(id);
+    return id;
+  }
+
+  // Blocks until every node has run. If a node throws, nodes that haven't started yet are
+  // skipped and the first exception is rethrown once the graph has drained.
+  void run(ThreadPool& pool)
+  {
+    runStart = clock::now();
+    firstError = nullptr;
+    finishedCount = 0;
+    for (auto& node : nodes)
+      node.remainingDependencies = static_cast<uint32_t>(node.dependencies.size());
+
+    if (pool.size() == 0)
+    {
+      for (NodeId id = 0; id < nodes.size(); ++id)
+        execute(id);
+    }else{
+      for (NodeId id = 0; id < nodes.size(); ++id)
+      {
+        if (nodes[id].dependencies.empty())
+          pool.submit([this, &pool, id]{ runNode(pool, id); });
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      finishedCondition.wait(lock, [this]{ return finishedCount == nodes.size(); });
+    }
+
+    if (firstError)
+      std::rethrow_exception(firstError);
+  }
+
+  // Wall clock time of the last run
+  double totalMs() const
+  {
+    double end = 0;
+    for (const auto& node : nodes)
+      end = std::max(end, toMs(node.end));
+    return end;
+  }
+
+  // f(name, thread, start, end) for every node of the last run
+  template<typename F>
+  void forEachNode(F f) const
+  {
+    for (const auto& node : nodes)
+      f(node.name, node.thread, node.start, node.end);
+  }
+
+  void printTimings(std::ostream& out) const
+  {
+    out << "Startup task graph (" << totalMs() << " ms wall clock)\n";
+    out << "  " << std::left << std::setw(24) << "stage" << std::right
+        << std::setw(10) << "start" << std::setw(10) << "end" << std::setw(10) << "ms" << std::setw(8) << "thread" << "\n";
+    for (const auto& node : nodes)
+    {
+      out << "  " << std::left << std::setw(24) << node.name << std::right << std::fixed << std::setprecision(2)
+          << std::setw(10) << toMs(node.start) << std::setw(10) << toMs(node.end)
+          << std::setw(10) << toMs(node.end) - toMs(node.start) << std::setw(8) << node.thread << "\n";
+    }
+    out << std::defaultfloat;
+
+    double pathMs = 0;
+    std::vector<const char*> path = criticalPath(pathMs);
+    if (path.empty())
+      return;
+    out << "  critical path (" << pathMs << " ms):";
+    for (size_t i = 0; i < path.size(); ++i)
+      out << (i == 0 ? " " : " -> ") << path[i];
+    out << std::endl;
+  }
+
+  // The chain of dependencies with the largest summed duration, first node first.
+  // Nothing we parallelize off of it can make startup faster.
+  std::vector<const char*> criticalPath(double& ms) const
+  {
+    ms = 0;
+    if (nodes.empty())
+      return {};
+
+    std::vector<double> pathMs(nodes.size(), 0);
+    std::vector<NodeId> previous(nodes.size(), nodes.size());
+    for (NodeId id = 0; id < nodes.size(); ++id)
+    {
+      double longest = 0;
+      for (NodeId dependency : nodes[id].dependencies)
+      {
+        if (pathMs[dependency] > longest)
+        {
+          longest = pathMs[dependency];
+          previous[id] = dependency;
+        }
+      }
+      pathMs[id] = longest + toMs(nodes[id].end) - toMs(nodes[id].start);
+    }
+
+    NodeId last = std::max_element(pathMs.begin(), pathMs.end()) - pathMs.begin();
+    std::vector<const char*> path;
+    for (NodeId id = last; id != nodes.size(); id = previous[id])
+      path.push_back(nodes[id].name);
+    std::reverse(path.begin(), path.end());
+    ms = pathMs[last];
+    return path;
+  }
+
+  // The timings of the last run as a JSON object, node names are plain identifiers
+  void writeJson(std::ostream& out) const
+  {
+    out << std::fixed << std::setprecision(3);
+    out << "{\"totalMs\":" << totalMs() << ",\"stages\":[";
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+      const Node& node = nodes[i];
+      out << (i ? "," : "") << "\n    {\"name\":\"" << node.name << "\",\"thread\":" << node.thread
+          << ",\"startMs\":" << toMs(node.start) << ",\"endMs\":" << toMs(node.end)
+          << ",\"ms\":" << toMs(node.end) - toMs(node.start) << "}";
+    }
+    double pathMs = 0;
+    std::vector<const char*> path = criticalPath(pathMs);
+    out << "],\n  \"criticalPath\":{\"ms\":" << pathMs << ",\"stages\":[";
+    for (size_t i = 0; i < path.size(); ++i)
+      out << (i ? "," : "") << "\"" << path[i] << "\"";
+    out << "]}}" << std::defaultfloat;
+  }
+
+private:
+  struct Node
+  {
+    const char* name;
+    std::function<void()> work;
+    std::vector<NodeId> dependencies;
+    std::vector<NodeId> dependents;
+    std::atomic<uint32_t> remainingDependencies{0};
+    clock::time_point start{};
+    clock::time_point end{};
+    uint32_t thread = 0;
+
+    Node(const char* name, std::function<void()> work, std::vector<NodeId> dependencies)
+      : name(name), work(std::move(work)), dependencies(std::move(dependencies)) {}
+    Node(Node&& other) noexcept
+      : name(other.name), work(std::move(other.work)), dependencies(std::move(other.dependencies)),
+        dependents(std::move(other.dependents)) {}
+  };
+
+  double toMs(clock::time_point t) const
+  {
+    return std::chrono::duration<double, std::milli>(t - runStart).count();
+  }
+
+  void execute(NodeId id)
+  {
+    Node& node = nodes[id];
+    node.thread = ThreadPool::currentThreadIndex();
+    node.start = clock::now();
+    bool failed;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      failed = firstError != nullptr;
+    }
+    if (!failed)
+    {
+      try{
+        node.work();
+      }catch(...){
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!firstError)
+          firstError = std::current_exception();
+      }
+    }
+    node.end = clock::now();
+  }
+
+  void runNode(ThreadPool& pool, NodeId id)
+  {
+    execute(id);
+
+    for (NodeId dependent : nodes[id].dependents)
+    {
+      if (nodes[dependent].remainingDependencies.fetch_sub(1) == 1)
+        pool.submit([this, &pool, dependent]{ runNode(pool, dependent); });
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      finishedCount++;
+    }
+    finishedCondition.notify_one();
+  }
+
+  std::vector<Node> nodes;
+  clock::time_point runStart{};
+  std::mutex mutex;
+  std::condition_variable finishedCondition;
+  size_t finishedCount = 0;
+  std::exception_ptr firstError;
+};
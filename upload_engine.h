@@ -0,0 +1,408 @@
+#pragma once
+
+// Streams buffer and image data to the GPU on the transfer queue.
+//
+// Data is copied into a persistently mapped staging ring buffer and the copies are recorded
+// into batches that are submitted with flush(). Every batch signals the next value of a
+// timeline semaphore, so the ring space and command buffer of a batch can be reused as soon
+// as the semaphore has passed that value, without fences and without waiting on the graphics
+// queue. If the transfer queue lives in its own family the resources are released to the
+// graphics family at the end of the batch, and the graphics side picks them up with
+// acquireOnGraphics() in the frame that first uses them.
+//
+// Not thread safe, everything is called from the render thread.
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "host_allocator.h"
+#include "device_memory.h"
+
+class UploadEngine
+{
+public:
+  static const VkDeviceSize DEFAULT_RING_SIZE = 64ull << 20;
+
+  // Stages where uploaded data may be consumed. Used as the semaphore wait stage of the
+  // graphics submit and as the scope of the ownership barriers.
+  static const VkPipelineStageFlags CONSUMER_STAGES =
+    VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+  static const VkAccessFlags CONSUMER_ACCESS =
+    VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT |
+    VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+
+  void init(VkDevice device, HostAllocator& hostAllocator, DeviceMemoryAllocator& allocator, VkPhysicalDevice physicalDevice,
+            uint32_t graphicsFamily, uint32_t transferFamily, VkQueue transferQueue,
+            VkDeviceSize ringSize = DEFAULT_RING_SIZE)
+  {
+    this->device = device;
+    this->host = &hostAllocator;
+    this->allocator = &allocator;
+    this->graphicsFamily = graphicsFamily;
+    this->transferFamily = transferFamily;
+    this->transferQueue = transferQueue;
+    this->ringSize = ringSize;
+
+    // Image copies need offsets that are a multiple of the texel size and 4, 16 covers every
+    // format we use. Some drivers copy faster from even larger alignments.
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    alignment = std::max<VkDeviceSize>(16, properties.limits.optimalBufferCopyOffsetAlignment);
+
+    allocator.createBuffer(ringSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                           ringBuffer, ringMemory);
+
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &typeInfo;
+    if (vkCreateSemaphore(device, &semaphoreInfo, host->callbacks(VK_OBJECT_TYPE_SEMAPHORE), &timeline) != VK_SUCCESS)
+      throw std::runtime_error("failed to create upload timeline semaphore.");
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = transferFamily;
+    if (vkCreateCommandPool(device, &poolInfo, host->callbacks(VK_OBJECT_TYPE_COMMAND_POOL), &commandPool) != VK_SUCCESS)
+      throw std::runtime_error("failed to create upload command pool.");
+  }
+
+  void shutdown()
+  {
+    if (device == VK_NULL_HANDLE)
+      return;
+    flush();
+    wait(lastSubmitted);
+    vkDestroyCommandPool(device, commandPool, host->callbacks(VK_OBJECT_TYPE_COMMAND_POOL));
+    vkDestroySemaphore(device, timeline, host->callbacks(VK_OBJECT_TYPE_SEMAPHORE));
+    allocator->destroyBuffer(ringBuffer, ringMemory);
+    device = VK_NULL_HANDLE;
+  }
+
+  // The buffer must have been created with VK_BUFFER_USAGE_TRANSFER_DST_BIT. Large uploads are
+  // split into chunks so they can stream through a ring smaller than the data.
+  void uploadBuffer(VkBuffer buffer, VkDeviceSize bufferOffset, const void* data, VkDeviceSize size)
+  {
+    const VkDeviceSize maxChunk = ringSize / 4;
+    for (VkDeviceSize done = 0; done < size; )
+    {
+      VkDeviceSize chunk = std::min(maxChunk, size - done);
+      VkDeviceSize offset = reserve(chunk);
+      std::memcpy(static_cast<char*>(ringMemory.mapped) + offset, static_cast<const char*>(data) + done, chunk);
+
+      VkBufferCopy region{};
+      region.srcOffset = offset;
+      region.dstOffset = bufferOffset + done;
+      region.size = chunk;
+      vkCmdCopyBuffer(commandBuffer(), ringBuffer, buffer, 1, &region);
+      done += chunk;
+    }
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.buffer = buffer;
+    barrier.offset = bufferOffset;
+    barrier.size = size;
+    releaseBuffer(barrier);
+    stats.bytes += size;
+  }
+
+  // Uploads a whole single mip, single layer color image. The image ends up in finalLayout.
+  void uploadImage(VkImage image, VkExtent3D extent, VkDeviceSize texelSize, const void* data, VkImageLayout finalLayout)
+  {
+    const VkDeviceSize size = texelSize * extent.width * extent.height * extent.depth;
+    if (size > ringSize / 2)
+      throw std::runtime_error("image is too large for the upload ring.");
+
+    VkDeviceSize offset = reserve(size);
+    std::memcpy(static_cast<char*>(ringMemory.mapped) + offset, data, size);
+
+    VkImageMemoryBarrier toTransfer{};
+    toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    toTransfer.srcAccessMask = 0;
+    toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    toTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.image = image;
+    toTransfer.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &toTransfer);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = offset;
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = extent;
+    vkCmdCopyBufferToImage(commandBuffer(), ringBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    // The layout transition happens as part of the ownership transfer
+    VkImageMemoryBarrier barrier = toTransfer;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = finalLayout;
+    releaseImage(barrier);
+    stats.bytes += size;
+  }
+
+  // Submits everything recorded since the last flush. Returns the timeline value that is
+  // reached once the batch has finished, or the value of the previous batch if there was nothing to submit.
+  uint64_t flush()
+  {
+    if (recording == VK_NULL_HANDLE)
+      return lastSubmitted;
+
+    if (vkEndCommandBuffer(recording) != VK_SUCCESS)
+      throw std::runtime_error("failed to record upload command buffer.");
+
+    uint64_t value = ++lastSubmitted;
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &value;
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &recording;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &timeline;
+    if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+      throw std::runtime_error("failed to submit upload batch.");
+
+    inFlight.push_back(Batch{recording, value, head});
+    recording = VK_NULL_HANDLE;
+
+    for (auto& barrier : recordedBufferReleases)
+      flushedBufferAcquires.push_back(barrier);
+    for (auto& barrier : recordedImageReleases)
+      flushedImageAcquires.push_back(barrier);
+    recordedBufferReleases.clear();
+    recordedImageReleases.clear();
+    graphicsWaitValue = value;
+    stats.batches++;
+    return value;
+  }
+
+  // Records the acquire half of the ownership transfers for everything flushed since the last
+  // call. Returns the timeline value the submit of commandBuffer has to wait for at
+  // CONSUMER_STAGES, or 0 if no uploads are pending.
+  uint64_t acquireOnGraphics(VkCommandBuffer commandBuffer)
+  {
+    if (!flushedBufferAcquires.empty() || !flushedImageAcquires.empty())
+    {
+      vkCmdPipelineBarrier(commandBuffer, CONSUMER_STAGES, CONSUMER_STAGES, 0, 0, nullptr,
+                           static_cast<uint32_t>(flushedBufferAcquires.size()), flushedBufferAcquires.data(),
+                           static_cast<uint32_t>(flushedImageAcquires.size()), flushedImageAcquires.data());
+      flushedBufferAcquires.clear();
+      flushedImageAcquires.clear();
+    }
+
+    uint64_t value = graphicsWaitValue;
+    graphicsWaitValue = 0;
+    return value;
+  }
+
+  // Blocks the CPU until the batch with the given timeline value has finished
+  void wait(uint64_t value)
+  {
+    if (value == 0)
+      return;
+
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &timeline;
+    waitInfo.pValues = &value;
+    vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+    retire();
+  }
+
+  VkSemaphore timelineSemaphore() const { return timeline; }
+  bool hasDedicatedQueue() const { return transferFamily != graphicsFamily; }
+
+  struct Stats
+  {
+    uint64_t bytes = 0;
+    uint64_t batches = 0;
+    uint64_t ringStalls = 0;   // Times an upload had to wait for the GPU to free ring space
+    double ringStallMs = 0;
+  };
+
+  const Stats& getStats() const { return stats; }
+
+  void printStats(std::ostream& out) const
+  {
+    out << "Upload engine (" << (hasDedicatedQueue() ? "dedicated transfer queue family " : "graphics queue family ")
+        << transferFamily << ", " << ringSize / 1048576 << " MiB ring): "
+        << stats.bytes / 1048576.0 << " MiB in " << stats.batches << " batch(es), "
+        << stats.ringStalls << " ring stall(s) totalling " << stats.ringStallMs << " ms" << std::endl;
+  }
+
+private:
+  struct Batch
+  {
+    VkCommandBuffer commandBuffer;
+    uint64_t value;
+    uint64_t ringHead; // Everything before this in the ring is free once the batch is done
+  };
+
+  // head and tail count bytes since the start and only ever grow, the ring offset is the value modulo ringSize
+  VkDeviceSize reserve(VkDeviceSize size)
+  {
+    if (size > ringSize)
+      throw std::runtime_error("upload is larger than the staging ring.");
+
+    for (;;)
+    {
+      uint64_t position = (head + alignment - 1) / alignment * alignment;
+      if (position % ringSize + size > ringSize)
+        position += ringSize - position % ringSize; // Doesn't fit before the end, skip to the start
+      if (position + size - tail <= ringSize)
+      {
+        head = position + size;
+        return position % ringSize;
+      }
+
+      retire();
+      position = (head + alignment - 1) / alignment * alignment;
+      if (position % ringSize + size > ringSize)
+        position += ringSize - position % ringSize;
+      if (position + size - tail <= ringSize)
+        continue;
+
+      // The ring is full of work that hasn't finished yet. Make sure the batch we are recording
+      // doesn't hold the space we are waiting for, then wait for the oldest batch.
+      auto start = std::chrono::steady_clock::now();
+      flush();
+      wait(inFlight.front().value);
+      stats.ringStalls++;
+      stats.ringStallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  void retire()
+  {
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(device, timeline, &completed);
+    while (!inFlight.empty() && inFlight.front().value <= completed)
+    {
+      tail = inFlight.front().ringHead;
+      freeCommandBuffers.push_back(inFlight.front().commandBuffer);
+      inFlight.pop_front();
+    }
+  }
+
+  VkCommandBuffer commandBuffer()
+  {
+    if (recording != VK_NULL_HANDLE)
+      return recording;
+
+    retire();
+    if (freeCommandBuffers.empty())
+    {
+      VkCommandBufferAllocateInfo allocInfo{};
+      allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      allocInfo.commandPool = commandPool;
+      allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      allocInfo.commandBufferCount = 1;
+      if (vkAllocateCommandBuffers(device, &allocInfo, &recording) != VK_SUCCESS)
+        throw std::runtime_error("failed to allocate upload command buffer.");
+    }else{
+      recording = freeCommandBuffers.back();
+      freeCommandBuffers.pop_back();
+      vkResetCommandBuffer(recording, 0);
+    }
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(recording, &beginInfo);
+    return recording;
+  }
+
+  // With a separate transfer family the barrier is a release, the graphics queue repeats it as
+  // an acquire. Within one family it is an ordinary barrier that makes the copy visible to later submits.
+  void releaseBuffer(VkBufferMemoryBarrier barrier)
+  {
+    if (hasDedicatedQueue())
+    {
+      barrier.dstAccessMask = 0;
+      barrier.srcQueueFamilyIndex = transferFamily;
+      barrier.dstQueueFamilyIndex = graphicsFamily;
+      vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                           0, 0, nullptr, 1, &barrier, 0, nullptr);
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = CONSUMER_ACCESS;
+      recordedBufferReleases.push_back(barrier);
+    }else{
+      barrier.dstAccessMask = CONSUMER_ACCESS;
+      barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, CONSUMER_STAGES,
+                           0, 0, nullptr, 1, &barrier, 0, nullptr);
+    }
+  }
+
+  void releaseImage(VkImageMemoryBarrier barrier)
+  {
+    if (hasDedicatedQueue())
+    {
+      barrier.dstAccessMask = 0;
+      barrier.srcQueueFamilyIndex = transferFamily;
+      barrier.dstQueueFamilyIndex = graphicsFamily;
+      vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                           0, 0, nullptr, 0, nullptr, 1, &barrier);
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = CONSUMER_ACCESS;
+      recordedImageReleases.push_back(barrier);
+    }else{
+      barrier.dstAccessMask = CONSUMER_ACCESS;
+      vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, CONSUMER_STAGES,
+                           0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  HostAllocator* host = nullptr;
+  DeviceMemoryAllocator* allocator = nullptr;
+  uint32_t graphicsFamily = 0;
+  uint32_t transferFamily = 0;
+  VkQueue transferQueue = VK_NULL_HANDLE;
+
+  VkBuffer ringBuffer = VK_NULL_HANDLE;
+  DeviceAllocation ringMemory;
+  VkDeviceSize ringSize = 0;
+  VkDeviceSize alignment = 16;
+  uint64_t head = 0;
+  uint64_t tail = 0;
+
+  VkSemaphore timeline = VK_NULL_HANDLE;
+  uint64_t lastSubmitted = 0;
+  uint64_t graphicsWaitValue = 0;
+
+  VkCommandPool commandPool = VK_NULL_HANDLE;
+  VkCommandBuffer recording = VK_NULL_HANDLE;
+  std::vector<VkCommandBuffer> freeCommandBuffers;
+  std::deque<Batch> inFlight;
+
+  std::vector<VkBufferMemoryBarrier> recordedBufferReleases; // Released in the batch being recorded
+  std::vector<VkImageMemoryBarrier> recordedImageReleases;
+  std::vector<VkBufferMemoryBarrier> flushedBufferAcquires;  // Submitted, waiting for acquireOnGraphics
+  std::vector<VkImageMemoryBarrier> flushedImageAcquires;
+
+  Stats stats;
+};
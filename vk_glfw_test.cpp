@@ -7,6 +7,7 @@
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/vec4.hpp>
 #include <glm/mat4x4.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include <iostream>
 #include <vector>
@@ -14,8 +15,35 @@
 #include <optional>
 #include <set>
 #include <cstdint>
+#include <cstddef>
 #include <algorithm>
 #include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <cstdio>
+#include <thread>
+#include <random>
+#include <atomic>
+#include <array>
+
+#include "task_graph.h"
+#include "profiler.h"
+#include "device_memory.h"
+#include "upload_engine.h"
+#include "command_recorder.h"
+#include "depth_pyramid.h"
+#include "gpu_culling.h"
+#include "pipeline_factory.h"
+#include "bindless.h"
+#include "frame_ring.h"
+#include "instance_kernels.h"
+#include "shader_code.h"
+#include "host_allocator.h"
+#include "debug_log.h"
+#include "async_compute.h"
+#include <cmath>
+#include <deque>
 
 const std::vector<char const *> validationLayers =
 {
@@ -32,8 +60,116 @@ const bool enableValidationLayers = true;
 const bool enableValidationLayers = false;
 #endif
 
+// Validation messages go through debugLog, see debug_log.h. Async hands them to a writer thread,
+// sync writes them in the callback (--log). Only --log-level and above are written.
+DebugLog debugLog;
+DebugLog::Mode debugLogMode = DebugLog::Mode::Async;
+
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
+
+// How many frames the CPU may record ahead of the GPU. While the GPU renders frame N
+// the CPU is already recording frame N+1. Set with --frames-in-flight (1-4).
+const uint32_t MAX_FRAMES_IN_FLIGHT = 4;
+uint32_t framesInFlight = 2;
+
+// Headless mode renders into device owned images instead of a swapchain, so it runs without
+// a display or surface extensions (e.g. on lavapipe). Frames are counted with --frames and the
+// last one can be written to disk with --readback.
+bool headless = false;
+uint64_t frameLimit = 0;  // 0 means run until the window is closed
+std::string readbackPath;
+
+// Compiled pipelines are kept on disk between runs, see createPipelineCache. A cache is
+// "warm" if it was loaded from disk and matched the current device and driver.
+std::string pipelineCachePath = "pipeline_cache.bin";
+bool pipelineCacheWarm = false;
+
+// The pipeline factory keeps up to pipelineCapacity pipelines (--pipeline-lru) and builds
+// prefetched ones on pipelineBuildThreads threads (--pipeline-threads, 0 builds them right away).
+uint32_t pipelineCapacity = 64;
+uint32_t pipelineBuildThreads = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+// initVulkan runs its stages as a dependency graph on this many worker threads, 0 runs them
+// one after another on the main thread (--serial-init).
+uint32_t initThreads = std::max(1u, std::thread::hardware_concurrency());
+std::chrono::steady_clock::time_point programStart;
+
+// Chrome trace written at exit when built with ENABLE_PROFILER
+std::string tracePath = "trace.json";
+
+// Every launch writes how long each initVulkan stage and pipeline build took as JSON
+// (--startup-report, an empty path turns it off). --startup-bench N starts up and tears down N
+// times instead of rendering and writes the distribution of every stage to the same file.
+std::string startupReportPath = "startup.json";
+uint32_t startupBenchRuns = 0;
+bool creationFeedbackEnabled = false; // VK_EXT_pipeline_creation_feedback or Vulkan 1.3
+
+struct StartupRun
+{
+  double totalMs;
+  std::vector<std::pair<const char*, double>> stages; // Name and ms, in graph order
+};
+std::vector<StartupRun> startupRuns; // One per initVulkan
+
+// The scene is a grid of sceneDrawCount triangles, one draw each (--draws). The draws are
+// recorded into secondary command buffers on recordThreads threads, 0 records them inline
+// in the primary command buffer on the render thread (--record-threads).
+uint32_t sceneDrawCount = 1;
+uint32_t recordThreads = std::max(1u, std::thread::hardware_concurrency());
+
+// Per instance work on the CPU goes through the SoA kernels in instance_kernels.h, using the best
+// instruction set the CPU has up to simdLevel (--simd) on simdThreads threads (--simd-threads).
+SimdLevel simdLevel = SimdLevel::AVX2;
+uint32_t simdThreads = std::max(1u, std::thread::hardware_concurrency() / 2);
+InstanceKernels instanceKernels;
+
+// --gpu-cull turns the instances into objects that a compute pass culls against the view frustum
+// and the depth of the previous frame, drawn with one indirect draw instead of sceneDrawCount draws.
+// --no-occlusion keeps only the frustum test. --zoom scales the view, the scene is a square filling
+// the screen at 1. --layers stacks that many copies of the instance grid behind each other, each
+// one enlarged until it covers the screen, a dense scene where only the front layer is visible.
+bool gpuCulling = false;
+bool occlusionCulling = true;
+float cameraZoom = 1.0f;
+uint32_t sceneLayers = 1;
+
+// --compute-load N runs a particle simulation of N iterations per frame on the compute queue,
+// see async_compute.h. A frame consumes the previous frame's step so the two overlap, with
+// --serialize-compute it waits for its own step instead. --single-queue-compute submits the
+// steps to the graphics queue, which is also what happens without a separate compute family.
+uint32_t computeLoad = 0;
+bool serializeCompute = false;
+bool singleQueueCompute = false;
+const uint32_t computeParticles = 1u << 18;
+
+// Present pacing. The present mode and swap chain image count can be picked at runtime
+// (--present-mode, --swapchain-images, 0 means minImageCount + 1). --low-latency holds every
+// frame back until the previous one is on screen, using VK_KHR_present_wait when the device
+// has it, so input is sampled as close to the display as possible.
+std::optional<VkPresentModeKHR> requestedPresentMode;
+uint32_t requestedImageCount = 0;
+bool lowLatency = false;
+
+// --dynamic-rendering records with vkCmdBeginRendering straight into the image views, there is no
+// render pass and no framebuffers to recreate with the swap chain. Core in Vulkan 1.3, before that
+// it needs VK_KHR_dynamic_rendering. Without either the render pass path is used.
+bool dynamicRenderingRequested = false;
+bool dynamicRendering = false; // Whether the device ended up with it
+
+// --msaa N renders the scene with N samples per pixel and resolves into the swap chain image at the
+// end of the subpass. The multisampled color and depth images never leave the tile memory of a
+// tiler, they are transient and on lazily allocated memory where the device has it. Lowered to
+// what the device supports, see chooseMsaaSamples.
+uint32_t requestedMsaaSamples = 1;
+VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+
+// --bench NAME runs a benchmark after initVulkan instead of the render loop.
+// --bench-count sets its size: buffers for alloc, KiB uploaded per frame for upload, draws for record,
+// objects for occlusion, requests for pipelines, draws for bindless, instances for simd, messages
+// for logging, submits for sync.
+std::string benchmark;
+uint64_t benchCount = 10000;
 GLFWwindow* window;
 VkInstance Instance;
 VkDebugUtilsMessengerEXT debugMessenger;
@@ -41,16 +177,208 @@ VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
 VkDevice Device = VK_NULL_HANDLE;
 VkQueue graphicsQueue;
 VkQueue presentQueue;
+VkQueue transferQueue; // Same as graphicsQueue if the device has no separate transfer family
+VkQueue computeQueue;  // Same as graphicsQueue if the device has no separate compute family
+bool dedicatedComputeQueue = false;
 VkSurfaceKHR surface;
-VkSwapchainKHR swapChain;
+VkSwapchainKHR swapChain = VK_NULL_HANDLE;
 std::vector<VkImage> swapChainImages;
 VkFormat swapChainImageFromat;
+VkSurfaceFormatKHR swapChainSurfaceFormat;
 VkExtent2D swapChainExtent;
 std::vector<VkImageView> swapChainImageViews;
 VkRenderPass renderPass;
-VkPipelineLayout pipelineLayout; // Not used yet
-VkPipeline graphicsPipeline;
+VkFormat depthFormat;
+VkImage depthImage = VK_NULL_HANDLE; // One for all frames, they render one after another on the same queue
+VkImageView depthImageView = VK_NULL_HANDLE;
+DeviceAllocation depthImageMemory;
+DepthPyramid depthPyramid;           // Built from depthImage at the end of every frame with --gpu-cull
+VkImage msaaColorImage = VK_NULL_HANDLE; // Rendered into with --msaa, resolved into the swap chain image
+VkImageView msaaColorImageView = VK_NULL_HANDLE;
+DeviceAllocation msaaColorImageMemory;
+VkPipelineLayout pipelineLayout; // Bindless sets 0 and 1, the frame ring set 2 and the draw push constants
+
+// Matches the push constant block in shader.vert
+struct DrawConstants
+{
+  uint32_t object;   // Index into this frame's ObjectData
+  uint32_t material; // Slot of the draw's material in the bindless buffer table
+};
+
+// Per frame shader data, written into frameRing every frame and read through set 2 (frame_ring.h).
+// Matches the Camera and Objects blocks in shader.vert.
+struct CameraData
+{
+  glm::mat4 viewProjection;
+};
+
+struct ObjectData
+{
+  float offset[2]; // Where the draw puts the triangle, in the camera's space
+  float scale;
+  float padding;
+};
+
+FrameRing frameRing;
+const uint32_t frameDataSet = 2;
+uint32_t cameraOffset = 0;           // This frame's dynamic offsets into frameRing
+uint32_t objectsOffset = 0;
+ObjectData* frameObjects = nullptr;  // This frame's objects, one per draw, filled by recordSceneDraws
+
+// Every resource a shader reads lives in the bindless tables, see bindless.h. Draw i uses material
+// i % materialCount (--materials), a small storage buffer with a tint. --bench bindless compares
+// against binding a descriptor set per draw, bindPerDraw switches the scene to that.
+BindlessHeap bindless;
+uint32_t materialCount = 1;
+std::vector<VkBuffer> materialBuffers;
+std::vector<DeviceAllocation> materialMemory;
+std::vector<uint32_t> materialSlots;
+bool bindPerDraw = false;
+std::vector<VkDescriptorSet> perDrawMaterialSets; // One per material, only while bindPerDraw
+std::atomic<uint64_t> descriptorBinds{0};         // vkCmdBindDescriptorSets calls by recordSceneDraws
+
+// Per instance vertex attributes, locations 0-4 in shader.vert. Every draw renders
+// instanceCount instances out of instanceBuffer (--instances).
+struct InstanceData
+{
+  glm::mat4 transform;
+  glm::vec4 color;
+};
+uint32_t instanceCount = 1;
+VkBuffer instanceBuffer = VK_NULL_HANDLE;
+DeviceAllocation instanceMemory;
+VkBuffer objectBoundsBuffer = VK_NULL_HANDLE;  // One bounding sphere per instance, only with --gpu-cull
+DeviceAllocation objectBoundsMemory;
+VkBuffer triangleIndexBuffer = VK_NULL_HANDLE; // Indirect draws are indexed, the indices just count 0 to 2
+DeviceAllocation triangleIndexMemory;
+VkPipeline graphicsPipeline;         // Looked up in pipelineFactory at the start of every frame
+PipelineFactory pipelineFactory;     // Builds and caches every graphics pipeline, see pipeline_factory.h
+PipelineKey scenePipelineKey;
+GpuCuller culler;                    // Compute pipeline and draw buffers of the --gpu-cull path
+AsyncCompute asyncCompute;           // The --compute-load simulation
+VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+
+// SPIR-V is mapped from disk and turned into a module independently of everything else,
+// createGraphicsPipeline only picks up the finished modules. See shader_code.h.
+struct ShaderSource
+{
+  const char* path = nullptr;
+  ShaderCode code{};
+  VkShaderModule module = VK_NULL_HANDLE;
+  uint64_t hash = 0; // PipelineFactory::hashCode, taken before the code is released
+};
+ShaderSource vertShader{"shaders/vert.spv"};
+ShaderSource fragShader{"shaders/frag.spv"};
+ShaderSource cullShader{"shaders/cull.spv"};
+ShaderSource pyramidShader{"shaders/hiz.spv"};
+ShaderSource simulateShader{"shaders/simulate.spv"};
+
+#ifdef EMBED_SHADERS
+// Built with -DEMBED_SHADERS the SPIR-V is part of the program and the .spv files aren't opened.
+// build.sh writes the word lists next to them with glslc -mfmt=num.
+constexpr uint32_t embeddedVert[] = {
+#include "shaders/vert.spv.inc"
+};
+constexpr uint32_t embeddedFrag[] = {
+#include "shaders/frag.spv.inc"
+};
+constexpr uint32_t embeddedCull[] = {
+#include "shaders/cull.spv.inc"
+};
+constexpr uint32_t embeddedPyramid[] = {
+#include "shaders/hiz.spv.inc"
+};
+constexpr uint32_t embeddedSimulate[] = {
+#include "shaders/simulate.spv.inc"
+};
+
+struct EmbeddedShader
+{
+  const char* path; // The file it replaces
+  const uint32_t* words;
+  size_t size;
+};
+constexpr EmbeddedShader embeddedShaders[] = {
+  {"shaders/vert.spv", embeddedVert, sizeof(embeddedVert)},
+  {"shaders/frag.spv", embeddedFrag, sizeof(embeddedFrag)},
+  {"shaders/cull.spv", embeddedCull, sizeof(embeddedCull)},
+  {"shaders/hiz.spv", embeddedPyramid, sizeof(embeddedPyramid)},
+  {"shaders/simulate.spv", embeddedSimulate, sizeof(embeddedSimulate)},
+};
+#endif
 std::vector<VkFramebuffer> swapChainFramebuffers;
+DeviceMemoryAllocator memoryAllocator;             // All buffer and image memory comes from here, see device_memory.h
+HostAllocator hostAllocator;                        // Host memory of the Vulkan objects created here, see host_allocator.h
+HostAllocator::Snapshot startupHostAllocations;     // Taken when initVulkan is done, the frames are measured from there
+std::vector<DeviceAllocation> offscreenImageMemory; // Backing memory for swapChainImages in headless mode
+UploadEngine uploadEngine;                          // Streams buffer and image data through transferQueue
+ParallelRecorder recorder;                          // Per thread command pools for the secondary command buffers
+VkCommandPool commandPool;
+std::vector<VkCommandBuffer> commandBuffers;          // One per frame in flight
+std::vector<VkSemaphore> imageAvailableSemaphores;    // One per frame in flight
+std::vector<VkSemaphore> renderFinishedSemaphores;    // One per swapchain image, the presentation engine holds it until the image is reacquired
+VkSemaphore frameTimeline;                            // Timeline of the graphics queue, a frame signals its number when it finishes
+std::vector<uint64_t> imageFrames;                    // The last frame that rendered to each swapchain image
+uint32_t currentFrame = 0;
+
+// Frames are numbered in submission order and frameTimeline counts up to the last one finished,
+// so every "is the GPU done with this" question is a comparison with completedFrames. A frame
+// slot remembers which frame it submitted last, a swapchain image which frame rendered to it.
+uint64_t submittedFrames = 0;
+uint64_t completedFrames = 0;
+std::vector<uint64_t> frameSlotNumbers;
+uint64_t frameSyncCalls = 0; // Waits and counter queries on frameTimeline, see waitForFrame
+
+// A resize swaps in a new swap chain without waiting for the device. The old one and
+// everything created from it is kept here until the frames that used it are done.
+struct RetiredSwapChain
+{
+  VkSwapchainKHR swapChain;
+  std::vector<VkImageView> imageViews;
+  std::vector<VkFramebuffer> framebuffers;
+  std::vector<VkSemaphore> renderFinishedSemaphores;
+  VkImage depthImage;
+  VkImageView depthImageView;
+  DeviceAllocation depthImageMemory;
+  VkImage msaaColorImage;
+  VkImageView msaaColorImageView;
+  DeviceAllocation msaaColorImageMemory;
+  DepthPyramid::Images depthPyramid;
+  uint64_t lastFrame; // Safe to destroy once completedFrames reaches this
+};
+std::vector<RetiredSwapChain> retiredSwapChains;
+bool framebufferResized = false;
+uint64_t swapChainRecreations = 0;
+VkPresentModeKHR swapChainPresentMode;
+
+// VK_KHR_present_id / VK_KHR_present_wait are optional. With them every present carries the
+// frame number as its id and we can find out when it actually reached the display.
+bool presentWaitEnabled = false;
+PFN_vkWaitForPresentKHR pfnWaitForPresentKHR = nullptr;
+PFN_vkCmdBeginRenderingKHR pfnCmdBeginRendering = nullptr; // Core or KHR entry point, see createLogicalDevice
+PFN_vkCmdEndRenderingKHR pfnCmdEndRendering = nullptr;
+uint64_t lastPresentId = 0;
+VkSwapchainKHR lastPresentSwapChain = VK_NULL_HANDLE;
+
+// Input is sampled right before recording. The time of the sample travels with the present
+// id so the input to present latency can be measured once the present has happened.
+struct InputSample
+{
+  double cursorX = 0;
+  double cursorY = 0;
+  bool dragging = false;
+  std::chrono::steady_clock::time_point time;
+};
+struct PendingPresent
+{
+  uint64_t id;
+  VkSwapchainKHR swapChain;
+  std::chrono::steady_clock::time_point inputTime;
+};
+InputSample latestInput;
+float sceneOffset[2] = {0.0f, 0.0f}; // Drag the scene with the left mouse button to judge the latency by eye
+std::deque<PendingPresent> pendingPresents;
+std::vector<double> inputLatencies; // ms
 
 VkResult CreateDebugUtilsMessengerEXT( VkInstance instance,
    const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo,
@@ -71,7 +399,7 @@ void DestroyDebugUtilsMessengerEXT( VkInstance instance,
 {
   auto func = (PFN_vkDestroyDebugUtilsMessengerEXT) vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
   if (func) {
-    return func(instance, debugMessenger, nullptr);
+    return func(instance, DebugMessenger, pAllocator);
   }
 }
 
@@ -111,15 +439,23 @@ void initWindow()
   // glfw was ment to be run with an OpenGL context
   // GLFW_CLIENT_API with GLFW_NO_API tells it not to do that
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-  glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+  glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
   window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
+
+  // Not every platform reports VK_ERROR_OUT_OF_DATE_KHR after a resize, so we keep track ourselves
+  glfwSetFramebufferSizeCallback(window, [](GLFWwindow*, int, int) { framebufferResized = true; });
 }
 
 std::vector<const char*> getRequiredExtensions()
 {
-  uint32_t glfwExtensionCount = 0;
-  const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-  std::vector<const char*>Result(glfwExtensions, glfwExtensions + glfwExtensionCount);
+  // Surface extensions are only needed when we present to a window
+  std::vector<const char*>Result;
+  if (!headless)
+  {
+    uint32_t glfwExtensionCount = 0;
+    const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    Result.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+  }
   if (enableValidationLayers)
     Result.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 
@@ -146,9 +482,7 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
     const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
     void* pUserData)
 {
-  if( messageSeverity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) {
-    std::cerr << "Validation Layer: " << pCallbackData->pMessage << std::endl;
-  }
+  debugLog.log(messageSeverity, pCallbackData);
   return VK_FALSE;
 }
 
@@ -156,9 +490,7 @@ void populateDebugMessagerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& createI
 {
   createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
   createInfo.pNext = 0;
-  createInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
-                               VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
-                               VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+  createInfo.messageSeverity = debugLog.severityMask(); // The layer doesn't call back for the rest
   createInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT    |
                            VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | 
                            VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
@@ -178,7 +510,7 @@ void createInstance()
   ApplicationInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
   ApplicationInfo.pEngineName = "No Engine";
   ApplicationInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-  ApplicationInfo.apiVersion = VK_API_VERSION_1_0;
+  ApplicationInfo.apiVersion = VK_API_VERSION_1_3; // Timeline semaphores need 1.2, dynamic rendering is core in 1.3
 
   printAvailableExtensions();
 
@@ -208,7 +540,7 @@ void createInstance()
   CreateInstanceInfo.ppEnabledExtensionNames = extensions.data();
 
   // The second argument can be a callback to a custom allocator
-  if (vkCreateInstance(&CreateInstanceInfo, nullptr, &Instance) != VK_SUCCESS)
+  if (vkCreateInstance(&CreateInstanceInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_INSTANCE), &Instance) != VK_SUCCESS)
   {
     exit(1);
   }
@@ -222,7 +554,7 @@ void setupDebugMessenger()
   VkDebugUtilsMessengerCreateInfoEXT createInfo{};
   populateDebugMessagerCreateInfo(createInfo);
 
-  if (CreateDebugUtilsMessengerEXT(Instance, &createInfo, nullptr, &debugMessenger) != VK_SUCCESS)
+  if (CreateDebugUtilsMessengerEXT(Instance, &createInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_DEBUG_UTILS_MESSENGER_EXT), &debugMessenger) != VK_SUCCESS)
     throw std::runtime_error("Failed to set up debug messenger!");
 
 }
@@ -231,10 +563,13 @@ struct QueueFamilyIndices
 {
   std::optional<uint32_t> graphicsFamily;
   std::optional<uint32_t> presentFamily;
+  uint32_t transferFamily = 0; // Falls back to graphicsFamily, see findQueueFamilies
+  uint32_t computeFamily = 0;  // Likewise
 
   bool isComplete()
   { 
-    return graphicsFamily.has_value() && presentFamily.has_value();
+    // Nothing is presented in headless mode
+    return graphicsFamily.has_value() && (headless || presentFamily.has_value());
   }
 };
 
@@ -250,11 +585,13 @@ QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device)
   int i = 0;
   for (const auto& queueFamily : queueFamilies)
   {
-    if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+    // The culling pass is dispatched on the graphics queue. There is always a family that can do both.
+    if ((queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) && (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT))
       indices.graphicsFamily = i;
 
     VkBool32 presentSupport = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+    if (!headless)
+      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
     if(presentSupport)
       indices.presentFamily = i;
 
@@ -264,9 +601,54 @@ QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device)
     i++;
   }
 
+  // Prefer a family that can only copy (the DMA engines on discrete cards), then any transfer
+  // capable family without graphics. Every graphics family can transfer, so that is the fallback.
+  if (indices.graphicsFamily.has_value())
+  {
+    indices.transferFamily = indices.graphicsFamily.value();
+    int bestScore = 0;
+    for (uint32_t family = 0; family < queueFamilyCount; ++family)
+    {
+      VkQueueFlags flags = queueFamilies[family].queueFlags;
+      if (!(flags & VK_QUEUE_TRANSFER_BIT) || (flags & VK_QUEUE_GRAPHICS_BIT))
+        continue;
+      int score = (flags & VK_QUEUE_COMPUTE_BIT) ? 1 : 2;
+      if (score > bestScore)
+      {
+        bestScore = score;
+        indices.transferFamily = family;
+      }
+    }
+
+    // A compute family without graphics is the async compute engine, preferably not the one the
+    // uploads went to. The graphics family can always compute, so that is the fallback.
+    indices.computeFamily = indices.graphicsFamily.value();
+    bestScore = 0;
+    for (uint32_t family = 0; family < queueFamilyCount; ++family)
+    {
+      VkQueueFlags flags = queueFamilies[family].queueFlags;
+      if (!(flags & VK_QUEUE_COMPUTE_BIT) || (flags & VK_QUEUE_GRAPHICS_BIT))
+        continue;
+      int score = family == indices.transferFamily ? 1 : 2;
+      if (score > bestScore)
+      {
+        bestScore = score;
+        indices.computeFamily = family;
+      }
+    }
+  }
+
   return indices;
 }
 
+std::vector<const char*> getRequiredDeviceExtensions()
+{
+  // Without a surface there is no swapchain
+  if (headless)
+    return {};
+  return deviceExtensions;
+}
+
 bool checkDeviceExtensionSupport(VkPhysicalDevice device)
 {
   uint32_t extensionCount = 0;
@@ -275,7 +657,8 @@ bool checkDeviceExtensionSupport(VkPhysicalDevice device)
   std::vector<VkExtensionProperties> availableExtensions(extensionCount);
   vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-  std::set<std::string> requeredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+  const auto requiredExtensions = getRequiredDeviceExtensions();
+  std::set<std::string> requeredExtensions(requiredExtensions.begin(), requiredExtensions.end());
 
   for (const auto& extension : availableExtensions)
     requeredExtensions.erase(extension.extensionName);
@@ -315,6 +698,116 @@ SwapCahinSupportDetails querySwapChainSupportDetails(VkPhysicalDevice device)
   return details;
 }
 
+bool checkDeviceFeatureSupport(VkPhysicalDevice device)
+{
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(device, &deviceProperties);
+  if (deviceProperties.apiVersion < VK_API_VERSION_1_2)
+    return false;
+
+  VkPhysicalDeviceVulkan12Features vulkan12Features{};
+  vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+  VkPhysicalDeviceFeatures2 deviceFeatures{};
+  deviceFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  deviceFeatures.pNext = &vulkan12Features;
+  vkGetPhysicalDeviceFeatures2(device, &deviceFeatures);
+
+  // The culled draws come from a buffer, their count too, and each one picks its object with firstInstance
+  if (gpuCulling && !(vulkan12Features.drawIndirectCount && deviceFeatures.features.multiDrawIndirect &&
+                      deviceFeatures.features.drawIndirectFirstInstance))
+    return false;
+
+  // The bindless tables, see bindless.h. The shaders index them with the draw's push constants.
+  bool descriptorIndexing = deviceFeatures.features.shaderStorageBufferArrayDynamicIndexing &&
+                            deviceFeatures.features.shaderSampledImageArrayDynamicIndexing &&
+                            vulkan12Features.runtimeDescriptorArray && vulkan12Features.descriptorBindingPartiallyBound &&
+                            vulkan12Features.descriptorBindingVariableDescriptorCount &&
+                            vulkan12Features.descriptorBindingStorageBufferUpdateAfterBind &&
+                            vulkan12Features.descriptorBindingSampledImageUpdateAfterBind;
+
+  return vulkan12Features.timelineSemaphore && descriptorIndexing;
+}
+
+// Optional, see presentWaitEnabled
+bool checkPresentWaitSupport(VkPhysicalDevice device)
+{
+  if (headless)
+    return false;
+
+  uint32_t extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+  std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+
+  std::set<std::string> wanted = {VK_KHR_PRESENT_ID_EXTENSION_NAME, VK_KHR_PRESENT_WAIT_EXTENSION_NAME};
+  for (const auto& extension : availableExtensions)
+    wanted.erase(extension.extensionName);
+  if (!wanted.empty())
+    return false;
+
+  VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+  presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+  VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+  presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+  presentIdFeatures.pNext = &presentWaitFeatures;
+
+  VkPhysicalDeviceFeatures2 deviceFeatures{};
+  deviceFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  deviceFeatures.pNext = &presentIdFeatures;
+  vkGetPhysicalDeviceFeatures2(device, &deviceFeatures);
+
+  return presentIdFeatures.presentId && presentWaitFeatures.presentWait;
+}
+
+// Optional, see dynamicRendering. core is set when the device has it as part of Vulkan 1.3.
+bool checkDynamicRenderingSupport(VkPhysicalDevice device, bool& core)
+{
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(device, &deviceProperties);
+  core = deviceProperties.apiVersion >= VK_API_VERSION_1_3;
+  if (!core)
+  {
+    uint32_t extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+    auto found = std::find_if(availableExtensions.begin(), availableExtensions.end(), [](const VkExtensionProperties& extension) {
+      return std::strcmp(extension.extensionName, VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME) == 0;
+    });
+    if (found == availableExtensions.end())
+      return false;
+  }
+
+  VkPhysicalDeviceDynamicRenderingFeatures dynamicRenderingFeatures{};
+  dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
+
+  VkPhysicalDeviceFeatures2 deviceFeatures{};
+  deviceFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  deviceFeatures.pNext = &dynamicRenderingFeatures;
+  vkGetPhysicalDeviceFeatures2(device, &deviceFeatures);
+
+  return dynamicRenderingFeatures.dynamicRendering;
+}
+
+// Core in 1.3, an extension without any features before that
+bool checkCreationFeedbackSupport(VkPhysicalDevice device, bool& core)
+{
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(device, &deviceProperties);
+  core = deviceProperties.apiVersion >= VK_API_VERSION_1_3;
+  if (core)
+    return true;
+
+  uint32_t extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+  std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+  return std::any_of(availableExtensions.begin(), availableExtensions.end(), [](const VkExtensionProperties& extension) {
+    return std::strcmp(extension.extensionName, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME) == 0;
+  });
+}
+
 bool isDeviceSuitable(VkPhysicalDevice device)
 {
 #if 0
@@ -329,14 +822,14 @@ bool isDeviceSuitable(VkPhysicalDevice device)
   QueueFamilyIndices indices = findQueueFamilies(device);
   bool extensionSupported = checkDeviceExtensionSupport(device);
 
-  bool swapChainAdequate = false;
-  if (extensionSupported)
+  bool swapChainAdequate = headless;
+  if (extensionSupported && !headless)
   {
     SwapCahinSupportDetails swapChainSupport = querySwapChainSupportDetails(device);
     swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
   }
 
-  return indices.isComplete() && extensionSupported && swapChainAdequate;
+  return indices.isComplete() && extensionSupported && swapChainAdequate && checkDeviceFeatureSupport(device);
 }
 
 VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats)
@@ -352,8 +845,29 @@ VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>
   return availableFormats[0];
 }
 
+const char* presentModeName(VkPresentModeKHR mode)
+{
+  switch (mode)
+  {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:    return "immediate";
+    case VK_PRESENT_MODE_MAILBOX_KHR:      return "mailbox";
+    case VK_PRESENT_MODE_FIFO_KHR:         return "fifo";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "fifo-relaxed";
+    default:                               return "unknown";
+  }
+}
+
 VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes)
 {
+  if (requestedPresentMode)
+  {
+    if (std::find(availablePresentModes.begin(), availablePresentModes.end(), *requestedPresentMode) != availablePresentModes.end())
+      return *requestedPresentMode;
+    // FIFO is the only mode every implementation has to support
+    std::cerr << "Present mode " << presentModeName(*requestedPresentMode) << " is not supported, using fifo" << std::endl;
+    return VK_PRESENT_MODE_FIFO_KHR;
+  }
+
   for (const auto& availablePresentMode : availablePresentModes)
   {
     if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR)
@@ -364,19 +878,14 @@ VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& avai
   return VK_PRESENT_MODE_FIFO_KHR;
 }
 
-VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities)
+// framebufferSize comes from glfwGetFramebufferSize, which has to be called on the main thread
+VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities, VkExtent2D framebufferSize)
 {
   if(capabilities.currentExtent.width != UINT32_MAX)
   {
     return capabilities.currentExtent;
   }else{
-    int width, height;
-    glfwGetFramebufferSize(window, &width, &height);
-
-    VkExtent2D actualExtent {
-      .width = static_cast<uint32_t>(width),
-      .height = static_cast<uint32_t>(height)
-    };
+    VkExtent2D actualExtent = framebufferSize;
     
     actualExtent.width  = std::clamp(actualExtent.width,  capabilities.minImageExtent.width,  capabilities.maxImageExtent.width);
     actualExtent.height = std::clamp(actualExtent.height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
@@ -387,6 +896,7 @@ VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities)
 
 void pickPhysicalDevice()
 {
+  physicalDevice = VK_NULL_HANDLE; // Left over from the previous run with --startup-bench
   uint32_t deviceCount = 0;
   vkEnumeratePhysicalDevices(Instance, &deviceCount, nullptr);
   std::vector<VkPhysicalDevice> devices(deviceCount);
@@ -411,7 +921,11 @@ void createLogicalDevice()
   QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 
   std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-  std::set<uint32_t> uniqueCueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+  std::set<uint32_t> uniqueCueueFamilies = {indices.graphicsFamily.value()};
+  if (indices.presentFamily.has_value())
+    uniqueCueueFamilies.insert(indices.presentFamily.value());
+  uniqueCueueFamilies.insert(indices.transferFamily);
+  uniqueCueueFamilies.insert(indices.computeFamily);
 
   float queuePriority = 1.0f;
   for (uint32_t queueFamily : uniqueCueueFamilies)
@@ -424,16 +938,68 @@ void createLogicalDevice()
     queueCreateInfos.push_back(queueCreateInfo);
   }
 
-  // Empty for now
+  // Checked by checkDeviceFeatureSupport
   VkPhysicalDeviceFeatures deviceFeatures{};
+  deviceFeatures.multiDrawIndirect = gpuCulling;
+  deviceFeatures.drawIndirectFirstInstance = gpuCulling;
+  deviceFeatures.shaderStorageBufferArrayDynamicIndexing = VK_TRUE;
+  deviceFeatures.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+
+  VkPhysicalDeviceVulkan12Features vulkan12Features{};
+  vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  vulkan12Features.timelineSemaphore = VK_TRUE;
+  vulkan12Features.drawIndirectCount = gpuCulling;
+  vulkan12Features.runtimeDescriptorArray = VK_TRUE;
+  vulkan12Features.descriptorBindingPartiallyBound = VK_TRUE;
+  vulkan12Features.descriptorBindingVariableDescriptorCount = VK_TRUE;
+  vulkan12Features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+  vulkan12Features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+
+  // Optional present pacing extensions
+  presentWaitEnabled = checkPresentWaitSupport(physicalDevice);
+  VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+  presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+  presentWaitFeatures.presentWait = VK_TRUE;
+  VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+  presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+  presentIdFeatures.pNext = &presentWaitFeatures;
+  presentIdFeatures.presentId = VK_TRUE;
+  if (presentWaitEnabled)
+    vulkan12Features.pNext = &presentIdFeatures;
+
+  bool dynamicRenderingCore = false;
+  dynamicRendering = dynamicRenderingRequested && checkDynamicRenderingSupport(physicalDevice, dynamicRenderingCore);
+  if (dynamicRenderingRequested && !dynamicRendering)
+    std::cerr << "Dynamic rendering is not supported, using a render pass" << std::endl;
+  VkPhysicalDeviceDynamicRenderingFeatures dynamicRenderingFeatures{};
+  dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
+  dynamicRenderingFeatures.dynamicRendering = VK_TRUE;
+  if (dynamicRendering)
+  {
+    dynamicRenderingFeatures.pNext = vulkan12Features.pNext;
+    vulkan12Features.pNext = &dynamicRenderingFeatures;
+  }
 
   VkDeviceCreateInfo createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  createInfo.pNext = &vulkan12Features;
   createInfo.pEnabledFeatures = &deviceFeatures;
   createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
   createInfo.pQueueCreateInfos = queueCreateInfos.data();
-  createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-  createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+  auto extensions = getRequiredDeviceExtensions();
+  if (presentWaitEnabled)
+  {
+    extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+    extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+  }
+  if (dynamicRendering && !dynamicRenderingCore)
+    extensions.push_back(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+  bool creationFeedbackCore = false;
+  creationFeedbackEnabled = checkCreationFeedbackSupport(physicalDevice, creationFeedbackCore);
+  if (creationFeedbackEnabled && !creationFeedbackCore)
+    extensions.push_back(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+  createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+  createInfo.ppEnabledExtensionNames = extensions.data();
 
   if (enableValidationLayers)
   {
@@ -448,29 +1014,93 @@ void createLogicalDevice()
     createInfo.enabledLayerCount = 0;
   }
 
-  if (vkCreateDevice(physicalDevice, &createInfo, nullptr, &Device) != VK_SUCCESS)
+  if (vkCreateDevice(physicalDevice, &createInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_DEVICE), &Device) != VK_SUCCESS)
     throw std::runtime_error("failed to create logical device.");
 
   vkGetDeviceQueue(Device, indices.graphicsFamily.value(), 0, &graphicsQueue);
-
+  if (indices.presentFamily.has_value())
+    vkGetDeviceQueue(Device, indices.presentFamily.value(), 0, &presentQueue);
+  vkGetDeviceQueue(Device, indices.transferFamily, 0, &transferQueue);
+  vkGetDeviceQueue(Device, indices.computeFamily, 0, &computeQueue);
+  dedicatedComputeQueue = indices.computeFamily != indices.graphicsFamily.value();
+
+  if (presentWaitEnabled)
+    pfnWaitForPresentKHR = (PFN_vkWaitForPresentKHR) vkGetDeviceProcAddr(Device, "vkWaitForPresentKHR");
+  if (dynamicRendering)
+  {
+    pfnCmdBeginRendering = (PFN_vkCmdBeginRenderingKHR) vkGetDeviceProcAddr(Device, dynamicRenderingCore ? "vkCmdBeginRendering" : "vkCmdBeginRenderingKHR");
+    pfnCmdEndRendering = (PFN_vkCmdEndRenderingKHR) vkGetDeviceProcAddr(Device, dynamicRenderingCore ? "vkCmdEndRendering" : "vkCmdEndRenderingKHR");
+  }
 }
 
 void createSurface()
 {
-  if (glfwCreateWindowSurface(Instance, window, nullptr, &surface) != VK_SUCCESS)
+  if (glfwCreateWindowSurface(Instance, window, hostAllocator.callbacks(VK_OBJECT_TYPE_SURFACE_KHR), &surface) != VK_SUCCESS)
     throw std::runtime_error("failed to create window surface.");
 }
 
-void createSwapChain()
+// Picked before the swap chain exists so the render pass, which only needs the format,
+// can be created at the same time as the swap chain.
+// The depth pyramid is built from the depth buffer, with --gpu-cull it has to be sampled as well
+VkFormat findDepthFormat()
+{
+  VkFormatFeatureFlags required = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  if (gpuCulling)
+    required |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+
+  for (VkFormat format : {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT})
+  {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+    if ((properties.optimalTilingFeatures & required) == required)
+      return format;
+  }
+  throw std::runtime_error("failed to find a supported depth format.");
+}
+
+// The highest count up to --msaa that the device can render color and depth with
+VkSampleCountFlagBits chooseMsaaSamples()
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  VkSampleCountFlags supported = properties.limits.framebufferColorSampleCounts & properties.limits.framebufferDepthSampleCounts;
+
+  uint32_t samples = std::min(requestedMsaaSamples, 64u);
+  while (samples > 1 && !(supported & samples))
+    samples >>= 1;
+  if (samples != requestedMsaaSamples)
+    std::cerr << requestedMsaaSamples << "x MSAA isn't supported, using " << samples << "x" << std::endl;
+  return static_cast<VkSampleCountFlagBits>(samples);
+}
+
+void selectSwapChainFormat()
+{
+  if (headless)
+  {
+    swapChainSurfaceFormat = {VK_FORMAT_R8G8B8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+  }else{
+    SwapCahinSupportDetails swapChainSupport = querySwapChainSupportDetails(physicalDevice);
+    swapChainSurfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
+  }
+  swapChainImageFromat = swapChainSurfaceFormat.format;
+  depthFormat = findDepthFormat();
+  msaaSamples = chooseMsaaSamples();
+}
+
+// framebufferSize is the window's, read on the main thread. Only used when the surface leaves the
+// extent up to us (currentExtent is UINT32_MAX, e.g. on Wayland).
+void createSwapChain(VkExtent2D framebufferSize)
 {
   SwapCahinSupportDetails swapChainSupport = querySwapChainSupportDetails(physicalDevice);
 
-  VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
+  VkSurfaceFormatKHR surfaceFormat = swapChainSurfaceFormat;
   VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
-  VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
+  VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities, framebufferSize);
 
-  // It is recommended to request at least one more image than the minimum
-  uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+  // It is recommended to request at least one more image than the minimum. Fewer images means
+  // less queueing in front of the display, --swapchain-images trades that against throughput.
+  uint32_t imageCount = requestedImageCount ? requestedImageCount : swapChainSupport.capabilities.minImageCount + 1;
+  imageCount = std::max(imageCount, swapChainSupport.capabilities.minImageCount);
   if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount)
     imageCount = swapChainSupport.capabilities.maxImageCount;
 
@@ -507,17 +1137,298 @@ void createSwapChain()
   createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR; // Do we want to blend the window with the os? NO!
   createInfo.presentMode = presentMode;
   createInfo.clipped = VK_TRUE; // ignores pixels that are obscured by other windows. Not good if you want to record windows for example but improves performance.
-  createInfo.oldSwapchain = VK_NULL_HANDLE; // Resizing the image would require us to create a new swap chain and reference the old on here. This will be covered later.
+  createInfo.oldSwapchain = swapChain; // VK_NULL_HANDLE the first time. On a resize the driver can reuse resources of the old one.
   
-  if (vkCreateSwapchainKHR(Device, &createInfo, nullptr, &swapChain) != VK_SUCCESS)
+  if (vkCreateSwapchainKHR(Device, &createInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_SWAPCHAIN_KHR), &swapChain) != VK_SUCCESS)
     throw std::runtime_error("failed to create swap chain.");
 
   vkGetSwapchainImagesKHR(Device, swapChain, &imageCount, nullptr);
   swapChainImages.resize(imageCount);
   vkGetSwapchainImagesKHR(Device, swapChain, &imageCount, swapChainImages.data());
-  swapChainImageFromat = surfaceFormat.format;
   swapChainExtent = extent;
+  swapChainPresentMode = presentMode;
+
+}
+
+void createMemoryAllocator()
+{
+  memoryAllocator.init(Device, hostAllocator, physicalDevice);
+}
+
+void createUploadEngine()
+{
+  QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+  uploadEngine.init(Device, hostAllocator, memoryAllocator, physicalDevice, indices.graphicsFamily.value(), indices.transferFamily, transferQueue);
+}
+
+void createInstanceKernels()
+{
+  instanceKernels.init(simdThreads, simdLevel);
+}
+
+// Lays the instances out as a grid inside the cell of a draw. A single instance is the identity, which keeps
+// the original triangle.
+void createInstanceBuffer()
+{
+  // With more than one layer every instance goes to layer i % sceneLayers, layer 0 in front. The
+  // triangles are grown until they cover their neighbours' gaps, so each layer hides the ones behind.
+  // The triangle fits in a circle of radius sqrt(0.5) around the origin, before the instance scale.
+  InstanceSoA layout;
+  layout.resize(instanceCount);
+  uint32_t perLayer = (instanceCount + sceneLayers - 1) / sceneLayers;
+  uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(perLayer))));
+  float instanceSize = (sceneLayers > 1 ? 6.0f : 1.0f) / side;
+  for (uint32_t i = 0; i < instanceCount; ++i)
+  {
+    uint32_t cell = i / sceneLayers;
+    layout.x[i] = -1.0f + (2.0f * (cell % side) + 1.0f) / side;
+    layout.y[i] = -1.0f + (2.0f * (cell / side) + 1.0f) / side;
+    layout.z[i] = 0.9f * (i % sceneLayers) / sceneLayers;
+    layout.scaleX[i] = layout.scaleY[i] = instanceSize;
+    layout.scaleZ[i] = 1.0f;
+    layout.radius[i] = 0.7072f;
+  }
+
+  std::vector<InstanceData> instances(instanceCount);
+  glm::mat4 identity(1.0f);
+  instanceKernels.composeTransforms(&identity[0][0], layout, &instances[0].transform[0][0], sizeof(InstanceData) / sizeof(float));
+  for (uint32_t i = 0; i < instanceCount; ++i)
+  {
+    if (instanceCount == 1)
+      instances[i].color = glm::vec4(1.0f);
+    else
+      instances[i].color = glm::vec4(0.6f + 0.4f * std::sin(0.37f * i), 0.6f + 0.4f * std::sin(0.71f * i), 0.6f + 0.4f * std::sin(1.13f * i), 1.0f);
+  }
+
+  VkDeviceSize size = sizeof(InstanceData) * instances.size();
+  memoryAllocator.createBuffer(size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, instanceBuffer, instanceMemory);
+  // The next frame acquires the buffer and waits for the copy, see recordCommandBuffer
+  uploadEngine.uploadBuffer(instanceBuffer, 0, instances.data(), size);
+
+  if (gpuCulling)
+  {
+    std::vector<glm::vec4> bounds(instanceCount);
+    for (uint32_t i = 0; i < instanceCount; ++i)
+      bounds[i] = glm::vec4(layout.x[i], layout.y[i], layout.z[i], layout.radius[i] * instanceSize);
+
+    VkDeviceSize boundsSize = sizeof(glm::vec4) * bounds.size();
+    memoryAllocator.createBuffer(boundsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, objectBoundsBuffer, objectBoundsMemory);
+    uploadEngine.uploadBuffer(objectBoundsBuffer, 0, bounds.data(), boundsSize);
+    culler.setObjects(objectBoundsBuffer, instanceCount);
+  }
+  uploadEngine.flush();
+}
+
+void destroyInstanceBuffer()
+{
+  if (instanceBuffer != VK_NULL_HANDLE)
+    memoryAllocator.destroyBuffer(instanceBuffer, instanceMemory);
+  if (objectBoundsBuffer != VK_NULL_HANDLE)
+    memoryAllocator.destroyBuffer(objectBoundsBuffer, objectBoundsMemory);
+  instanceBuffer = VK_NULL_HANDLE;
+  objectBoundsBuffer = VK_NULL_HANDLE;
+}
+
+// Points the simulation at the compute queue, or at the graphics queue when there is no other one
+// or --single-queue-compute asks for it
+void selectComputeQueue(bool singleQueue)
+{
+  QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+  if (singleQueue || !dedicatedComputeQueue)
+    asyncCompute.setQueue(graphicsQueue, indices.graphicsFamily.value(), false);
+  else
+    asyncCompute.setQueue(computeQueue, indices.computeFamily, true);
+}
+
+void createAsyncCompute()
+{
+  asyncCompute.init(Device, hostAllocator, memoryAllocator, simulateShader.module, pipelineCache, computeParticles, framesInFlight);
+  vkDestroyShaderModule(Device, simulateShader.module, hostAllocator.callbacks(VK_OBJECT_TYPE_SHADER_MODULE));
+  simulateShader.module = VK_NULL_HANDLE;
+  selectComputeQueue(singleQueueCompute);
+}
+
+// The compute pipeline sits next to graphicsPipeline, in the same cache
+void createCuller()
+{
+  culler.init(Device, hostAllocator, memoryAllocator, cullShader.module, pipelineCache, framesInFlight);
+  culler.setDepthPyramid(depthPyramid);
+  vkDestroyShaderModule(Device, cullShader.module, hostAllocator.callbacks(VK_OBJECT_TYPE_SHADER_MODULE));
+  cullShader.module = VK_NULL_HANDLE;
+
+  const uint16_t indices[] = {0, 1, 2};
+  memoryAllocator.createBuffer(sizeof(indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, triangleIndexBuffer, triangleIndexMemory);
+  uploadEngine.uploadBuffer(triangleIndexBuffer, 0, indices, sizeof(indices)); // Flushed by createInstanceBuffer
+}
+
+// The tables are as large as the device allows for update after bind descriptors, up to a limit
+void createBindlessHeap()
+{
+  VkPhysicalDeviceDescriptorIndexingProperties indexingProperties{};
+  indexingProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES;
+  VkPhysicalDeviceProperties2 properties{};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  properties.pNext = &indexingProperties;
+  vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+  // A quarter of the pool limit per table, the rest is left for the sets of the bind per draw baseline
+  uint32_t poolLimit = indexingProperties.maxUpdateAfterBindDescriptorsInAllPools / 4;
+  uint32_t maxImages = std::min({4096u, poolLimit, indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                                 indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages});
+  uint32_t maxBuffers = std::min({1u << 20, poolLimit, indexingProperties.maxPerStageDescriptorUpdateAfterBindStorageBuffers,
+                                  indexingProperties.maxDescriptorSetUpdateAfterBindStorageBuffers});
+  bindless.init(Device, hostAllocator, maxImages, maxBuffers);
+}
+
+// Starts with room for the camera and a few thousand objects per frame, grows when a frame needs more
+void createFrameRing()
+{
+  frameRing.init(Device, hostAllocator, memoryAllocator, physicalDevice, 64 * 1024, sizeof(CameraData), framesInFlight);
+}
+
+// One storage buffer per material. Material 0 leaves the colors as they are.
+void createMaterials()
+{
+  materialBuffers.resize(materialCount);
+  materialMemory.resize(materialCount);
+  materialSlots.resize(materialCount);
+  for (uint32_t i = 0; i < materialCount; ++i)
+  {
+    glm::vec4 tint(1.0f);
+    if (i > 0)
+      tint = glm::vec4(0.7f + 0.3f * std::sin(0.53f * i), 0.7f + 0.3f * std::sin(0.89f * i), 0.7f + 0.3f * std::sin(1.31f * i), 1.0f);
+    memoryAllocator.createBuffer(sizeof(tint), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, materialBuffers[i], materialMemory[i]);
+    uploadEngine.uploadBuffer(materialBuffers[i], 0, &tint, sizeof(tint));
+    materialSlots[i] = bindless.addBuffer(materialBuffers[i], 0, VK_WHOLE_SIZE);
+  }
+  uploadEngine.flush();
+}
+
+// The slots are reused once the frames recorded so far are done, the buffers must be idle
+void destroyMaterials()
+{
+  for (uint32_t i = 0; i < materialBuffers.size(); ++i)
+  {
+    bindless.release(BindlessHeap::BUFFERS, materialSlots[i], submittedFrames);
+    memoryAllocator.destroyBuffer(materialBuffers[i], materialMemory[i]);
+  }
+  materialBuffers.clear();
+  materialMemory.clear();
+  materialSlots.clear();
+}
+
+void createDepthPyramid()
+{
+  depthPyramid.init(Device, hostAllocator, memoryAllocator, pyramidShader.module, pipelineCache, framesInFlight);
+  vkDestroyShaderModule(Device, pyramidShader.module, hostAllocator.callbacks(VK_OBJECT_TYPE_SHADER_MODULE));
+  pyramidShader.module = VK_NULL_HANDLE;
+}
+
+// Sized like the swap chain and recreated with it, together with the multisampled color image of --msaa.
+//
+// An attachment that is cleared when the pass begins and not stored when it ends only exists during
+// the pass. Those are created as transient attachments on lazily allocated memory if the device has
+// such a memory type: a tiler keeps them in tile memory and never backs them with pages. Elsewhere
+// they end up in ordinary device memory.
+void createDepthResources()
+{
+  VkImageCreateInfo imageInfo{};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.format = depthFormat;
+  imageInfo.extent = {swapChainExtent.width, swapChainExtent.height, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.samples = msaaSamples;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  if (gpuCulling)
+    imageInfo.usage |= VK_IMAGE_USAGE_SAMPLED_BIT; // Read by the depth pyramid build
+  else
+    imageInfo.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  memoryAllocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory,
+                              gpuCulling ? 0 : VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+
+  VkImageViewCreateInfo viewInfo{};
+  viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewInfo.image = depthImage;
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewInfo.format = depthFormat;
+  viewInfo.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1}; // Only depth is sampled, even if there is stencil
+  if (vkCreateImageView(Device, &viewInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW), &depthImageView) != VK_SUCCESS)
+    throw std::runtime_error("failed to create depth image view.");
+
+  if (gpuCulling)
+    depthPyramid.create(depthImageView, swapChainExtent);
+
+  msaaColorImage = VK_NULL_HANDLE;
+  msaaColorImageView = VK_NULL_HANDLE;
+  msaaColorImageMemory = {}; // The previous one may belong to a retired swap chain
+  if (msaaSamples == VK_SAMPLE_COUNT_1_BIT)
+    return;
+
+  // Resolved into the swap chain image at the end of the subpass, the samples themselves are never stored
+  imageInfo.format = swapChainImageFromat;
+  imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+  memoryAllocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, msaaColorImage, msaaColorImageMemory,
+                              VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+
+  viewInfo.image = msaaColorImage;
+  viewInfo.format = swapChainImageFromat;
+  viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  if (vkCreateImageView(Device, &viewInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW), &msaaColorImageView) != VK_SUCCESS)
+    throw std::runtime_error("failed to create multisampled color image view.");
+}
+
+// The depth and multisampled color images are shared by all frames, none may still be rendering into them
+void destroyDepthResources()
+{
+  vkDestroyImageView(Device, msaaColorImageView, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+  memoryAllocator.destroyImage(msaaColorImage, msaaColorImageMemory);
+  msaaColorImageView = VK_NULL_HANDLE;
+  vkDestroyImageView(Device, depthImageView, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+  memoryAllocator.destroyImage(depthImage, depthImageMemory);
+  depthImageView = VK_NULL_HANDLE;
+}
+
+// The camera of the scene, shader.vert reads it from the frame ring and the culling pass gets it as well
+glm::mat4 cameraViewProjection()
+{
+  glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(sceneOffset[0], sceneOffset[1], 0.0f));
+  return glm::scale(view, glm::vec3(cameraZoom, cameraZoom, 1.0f));
+}
 
+void createOffscreenTargets()
+{
+  // Stand-in for createSwapChain when there is no surface. We own the images, one per frame
+  // in flight so consecutive frames can overlap the same way swapchain images do.
+  swapChainExtent = {WIDTH, HEIGHT};
+  swapChainImages.resize(framesInFlight);
+  offscreenImageMemory.resize(framesInFlight);
+
+  for (uint32_t i = 0; i < framesInFlight; ++i)
+  {
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = swapChainImageFromat;
+    imageInfo.extent = {swapChainExtent.width, swapChainExtent.height, 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT; // Render to it and read it back
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    memoryAllocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapChainImages[i], offscreenImageMemory[i]);
+  }
 }
 
 void createImageViews()
@@ -541,7 +1452,7 @@ void createImageViews()
     createInfo.subresourceRange.baseArrayLayer = 0;
     createInfo.subresourceRange.layerCount = 1;
 
-    if (vkCreateImageView(Device, &createInfo, nullptr, &swapChainImageViews[i]) != VK_SUCCESS)
+    if (vkCreateImageView(Device, &createInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW), &swapChainImageViews[i]) != VK_SUCCESS)
       throw std::runtime_error("failed to create image views");
 
   }
@@ -561,221 +1472,447 @@ std::vector<char> readFile(const std::string& filename)
   return buffer;
 }
 
-VkShaderModule createShaderModule(const std::vector<char>& code)
+ShaderCode loadShaderCode(const char* path)
+{
+#ifdef EMBED_SHADERS
+  for (const auto& shader : embeddedShaders)
+  {
+    if (std::strcmp(shader.path, path) == 0)
+      return ShaderCode::view(shader.words, shader.size, path);
+  }
+  throw std::runtime_error(std::string("no embedded shader for ") + path + ".");
+#else
+  return ShaderCode::map(path);
+#endif
+}
+
+void loadShader(ShaderSource& shader)
+{
+  shader.code = loadShaderCode(shader.path);
+}
+
+VkShaderModule createShaderModule(const ShaderCode& code)
 {
   VkShaderModuleCreateInfo createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
   createInfo.codeSize = code.size();
-  // This pointer requires that data is aligned uin32_t* but our data is a unit8_t*
-  // However, apparantly vector already aligns data for worst case (32bit) so we are fine.
-  createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+  createInfo.pCode = code.data(); // Page aligned when mapped, uint32_t arrays when embedded
 
   VkShaderModule shaderModule{};
-  vkCreateShaderModule(Device, &createInfo, nullptr, &shaderModule);
+  if (vkCreateShaderModule(Device, &createInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_SHADER_MODULE), &shaderModule) != VK_SUCCESS)
+    throw std::runtime_error("failed to create shader module.");
   return shaderModule;
 }
 
-void createGraphicsPipeline()
+void createShaderModule(ShaderSource& shader)
+{
+  shader.module = createShaderModule(shader.code);
+  shader.hash = PipelineFactory::hashCode(shader.code.data(), shader.code.size());
+  shader.code.release(); // The driver has its own copy now
+}
+
+// Checks that cache data was written by the same driver for the same device. The driver is allowed
+// to reject mismatching data, but some crash or silently ignore it, so we validate it ourselves.
+bool isPipelineCacheCompatible(const std::vector<char>& data)
 {
+  VkPipelineCacheHeaderVersionOne header{};
+  if (data.size() < sizeof(header))
+    return false;
 
-  // Shaders 
+  std::memcpy(&header, data.data(), sizeof(header));
 
-  auto vertShaderCode = readFile("shaders/vert.spv");
-  auto fragShaderCode = readFile("shaders/frag.spv");
-  VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-  VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
 
-  VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-  vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-  vertShaderStageInfo.module = vertShaderModule;
-  vertShaderStageInfo.pName = "main";
+  return header.headerSize >= sizeof(header) &&
+         header.headerSize <= data.size() &&
+         header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         header.vendorID == properties.vendorID &&
+         header.deviceID == properties.deviceID &&
+         std::memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
 
-  VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-  fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  fragShaderStageInfo.pName = "main";
-  fragShaderStageInfo.module = fragShaderModule;
+void createPipelineCache()
+{
+  std::vector<char> cacheData;
+  try{
+    cacheData = readFile(pipelineCachePath);
+  }catch(const std::exception&){
+    // No cache yet, first run
+  }
 
-  VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
+  if (!cacheData.empty() && !isPipelineCacheCompatible(cacheData))
+  {
+    std::cout << "Discarding stale or corrupt pipeline cache " << pipelineCachePath << std::endl;
+    cacheData.clear();
+  }
 
-  // Fixed functions
+  VkPipelineCacheCreateInfo createInfo{};
+  createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  createInfo.initialDataSize = cacheData.size();
+  createInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
 
-  // Vertex Buffer
-  VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-  vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertexInputInfo.vertexBindingDescriptionCount = 0;
-  vertexInputInfo.pVertexBindingDescriptions = nullptr;
-  vertexInputInfo.vertexAttributeDescriptionCount = 0;
-  vertexInputInfo.pVertexAttributeDescriptions = nullptr;
-
-  VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-  inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-  inputAssembly.primitiveRestartEnable = VK_FALSE;
-
-  // Viewport
-  VkViewport viewPort{};
-  viewPort.x = 0.0f;
-  viewPort.y = 0.0f;
-  viewPort.width = (float) swapChainExtent.width;
-  viewPort.height = (float) swapChainExtent.height;
-  viewPort.minDepth = 0;
-  viewPort.maxDepth = 1;
-
-  VkRect2D scissor{};
-  scissor.offset = {0,0};
-  scissor.extent = swapChainExtent;
-
-  VkPipelineViewportStateCreateInfo viewportState{};
-  viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-  viewportState.viewportCount = 1;
-  viewportState.pViewports = &viewPort;
-  viewportState.scissorCount = 1;
-  viewportState.pScissors = &scissor;
-
-  // Rasterizer
-  VkPipelineRasterizationStateCreateInfo rasterizer{};
-  rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-  rasterizer.depthClampEnable = VK_FALSE;
-  rasterizer.rasterizerDiscardEnable = VK_FALSE;
-  rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-  rasterizer.lineWidth = 1.0f;
-  rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-  rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-  rasterizer.depthBiasEnable = VK_FALSE;
-  rasterizer.depthBiasConstantFactor = 0.0f; // Optional
-  rasterizer.depthBiasClamp = 0.0f; // Optional
-  rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
-
-  // Multisampling (off, revisit later)
-  VkPipelineMultisampleStateCreateInfo multisampling{};
-  multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-  multisampling.sampleShadingEnable = VK_FALSE;
-  multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-  multisampling.minSampleShading = 1.0f; // Optional
-  multisampling.pSampleMask = nullptr; // Optional
-  multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
-  multisampling.alphaToOneEnable = VK_FALSE; // Optional
-
-  // Depth and Stencil testing(off, revisit later)
-
-  // Color Blending
-  // VkPipelineColorBlendStateCreateInfo is used for global color blending, but we only have one framebuffer so it's not needed
-
-  // This creates standard alpha-blending
-  VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-  colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-  colorBlendAttachment.blendEnable = VK_TRUE;
-  colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-  colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-  colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
-  colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-  colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-  colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
-
-  VkPipelineColorBlendStateCreateInfo colorBlending{};
-  colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-  colorBlending.logicOpEnable = VK_FALSE;
-  colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-  colorBlending.attachmentCount = 1;
-  colorBlending.pAttachments = &colorBlendAttachment;
-  colorBlending.blendConstants[0] = 0.0f; // Optional 
-  colorBlending.blendConstants[1] = 0.0f; // Optional 
-  colorBlending.blendConstants[2] = 0.0f; // Optional 
-  colorBlending.blendConstants[3] = 0.0f; // Optional 
-
-  // Dynamic State (Can be changed without recreating the pipeline, not used for now)
-  VkDynamicState dynamicStates[] ={
-    VK_DYNAMIC_STATE_VIEWPORT,
-    VK_DYNAMIC_STATE_LINE_WIDTH
-  };
+  VkResult result = vkCreatePipelineCache(Device, &createInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_PIPELINE_CACHE), &pipelineCache);
+  if (result != VK_SUCCESS && !cacheData.empty())
+  {
+    // The header looked fine but the driver didn't like the payload, start over with an empty cache
+    std::cout << "Driver rejected pipeline cache " << pipelineCachePath << ", starting cold" << std::endl;
+    cacheData.clear();
+    createInfo.initialDataSize = 0;
+    createInfo.pInitialData = nullptr;
+    result = vkCreatePipelineCache(Device, &createInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_PIPELINE_CACHE), &pipelineCache);
+  }
 
-  VkPipelineDynamicStateCreateInfo dynamicState{};
-  dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-  dynamicState.dynamicStateCount = 2;
-  dynamicState.pDynamicStates = dynamicStates;
+  if (result != VK_SUCCESS)
+    throw std::runtime_error("failed to create pipeline cache.");
 
-  // Pipeline Layout (used to define uniforms, not used for now, must still be created)
-  
-  VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipelineLayoutInfo.setLayoutCount = 0;
-  pipelineLayoutInfo.pSetLayouts = nullptr;
-  pipelineLayoutInfo.pushConstantRangeCount = 0;
-  pipelineLayoutInfo.pPushConstantRanges = nullptr;
+  pipelineCacheWarm = !cacheData.empty();
+}
 
-  if (vkCreatePipelineLayout(Device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
-    throw std::runtime_error("failed to create pipeline layout");
+void savePipelineCache()
+{
+  size_t dataSize = 0;
+  if (vkGetPipelineCacheData(Device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0)
+    return;
 
-  VkGraphicsPipelineCreateInfo pipelineInfo{};
-  pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  pipelineInfo.stageCount = 2;
-  pipelineInfo.pStages = shaderStages;
-  
-  pipelineInfo.pVertexInputState = &vertexInputInfo;
-  pipelineInfo.pInputAssemblyState = &inputAssembly;
-  pipelineInfo.pViewportState = &viewportState;
-  pipelineInfo.pRasterizationState = &rasterizer;
-  pipelineInfo.pMultisampleState = &multisampling;
-  pipelineInfo.pDepthStencilState = nullptr;
-  pipelineInfo.pColorBlendState = &colorBlending;
-  pipelineInfo.pDynamicState = nullptr;
+  std::vector<char> data(dataSize);
+  if (vkGetPipelineCacheData(Device, pipelineCache, &dataSize, data.data()) != VK_SUCCESS)
+    return;
+
+  // Write to a temporary file and rename it over the old one, so a crash half way through
+  // never leaves a truncated cache behind.
+  const std::string tmpPath = pipelineCachePath + ".tmp";
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+      std::cerr << "failed to write pipeline cache " << tmpPath << std::endl;
+      return;
+    }
+    file.write(data.data(), dataSize);
+    if (!file)
+    {
+      std::cerr << "failed to write pipeline cache " << tmpPath << std::endl;
+      std::remove(tmpPath.c_str());
+      return;
+    }
+  }
 
-  pipelineInfo.layout = pipelineLayout;
-  pipelineInfo.renderPass = renderPass;
-  pipelineInfo.subpass = 0; // This pipeline will be used for the color render pass we defined
-                            // Several renderpasses compatible with renderpass can be used, 
-                            // but that functionality is out of scope.
+  if (std::rename(tmpPath.c_str(), pipelineCachePath.c_str()) != 0)
+  {
+    std::cerr << "failed to replace pipeline cache " << pipelineCachePath << std::endl;
+    std::remove(tmpPath.c_str());
+  }
+}
+
+void createGraphicsPipeline()
+{
+  pipelineFactory.init(Device, hostAllocator, pipelineCache, pipelineCapacity, pipelineBuildThreads);
+  pipelineFactory.setCreationFeedback(creationFeedbackEnabled);
 
-  // Used to create a pipeline based on another pipeline if they have alot in common.
-  // Requires flags field to have VK_PIPELINE_CREATE_DERIVATIVE_BIT set
-  pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
-  pipelineInfo.basePipelineIndex = -1; // Optional
+  // Vertex Buffer
+  // The triangle itself is still hard coded in the vertex shader, the only vertex buffer is the
+  // instance data. It advances once per instance instead of once per vertex.
+  VkVertexInputBindingDescription instanceBinding{};
+  instanceBinding.binding = 0;
+  instanceBinding.stride = sizeof(InstanceData);
+  instanceBinding.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+  // A mat4 attribute takes one location per column
+  std::vector<VkVertexInputAttributeDescription> instanceAttributes;
+  for (uint32_t column = 0; column < 4; ++column)
+    instanceAttributes.push_back({column, 0, VK_FORMAT_R32G32B32A32_SFLOAT,
+                                  static_cast<uint32_t>(offsetof(InstanceData, transform) + column * sizeof(glm::vec4))});
+  instanceAttributes.push_back({4, 0, VK_FORMAT_R32G32B32A32_SFLOAT, static_cast<uint32_t>(offsetof(InstanceData, color))});
+
+  // Pipeline Layout: the bindless tables, the per frame data and the per draw push constants, which carry the indices
+  VkPushConstantRange pushConstantRange{};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = sizeof(DrawConstants);
 
-  if (vkCreateGraphicsPipelines(Device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
-    throw std::runtime_error("failed to create graphics pipeline");
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  VkDescriptorSetLayout setLayouts[] = {bindless.getSetLayout(BindlessHeap::IMAGES), bindless.getSetLayout(BindlessHeap::BUFFERS),
+                                        frameRing.getSetLayout()}; // At frameDataSet
+  pipelineLayoutInfo.setLayoutCount = 3;
+  pipelineLayoutInfo.pSetLayouts = setLayouts;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+  if (vkCreatePipelineLayout(Device, &pipelineLayoutInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT), &pipelineLayout) != VK_SUCCESS)
+    throw std::runtime_error("failed to create pipeline layout");
 
-  vkDestroyShaderModule(Device, vertShaderModule, nullptr);
-  vkDestroyShaderModule(Device, fragShaderModule, nullptr);
+  // The factory owns the shader modules from here on, they are needed for every variant it builds
+  scenePipelineKey.vertexShader = pipelineFactory.addShader(vertShader.hash, vertShader.module);
+  scenePipelineKey.fragmentShader = pipelineFactory.addShader(fragShader.hash, fragShader.module);
+  vertShader.module = VK_NULL_HANDLE;
+  fragShader.module = VK_NULL_HANDLE;
+  scenePipelineKey.vertexInput = pipelineFactory.addVertexInput({instanceBinding}, instanceAttributes);
+  scenePipelineKey.layout = pipelineLayout;
+  scenePipelineKey.renderPass = renderPass; // VK_NULL_HANDLE with dynamic rendering
+  scenePipelineKey.colorFormat = swapChainImageFromat;
+  scenePipelineKey.depthFormat = depthFormat;
+  scenePipelineKey.samples = msaaSamples;
+  scenePipelineKey.cullMode = VK_CULL_MODE_BACK_BIT;
+  scenePipelineKey.frontFace = VK_FRONT_FACE_CLOCKWISE;
+  scenePipelineKey.blend = BlendMode::Alpha;
+  scenePipelineKey.depthCompare = VK_COMPARE_OP_LESS; // Nearer triangles win
+
+  auto buildStart = std::chrono::steady_clock::now();
+  graphicsPipeline = pipelineFactory.get(scenePipelineKey);
+  double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+  std::cout << "Pipeline build: " << buildMs << " ms (" << (pipelineCacheWarm ? "warm" : "cold") << " cache)" << std::endl;
 }
 
-void createRenderPass()
+// What the scene pass does with each attachment. The render pass and dynamic rendering are both
+// set up from this, and printAttachmentReport reports it. The first two are always the color and
+// depth attachments that are drawn to, with --msaa the swap chain image is the third and only
+// receives the resolve.
+struct SceneAttachment
 {
-  VkAttachmentDescription colorAttachment{};
-  colorAttachment.format = swapChainImageFromat;
-  colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR; // Clear the image before rendering;
-  colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE; // Store the image after rendering so we can display it.
-  colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE; // We don't use stencil buffer atm
-  colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; // Since we clear the image we don't care about the layout before rendering.
-  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; // Optimize layout for presenting on screen
+  const char* name;
+  VkFormat format;
+  VkSampleCountFlagBits samples;
+  VkAttachmentLoadOp loadOp;
+  VkAttachmentStoreOp storeOp;
+  VkImage image;                  // Null for the swap chain image
+  const DeviceAllocation* memory; // Null for the swap chain image
+};
 
-  VkAttachmentReference colorAttachmentRef{};
-  colorAttachmentRef.attachment = 0; // Since we only have 1 colorAttachment, it's index will be 0
-  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+uint32_t sceneAttachmentCount()
+{
+  return msaaSamples == VK_SAMPLE_COUNT_1_BIT ? 2 : 3;
+}
 
-  // The index of this attachment is directly referenced in the shader code with the
-  // 'layout (location = 0) out vec4 outColor' directive
-  // Following types of attachments exist
-  //
-  // -  pInputAttachments: Attachments that are read from a shader
-  // -  pResolveAttachments: Attachments used for multisampling color attachments
-  // -  pDepthStencilAttachment: Attachment for depth and stencil data
+std::array<SceneAttachment, 3> sceneAttachments()
+{
+  std::array<SceneAttachment, 3> attachments{};
+  if (msaaSamples == VK_SAMPLE_COUNT_1_BIT)
+  {
+    // Clear the image before rendering, store it after rendering so we can display it
+    attachments[0] = {"color", swapChainImageFromat, VK_SAMPLE_COUNT_1_BIT,
+                      VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE, VK_NULL_HANDLE, nullptr};
+  }else{
+    // The samples are averaged into the swap chain image in the subpass, they never have to reach memory
+    attachments[0] = {"msaa color", swapChainImageFromat, msaaSamples,
+                      VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_DONT_CARE, msaaColorImage, &msaaColorImageMemory};
+    // Every pixel is written by the resolve, there is nothing to load
+    attachments[2] = {"resolve", swapChainImageFromat, VK_SAMPLE_COUNT_1_BIT,
+                      VK_ATTACHMENT_LOAD_OP_DONT_CARE, VK_ATTACHMENT_STORE_OP_STORE, VK_NULL_HANDLE, nullptr};
+  }
+  // Cleared every frame. With --gpu-cull it is kept and left readable for the depth pyramid build.
+  attachments[1] = {"depth", depthFormat, msaaSamples, VK_ATTACHMENT_LOAD_OP_CLEAR,
+                    gpuCulling ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE, depthImage, &depthImageMemory};
+  return attachments;
+}
+
+const char* loadOpName(VkAttachmentLoadOp op)
+{
+  switch (op)
+  {
+    case VK_ATTACHMENT_LOAD_OP_LOAD: return "load";
+    case VK_ATTACHMENT_LOAD_OP_CLEAR: return "clear";
+    default: return "dont-care";
+  }
+}
+
+const char* storeOpName(VkAttachmentStoreOp op)
+{
+  return op == VK_ATTACHMENT_STORE_OP_STORE ? "store" : "dont-care";
+}
+
+// What one full load or store of the attachment moves. The swap chain images have no memory
+// requirements we may ask for, an image like them is created just for the query.
+VkDeviceSize attachmentBytes(const SceneAttachment& attachment)
+{
+  VkMemoryRequirements requirements;
+  if (attachment.image != VK_NULL_HANDLE)
+  {
+    vkGetImageMemoryRequirements(Device, attachment.image, &requirements);
+    return requirements.size;
+  }
+
+  VkImageCreateInfo imageInfo{};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.extent = {swapChainExtent.width, swapChainExtent.height, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.format = attachment.format;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  imageInfo.samples = attachment.samples;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VkImage image;
+  if (vkCreateImage(Device, &imageInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE), &image) != VK_SUCCESS)
+    throw std::runtime_error("failed to create image.");
+  vkGetImageMemoryRequirements(Device, image, &requirements);
+  vkDestroyImage(Device, image, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE));
+  return requirements.size;
+}
+
+struct AttachmentFootprint
+{
+  VkDeviceSize reservedBytes = 0;  // Device memory of the attachments we own
+  VkDeviceSize committedBytes = 0; // Of the lazily allocated part, what the driver actually backed with pages
+  VkDeviceSize lazyBytes = 0;      // Reserved on lazily allocated memory
+  VkDeviceSize movedBytes = 0;     // Loaded and stored per frame
+  VkDeviceSize skippedBytes = 0;   // Per frame loads and stores that CLEAR and DONT_CARE leave out
+};
+
+// Load and store ops of every scene attachment, what they move per frame and the memory of the
+// attachments we own. A load reads the whole attachment from memory and a store writes it back, on
+// a tiler CLEAR and DONT_CARE don't touch memory at all. Lazily allocated memory is only committed
+// when an attachment spills out of tile memory, so the commitment is only meaningful after some frames.
+AttachmentFootprint printAttachmentReport(std::ostream& out)
+{
+  const auto scene = sceneAttachments();
+  const double MiB = 1048576.0;
+
+  AttachmentFootprint footprint;
+  out << "Scene attachments (" << msaaSamples << "x MSAA, " << swapChainExtent.width << "x" << swapChainExtent.height << ")\n"
+      << std::fixed << std::setprecision(2);
+  for (uint32_t i = 0; i < sceneAttachmentCount(); ++i)
+  {
+    const SceneAttachment& attachment = scene[i];
+    VkDeviceSize bytes = attachmentBytes(attachment);
+    VkDeviceSize moved = (attachment.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD ? bytes : 0) +
+                         (attachment.storeOp == VK_ATTACHMENT_STORE_OP_STORE ? bytes : 0);
+    footprint.movedBytes += moved;
+    footprint.skippedBytes += 2 * bytes - moved;
+
+    out << "  " << std::left << std::setw(11) << attachment.name << std::right << std::setw(2) << attachment.samples << "x  load "
+        << std::left << std::setw(9) << loadOpName(attachment.loadOp) << " store " << std::setw(9) << storeOpName(attachment.storeOp)
+        << std::right << std::setw(8) << moved / MiB << " MiB/frame, ";
+    if (!attachment.memory)
+    {
+      out << (headless ? "offscreen image" : "swap chain image") << "\n";
+      continue;
+    }
+
+    const DeviceAllocation& memory = *attachment.memory;
+    footprint.reservedBytes += memory.size;
+    out << memory.size / MiB << " MiB";
+    if (attachment.storeOp == VK_ATTACHMENT_STORE_OP_STORE)
+    {
+      out << "\n";
+    }else if (!memoryAllocator.isLazilyAllocated(memory.memoryType)){
+      out << ", transient, no lazily allocated memory\n";
+    }else{
+      out << ", transient, lazily allocated\n";
+      // The allocator gives lazily allocated memory a dedicated object, the commitment is this attachment's alone
+      VkDeviceSize committed = 0;
+      vkGetDeviceMemoryCommitment(Device, memory.memory, &committed);
+      footprint.lazyBytes += memory.size;
+      footprint.committedBytes += committed;
+    }
+  }
+
+  out << "  " << footprint.movedBytes / MiB << " MiB/frame loaded and stored, " << footprint.skippedBytes / MiB
+      << " MiB/frame left out by clear and dont-care, " << footprint.reservedBytes / MiB << " MiB attachment memory";
+  if (footprint.lazyBytes)
+    out << ", " << footprint.committedBytes / MiB << " of " << footprint.lazyBytes / MiB << " MiB lazily allocated memory committed ("
+        << (footprint.lazyBytes - footprint.committedBytes) / MiB << " MiB saved)";
+  out << std::defaultfloat << std::endl;
+  return footprint;
+}
+
+void createRenderPass()
+{
+  renderPass = VK_NULL_HANDLE;
+  if (dynamicRendering)
+    return; // The attachments are described when recording, see beginSceneRendering
+
+  const auto scene = sceneAttachments();
+  const bool resolve = msaaSamples != VK_SAMPLE_COUNT_1_BIT;
+  VkImageLayout presentLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; // Optimize layout for presenting on screen
+  if (headless)
+    presentLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL; // Nothing is presented, keep it ready for readback
+
+  VkAttachmentDescription attachments[3]{};
+  for (uint32_t i = 0; i < sceneAttachmentCount(); ++i)
+  {
+    attachments[i].format = scene[i].format;
+    attachments[i].samples = scene[i].samples;
+    attachments[i].loadOp = scene[i].loadOp;
+    attachments[i].storeOp = scene[i].storeOp;
+    attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE; // We don't use stencil buffer atm
+    attachments[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; // Since we clear or overwrite the image we don't care about the layout before rendering.
+  }
+  attachments[0].finalLayout = resolve ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : presentLayout;
+  attachments[1].finalLayout = gpuCulling ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  attachments[2].finalLayout = presentLayout;
+
+  VkAttachmentReference colorAttachmentRef{};
+  colorAttachmentRef.attachment = 0; // Since we only have 1 colorAttachment, it's index will be 0
+  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentReference depthAttachmentRef{};
+  depthAttachmentRef.attachment = 1;
+  depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentReference resolveAttachmentRef{};
+  resolveAttachmentRef.attachment = 2;
+  resolveAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  // The index of this attachment is directly referenced in the shader code with the
+  // 'layout (location = 0) out vec4 outColor' directive
+  // Following types of attachments exist
+  //
+  // -  pInputAttachments: Attachments that are read from a shader
+  // -  pResolveAttachments: Attachments used for multisampling color attachments
+  // -  pDepthStencilAttachment: Attachment for depth and stencil data
   // -  pPreserveAttachments: Attachments that are not used by this subpass, but for which the data must be preserved
   VkSubpassDescription subpass{};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
   subpass.colorAttachmentCount = 1;
   subpass.pColorAttachments = &colorAttachmentRef;
-  
+  subpass.pResolveAttachments = resolve ? &resolveAttachmentRef : nullptr; // Resolved at the end of the subpass
+  subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+  // The image is acquired asynchronously, the layout transition at the start of the render pass
+  // must wait until the imageAvailable semaphore has been signaled at the color output stage.
+  // The multisampled color image is shared by all frames like the depth image, the clear also
+  // has to wait for the previous frame's writes.
+  VkSubpassDependency dependencies[3]{};
+  dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[0].dstSubpass = 0;
+  dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependencies[0].srcAccessMask = resolve ? VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT : 0;
+  dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+  // All frames share the depth image. The clear has to wait for the previous frame's depth
+  // writes and for its depth pyramid build, which reads the image after the render pass.
+  dependencies[1].srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[1].dstSubpass = 0;
+  dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  dependencies[1].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+  dependencies[1].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+  // And the build has to wait for this frame's depth
+  dependencies[2].srcSubpass = 0;
+  dependencies[2].dstSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[2].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+  dependencies[2].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  dependencies[2].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  dependencies[2].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
   VkRenderPassCreateInfo renderPassInfo{};
   renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  renderPassInfo.attachmentCount = 1;
-  renderPassInfo.pAttachments = &colorAttachment;
+  renderPassInfo.attachmentCount = sceneAttachmentCount();
+  renderPassInfo.pAttachments = attachments;
   renderPassInfo.subpassCount = 1;
   renderPassInfo.pSubpasses = &subpass;
+  renderPassInfo.dependencyCount = 3;
+  renderPassInfo.pDependencies = dependencies;
 
-  if (vkCreateRenderPass(Device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS)
+  if (vkCreateRenderPass(Device, &renderPassInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_RENDER_PASS), &renderPass) != VK_SUCCESS)
     throw std::runtime_error("failed to create render pass.");
     
   
@@ -783,90 +1920,2519 @@ void createRenderPass()
 
 void createFrameBuffers()
 {
-  swapChainFramebuffers.resize(swapChainImageViews.size());
+  // Dynamic rendering renders into the image views directly
+  swapChainFramebuffers.resize(dynamicRendering ? 0 : swapChainImageViews.size());
   for (size_t i = 0; i < swapChainFramebuffers.size(); ++i)
   {
+    // In the order of sceneAttachments
     VkImageView attachments[] = {
+      swapChainImageViews[i],
+      depthImageView,
       swapChainImageViews[i]
     };
+    if (msaaSamples != VK_SAMPLE_COUNT_1_BIT)
+      attachments[0] = msaaColorImageView;
 
     VkFramebufferCreateInfo framebufferInfo{};
     framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     framebufferInfo.renderPass = renderPass;
-    framebufferInfo.attachmentCount = 1;
+    framebufferInfo.attachmentCount = sceneAttachmentCount();
     framebufferInfo.pAttachments = attachments;
     framebufferInfo.width = swapChainExtent.width;
     framebufferInfo.height = swapChainExtent.height;
     framebufferInfo.layers = 1;
 
-    if(vkCreateFramebuffer(Device, &framebufferInfo, nullptr, &swapChainFramebuffers[i]) != VK_SUCCESS)
+    if(vkCreateFramebuffer(Device, &framebufferInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_FRAMEBUFFER), &swapChainFramebuffers[i]) != VK_SUCCESS)
       throw std::runtime_error("failed to create framebuffer.");
   }
 }
 
+void createCommandPool()
+{
+  QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+
+  VkCommandPoolCreateInfo poolInfo{};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // We re-record every frame
+  poolInfo.queueFamilyIndex = indices.graphicsFamily.value();
+
+  if (vkCreateCommandPool(Device, &poolInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_COMMAND_POOL), &commandPool) != VK_SUCCESS)
+    throw std::runtime_error("failed to create command pool.");
+}
+
+void createCommandBuffers()
+{
+  commandBuffers.resize(framesInFlight);
+
+  VkCommandBufferAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.commandPool = commandPool;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+
+  if (vkAllocateCommandBuffers(Device, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
+    throw std::runtime_error("failed to allocate command buffers.");
+}
+
+void createRecorder()
+{
+  if (recordThreads)
+    recorder.init(Device, hostAllocator, findQueueFamilies(physicalDevice).graphicsFamily.value(), recordThreads, framesInFlight);
+}
+
+// The parts of the frame synchronization that exist per swap chain image, recreated along with the swap chain
+void createSwapChainSyncObjects()
+{
+  renderFinishedSemaphores.resize(headless ? 0 : swapChainImages.size());
+  imageFrames.assign(swapChainImages.size(), 0);
+
+  VkSemaphoreCreateInfo semaphoreInfo{};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  for (size_t i = 0; i < renderFinishedSemaphores.size(); ++i)
+  {
+    if (vkCreateSemaphore(Device, &semaphoreInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE), &renderFinishedSemaphores[i]) != VK_SUCCESS)
+      throw std::runtime_error("failed to create frame synchronization objects.");
+  }
+}
+
+void createSyncObjects()
+{
+  // Without presentation there is nothing to acquire and nobody waits for the rendering,
+  // the timeline is enough. The swap chain only takes binary semaphores.
+  imageAvailableSemaphores.resize(headless ? 0 : framesInFlight);
+  frameSlotNumbers.assign(framesInFlight, 0);
+
+  VkSemaphoreCreateInfo semaphoreInfo{};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  for (size_t i = 0; i < imageAvailableSemaphores.size(); ++i)
+  {
+    if (vkCreateSemaphore(Device, &semaphoreInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE), &imageAvailableSemaphores[i]) != VK_SUCCESS)
+      throw std::runtime_error("failed to create frame synchronization objects.");
+  }
+
+  // Everything numbered so far is done, the device is new
+  VkSemaphoreTypeCreateInfo typeInfo{};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  typeInfo.initialValue = submittedFrames;
+  completedFrames = submittedFrames;
+
+  VkSemaphoreCreateInfo timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  timelineInfo.pNext = &typeInfo;
+  if (vkCreateSemaphore(Device, &timelineInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE), &frameTimeline) != VK_SUCCESS)
+    throw std::runtime_error("failed to create frame timeline semaphore.");
+
+  createSwapChainSyncObjects();
+}
+
+// Strings in the reports are identifiers, only the device name needs escaping
+std::string jsonString(const char* text)
+{
+  std::string result = "\"";
+  for (const char* c = text; *c; ++c)
+  {
+    if (*c == '"' || *c == '\\')
+      result += '\\';
+    if (static_cast<unsigned char>(*c) >= 0x20)
+      result += *c;
+  }
+  return result + "\"";
+}
+
+// Where this launch's startup time went: every initVulkan stage and what the driver says about
+// the pipelines it built
+void writeStartupReport(const TaskGraph& graph)
+{
+  if (startupReportPath.empty())
+    return;
+  std::ofstream file(startupReportPath);
+  if (!file.is_open())
+  {
+    std::cerr << "failed to open " << startupReportPath << std::endl;
+    return;
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  file << "{\n  \"device\":" << jsonString(properties.deviceName) << ",\n"
+       << "  \"validationLayers\":" << (enableValidationLayers ? "true" : "false") << ",\n"
+       << "  \"initThreads\":" << initThreads << ",\n"
+       << "  \"pipelineCacheWarm\":" << (pipelineCacheWarm ? "true" : "false") << ",\n"
+       << "  \"taskGraph\":";
+  graph.writeJson(file);
+  file << ",\n  \"creationFeedback\":" << (creationFeedbackEnabled ? "true" : "false") << ",\n  \"pipelines\":[";
+  std::vector<PipelineFactory::BuildFeedback> feedback = pipelineFactory.getBuildFeedback();
+  file << std::fixed << std::setprecision(3);
+  for (size_t i = 0; i < feedback.size(); ++i)
+  {
+    const auto& build = feedback[i];
+    file << (i ? "," : "") << "\n    {\"ms\":" << build.ms << ",\"valid\":" << (build.valid ? "true" : "false")
+         << ",\"cacheHit\":" << (build.cacheHit ? "true" : "false") << ",\"driverMs\":" << build.driverMs
+         << ",\"vertexMs\":" << build.stageMs[0] << ",\"fragmentMs\":" << build.stageMs[1] << "}";
+  }
+  file << "],\n";
+  const HostAllocator::Counters& host = startupHostAllocations.total;
+  file << "  \"hostAllocations\":{\"allocations\":" << host.allocations << ",\"frees\":" << host.frees
+       << ",\"bytes\":" << host.bytes << ",\"liveBytes\":" << host.liveBytes << ",\"peakBytes\":" << host.peakBytes << "}\n}\n";
+  std::cout << "Wrote startup report to " << startupReportPath << std::endl;
+}
+
 void initVulkan()
 {
   // Take all notes with a fist of salt, Im still learning.
-  createInstance();         // Create a Vulkan instance
-  setupDebugMessenger();    // Set up debug messengers 
-  createSurface();          // Create a render surface, basically a glfw window with a vulkan context.
-  pickPhysicalDevice();     // Choose graphics card
-  createLogicalDevice();    // Configure the capabilities of the card
-  createSwapChain();        // Create a chain of images to displat
-  createImageViews();       // Configure each image in the chain
-  createRenderPass();       // Structure referenced by the pipeline
-  createGraphicsPipeline(); // Set up buffers, renderstate, blending etc
-  createFrameBuffers();     // Binds together VkImageViews retrieved from the swapChain and RenderPassAttachments
+  // The stages are a dependency graph rather than a list. Everything whose inputs are ready runs
+  // at the same time, e.g. the SPIR-V is read while the instance is still being created and the
+  // image views and framebuffers are built while the pipeline compiles.
+  using Node = TaskGraph::NodeId;
+  TaskGraph graph;
+
+  // GLFW only allows this on the main thread, the swap chain is created on a worker
+  int width = 0, height = 0;
+  if (!headless)
+    glfwGetFramebufferSize(window, &width, &height);
+  const VkExtent2D framebufferSize{static_cast<uint32_t>(width), static_cast<uint32_t>(height)};
+
+  Node loadVert     = graph.addNode("loadVertShader", []{ loadShader(vertShader); });
+  Node loadFrag     = graph.addNode("loadFragShader", []{ loadShader(fragShader); });
+
+  Node instance     = graph.addNode("createInstance", createInstance);              // Create a Vulkan instance
+  graph.addNode("setupDebugMessenger", setupDebugMessenger, {instance});            // Set up debug messengers
+  Node surface      = headless ? instance :
+                      graph.addNode("createSurface", createSurface, {instance});    // Create a render surface, basically a glfw window with a vulkan context.
+  Node physical     = graph.addNode("pickPhysicalDevice", pickPhysicalDevice, {surface}); // Choose graphics card
+  Node format       = graph.addNode("selectSwapChainFormat", selectSwapChainFormat, {physical});
+  Node device       = graph.addNode("createLogicalDevice", createLogicalDevice, {physical}); // Configure the capabilities of the card
+  Node allocator    = graph.addNode("createMemoryAllocator", createMemoryAllocator, {device}); // Hands out buffer and image memory from large blocks
+  Node upload       = graph.addNode("createUploadEngine", createUploadEngine, {allocator}); // Staging ring and transfer queue batches
+  Node cache        = graph.addNode("createPipelineCache", createPipelineCache, {device});   // Load previously compiled pipelines from disk
+  Node vertModule   = graph.addNode("createVertModule", []{ createShaderModule(vertShader); }, {device, loadVert});
+  Node fragModule   = graph.addNode("createFragModule", []{ createShaderModule(fragShader); }, {device, loadFrag});
+  Node cull         = upload;
+  Node pyramid      = allocator;
+  if (gpuCulling)
+  {
+    Node loadCull   = graph.addNode("loadCullShader", []{ loadShader(cullShader); });
+    Node loadHiZ    = graph.addNode("loadPyramidShader", []{ loadShader(pyramidShader); });
+    Node cullModule = graph.addNode("createCullModule", []{ createShaderModule(cullShader); }, {device, loadCull});
+    Node hizModule  = graph.addNode("createPyramidModule", []{ createShaderModule(pyramidShader); }, {device, loadHiZ});
+    cull            = graph.addNode("createCuller", createCuller, {upload, cache, cullModule}); // Culling compute pipeline
+    pyramid         = graph.addNode("createDepthPyramid", createDepthPyramid, {allocator, cache, hizModule}); // Hi-Z build pipeline
+  }
+  if (computeLoad)
+  {
+    Node loadSimulate   = graph.addNode("loadSimulateShader", []{ loadShader(simulateShader); });
+    Node simulateModule = graph.addNode("createSimulateModule", []{ createShaderModule(simulateShader); }, {device, loadSimulate});
+    graph.addNode("createAsyncCompute", createAsyncCompute, {allocator, cache, simulateModule}); // Simulation pipeline and compute queue
+  }
+  Node kernels      = graph.addNode("createInstanceKernels", createInstanceKernels);       // SIMD kernels and their worker threads
+  Node instances    = graph.addNode("createInstanceBuffer", createInstanceBuffer, {upload, cull, kernels}); // Per instance transforms and colors
+  Node heap         = graph.addNode("createBindlessHeap", createBindlessHeap, {device});    // Descriptor tables for every shader resource
+  graph.addNode("createMaterials", createMaterials, {instances, heap});                    // Uploads after the instances, the upload engine is single threaded
+  Node ring         = graph.addNode("createFrameRing", createFrameRing, {allocator});       // Mapped per frame buffers for the camera and the objects
+  Node swapChain    = headless ?
+                      graph.addNode("createOffscreenTargets", createOffscreenTargets, {allocator, format}) : // Images we own and render into instead of a swap chain
+                      graph.addNode("createSwapChain", [framebufferSize]{ createSwapChain(framebufferSize); }, {device, format}); // Create a chain of images to displat
+  Node views        = graph.addNode("createImageViews", createImageViews, {swapChain});      // Configure each image in the chain
+  Node depth        = graph.addNode("createDepthResources", createDepthResources, {swapChain, allocator, pyramid}); // Depth buffer, its pyramid with --gpu-cull and the multisampled color image with --msaa
+  Node pass         = graph.addNode("createRenderPass", createRenderPass, {device, format}); // Structure referenced by the pipeline
+  graph.addNode("createGraphicsPipeline", createGraphicsPipeline,                            // Set up buffers, renderstate, blending etc
+                {pass, cache, vertModule, fragModule, heap, ring});
+  graph.addNode("createFrameBuffers", createFrameBuffers, {views, depth, pass});                  // Binds together VkImageViews retrieved from the swapChain and RenderPassAttachments
+  Node pool         = graph.addNode("createCommandPool", createCommandPool, {device});       // Memory pool that command buffers are allocated from
+  graph.addNode("createCommandBuffers", createCommandBuffers, {pool});                     // One command buffer per frame in flight
+  graph.addNode("createRecorder", createRecorder, {device});                               // Recording threads and their command pools
+  graph.addNode("createSyncObjects", createSyncObjects, {swapChain});                      // Semaphores and the frame timeline used to pace the frames
+
+  ThreadPool threadPool(initThreads);
+  graph.run(threadPool);
+  PROFILE_TASK_GRAPH(graph);
+
+  StartupRun startup{graph.totalMs(), {}};
+  graph.forEachNode([&](const char* name, uint32_t, TaskGraph::clock::time_point start, TaskGraph::clock::time_point end) {
+    startup.stages.push_back({name, std::chrono::duration<double, std::milli>(end - start).count()});
+  });
+  startupRuns.push_back(std::move(startup));
+  startupHostAllocations = hostAllocator.snapshot();
+  if (startupBenchRuns == 0)
+  {
+    graph.printTimings(std::cout);
+    memoryAllocator.printStats(std::cout);
+    const HostAllocator::Counters& host = startupHostAllocations.total;
+    std::cout << "Host allocations during startup: " << host.allocations << " (" << host.bytes / 1024 << " KiB), "
+              << host.liveBytes / 1024 << " KiB live, " << host.peakBytes / 1024 << " KiB peak" << std::endl;
+    writeStartupReport(graph);
+  }
+
+  PROFILE_INIT_GPU(Device, hostAllocator, physicalDevice, findQueueFamilies(physicalDevice).graphicsFamily.value(), framesInFlight);
+}
+
+void destroyRetiredSwapChain(const RetiredSwapChain& retired)
+{
+  for (auto framebuffer : retired.framebuffers)
+    vkDestroyFramebuffer(Device, framebuffer, hostAllocator.callbacks(VK_OBJECT_TYPE_FRAMEBUFFER));
+  for (auto imageView : retired.imageViews)
+    vkDestroyImageView(Device, imageView, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+  for (auto semaphore : retired.renderFinishedSemaphores)
+    vkDestroySemaphore(Device, semaphore, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE));
+  vkDestroyImageView(Device, retired.depthImageView, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+  VkImage image = retired.depthImage;
+  DeviceAllocation memory = retired.depthImageMemory;
+  memoryAllocator.destroyImage(image, memory);
+  vkDestroyImageView(Device, retired.msaaColorImageView, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+  image = retired.msaaColorImage;
+  memory = retired.msaaColorImageMemory;
+  memoryAllocator.destroyImage(image, memory);
+  DepthPyramid::Images pyramid = retired.depthPyramid;
+  if (gpuCulling)
+    depthPyramid.destroy(pyramid);
+  vkDestroySwapchainKHR(Device, retired.swapChain, hostAllocator.callbacks(VK_OBJECT_TYPE_SWAPCHAIN_KHR));
 }
 
 void cleanup()
 {
-  for (auto framebuffer : swapChainFramebuffers)
-    vkDestroyFramebuffer(Device, framebuffer, nullptr);
+  PROFILE_SHUTDOWN();
+  PROFILE_WRITE_TRACE(tracePath);
+
+  for (const auto& retired : retiredSwapChains)
+    destroyRetiredSwapChain(retired);
+  retiredSwapChains.clear();
 
-  vkDestroyPipeline(Device, graphicsPipeline, nullptr);
-  vkDestroyPipelineLayout(Device, pipelineLayout, nullptr);
-  vkDestroyRenderPass(Device, renderPass, nullptr);
+  for (auto semaphore : imageAvailableSemaphores)
+    vkDestroySemaphore(Device, semaphore, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE));
+  vkDestroySemaphore(Device, frameTimeline, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE));
+  for (auto semaphore : renderFinishedSemaphores)
+    vkDestroySemaphore(Device, semaphore, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE));
+  vkDestroyCommandPool(Device, commandPool, hostAllocator.callbacks(VK_OBJECT_TYPE_COMMAND_POOL));
+  recorder.shutdown();
+
+  for (auto framebuffer : swapChainFramebuffers)
+    vkDestroyFramebuffer(Device, framebuffer, hostAllocator.callbacks(VK_OBJECT_TYPE_FRAMEBUFFER));
+
+  pipelineFactory.shutdown();
+  savePipelineCache();
+  vkDestroyPipelineCache(Device, pipelineCache, hostAllocator.callbacks(VK_OBJECT_TYPE_PIPELINE_CACHE));
+  vkDestroyPipelineLayout(Device, pipelineLayout, hostAllocator.callbacks(VK_OBJECT_TYPE_PIPELINE_LAYOUT));
+  destroyMaterials();
+  bindless.shutdown();
+  frameRing.shutdown();
+  vkDestroyRenderPass(Device, renderPass, hostAllocator.callbacks(VK_OBJECT_TYPE_RENDER_PASS));
   for (auto imageView : swapChainImageViews)
-    vkDestroyImageView(Device, imageView, nullptr);
-  vkDestroySwapchainKHR(Device,swapChain,nullptr);
-  vkDestroyDevice(Device, nullptr);
+    vkDestroyImageView(Device, imageView, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+  destroyDepthResources();
+  if (headless)
+  {
+    for (size_t i = 0; i < swapChainImages.size(); ++i)
+      memoryAllocator.destroyImage(swapChainImages[i], offscreenImageMemory[i]);
+  }else{
+    vkDestroySwapchainKHR(Device,swapChain,hostAllocator.callbacks(VK_OBJECT_TYPE_SWAPCHAIN_KHR));
+  }
+  destroyInstanceBuffer();
+  if (gpuCulling)
+  {
+    culler.shutdown();
+    depthPyramid.shutdown();
+    memoryAllocator.destroyBuffer(triangleIndexBuffer, triangleIndexMemory);
+  }
+  if (computeLoad)
+    asyncCompute.shutdown();
+  uploadEngine.shutdown();
+  memoryAllocator.shutdown();
+  vkDestroyDevice(Device, hostAllocator.callbacks(VK_OBJECT_TYPE_DEVICE));
   if (enableValidationLayers) {
-    DestroyDebugUtilsMessengerEXT(Instance, debugMessenger, nullptr);
+    DestroyDebugUtilsMessengerEXT(Instance, debugMessenger, hostAllocator.callbacks(VK_OBJECT_TYPE_DEBUG_UTILS_MESSENGER_EXT));
+  }
+  if (!headless)
+    vkDestroySurfaceKHR(Instance, surface, hostAllocator.callbacks(VK_OBJECT_TYPE_SURFACE_KHR));
+  vkDestroyInstance(Instance, hostAllocator.callbacks(VK_OBJECT_TYPE_INSTANCE));
+  if (!headless)
+  {
+    glfwDestroyWindow(window);
+    glfwTerminate();
   }
-  vkDestroySurfaceKHR(Instance, surface, nullptr);
-  vkDestroyInstance(Instance, nullptr);
-  glfwDestroyWindow(window);
-  glfwTerminate();
+
+  // --startup-bench starts up again after this, nothing may still refer to the destroyed objects.
+  // createSwapChain in particular hands swapChain to the driver as oldSwapchain.
+  swapChain = VK_NULL_HANDLE;
+  swapChainImages.clear();
+  swapChainImageViews.clear();
+  swapChainFramebuffers.clear();
+  offscreenImageMemory.clear();
+  pendingPresents.clear();
+  imageAvailableSemaphores.clear();
+  renderFinishedSemaphores.clear();
+  frameTimeline = VK_NULL_HANDLE;
+  commandPool = VK_NULL_HANDLE;
+  commandBuffers.clear();
+  renderPass = VK_NULL_HANDLE;
+  pipelineLayout = VK_NULL_HANDLE;
+  graphicsPipeline = VK_NULL_HANDLE;
+  pipelineCache = VK_NULL_HANDLE;
+  debugMessenger = VK_NULL_HANDLE;
+  surface = VK_NULL_HANDLE;
+  Device = VK_NULL_HANDLE;
+  Instance = VK_NULL_HANDLE;
+  window = nullptr;
 }
 
-void mainLoop()
+// Draw i is cell i of a square grid covering the screen. With a single draw that is the
+// original full size triangle. Called from several threads at once, only reads globals.
+void recordSceneDraws(VkCommandBuffer commandBuffer, uint32_t first, uint32_t count)
+{
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+
+  // Dynamic state isn't inherited by secondary command buffers, every one sets its own
+  VkViewport viewport{0.0f, 0.0f, (float) swapChainExtent.width, (float) swapChainExtent.height, 0.0f, 1.0f};
+  VkRect2D scissor{{0, 0}, swapChainExtent};
+  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+  vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+  VkDeviceSize instanceOffset = 0;
+  vkCmdBindVertexBuffers(commandBuffer, 0, 1, &instanceBuffer, &instanceOffset);
+
+  // The tables and the frame data are bound once, a draw only pushes its object and material index
+  frameRing.bind(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, frameDataSet, cameraOffset, objectsOffset);
+  uint64_t binds = 1;
+  if (!bindPerDraw)
+  {
+    bindless.bind(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout);
+    binds++;
+  }
+
+  if (gpuCulling)
+  {
+    // A single job, the draws come out of the culling pass and place their instances themselves
+    descriptorBinds += binds;
+    frameObjects[0] = {{0.0f, 0.0f}, 1.0f, 0.0f};
+    DrawConstants constants{0, materialSlots[0]};
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants), &constants);
+    vkCmdBindIndexBuffer(commandBuffer, triangleIndexBuffer, 0, VK_INDEX_TYPE_UINT16);
+    culler.draw(commandBuffer, currentFrame);
+    return;
+  }
+
+  // Each job writes the objects of its own draws, the ranges don't overlap
+  uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(sceneDrawCount))));
+  DrawConstants constants{};
+  for (uint32_t i = first; i < first + count; ++i)
+  {
+    ObjectData& object = frameObjects[i];
+    object.offset[0] = -1.0f + (2.0f * (i % side) + 1.0f) / side;
+    object.offset[1] = -1.0f + (2.0f * (i / side) + 1.0f) / side;
+    object.scale = 1.0f / side;
+    constants.object = i;
+    uint32_t material = i % materialCount;
+    if (bindPerDraw)
+    {
+      // The baseline: the material's own set, holding just its buffer at index 0
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, BindlessHeap::BUFFERS,
+                              1, &perDrawMaterialSets[material], 0, nullptr);
+      binds++;
+      constants.material = 0;
+    }else{
+      constants.material = materialSlots[material];
+    }
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants), &constants);
+    vkCmdDraw(commandBuffer, 3, instanceCount, 0, 0); // The triangle is hard coded in the vertex shader
+  }
+  descriptorBinds += binds;
+}
+
+// Stencil is never used, but a combined format has to transition both aspects together
+VkImageAspectFlags depthBarrierAspects()
+{
+  if (depthFormat == VK_FORMAT_D32_SFLOAT)
+    return VK_IMAGE_ASPECT_DEPTH_BIT;
+  return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+}
+
+void imageBarrier(VkCommandBuffer commandBuffer, VkImage image, VkImageAspectFlags aspects,
+                  VkImageLayout oldLayout, VkImageLayout newLayout,
+                  VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+                  VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+{
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstAccessMask = dstAccess;
+  barrier.oldLayout = oldLayout;
+  barrier.newLayout = newLayout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange = {aspects, 0, 1, 0, 1};
+  vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+// Starts drawing into the swap chain image and the depth buffer, either with the render pass or
+// with dynamic rendering. With --msaa the drawing goes to the multisampled color image instead and
+// the swap chain image receives the resolve. Without a render pass its layout transitions and
+// subpass dependencies (see createRenderPass) become explicit barriers, the ones here mirror them
+// one to one.
+void beginSceneRendering(VkCommandBuffer commandBuffer, uint32_t imageIndex, bool secondaries)
 {
-  while (!glfwWindowShouldClose(window))
+  VkClearValue clearValues[2]{};
+  clearValues[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}};
+  clearValues[1].depthStencil = {1.0f, 0}; // Farthest
+
+  if (!dynamicRendering)
+  {
+    VkRenderPassBeginInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = renderPass;
+    renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+    renderPassInfo.renderArea.offset = {0, 0};
+    renderPassInfo.renderArea.extent = swapChainExtent;
+    renderPassInfo.clearValueCount = 2;
+    renderPassInfo.pClearValues = clearValues;
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, secondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+    return;
+  }
+
+  const auto scene = sceneAttachments();
+  const bool resolve = msaaSamples != VK_SAMPLE_COUNT_1_BIT;
+  imageBarrier(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_ASPECT_COLOR_BIT,
+               VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0,
+               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+  if (resolve)
+    imageBarrier(commandBuffer, msaaColorImage, VK_IMAGE_ASPECT_COLOR_BIT,
+                 VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+  imageBarrier(commandBuffer, depthImage, depthBarrierAspects(),
+               VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+               VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+               VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+               VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+
+  VkRenderingAttachmentInfo colorAttachment{};
+  colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+  colorAttachment.imageView = resolve ? msaaColorImageView : swapChainImageViews[imageIndex];
+  colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  colorAttachment.loadOp = scene[0].loadOp;
+  colorAttachment.storeOp = scene[0].storeOp;
+  colorAttachment.clearValue = clearValues[0];
+  if (resolve)
   {
-    glfwPollEvents();
+    colorAttachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+    colorAttachment.resolveImageView = swapChainImageViews[imageIndex];
+    colorAttachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
   }
+
+  VkRenderingAttachmentInfo depthAttachment{};
+  depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+  depthAttachment.imageView = depthImageView;
+  depthAttachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  depthAttachment.loadOp = scene[1].loadOp;
+  depthAttachment.storeOp = scene[1].storeOp;
+  depthAttachment.clearValue = clearValues[1];
+
+  VkRenderingInfo renderingInfo{};
+  renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+  renderingInfo.flags = secondaries ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0;
+  renderingInfo.renderArea.offset = {0, 0};
+  renderingInfo.renderArea.extent = swapChainExtent;
+  renderingInfo.layerCount = 1;
+  renderingInfo.colorAttachmentCount = 1;
+  renderingInfo.pColorAttachments = &colorAttachment;
+  renderingInfo.pDepthAttachment = &depthAttachment;
+  pfnCmdBeginRendering(commandBuffer, &renderingInfo);
 }
 
-void run()
+void endSceneRendering(VkCommandBuffer commandBuffer, uint32_t imageIndex)
 {
-  try{
-    initWindow();
-    initVulkan();
-  }catch(const std::exception& e){
-    std::cerr << e.what() << std::endl;
+  if (!dynamicRendering)
+  {
+    vkCmdEndRenderPass(commandBuffer);
     return;
   }
-  mainLoop();
-  cleanup();
+  pfnCmdEndRendering(commandBuffer);
+
+  // The present (or the readback in headless mode) waits on the submit, no stage has to wait here
+  imageBarrier(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_ASPECT_COLOR_BIT,
+               VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+               VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+  if (gpuCulling)
+    imageBarrier(commandBuffer, depthImage, depthBarrierAspects(),
+                 VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                 VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 }
 
+// Returns the upload timeline value the frame has to wait for, 0 if it doesn't depend on any uploads
+uint64_t recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+  PROFILE_SCOPE("recordCommandBuffer");
+
+  VkCommandBufferBeginInfo beginInfo{};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT; // Re-recorded every frame
 
-int main( int argc, char* argv[])
+  if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+    throw std::runtime_error("failed to begin recording command buffer.");
+
+  PROFILE_BEGIN_FRAME(commandBuffer, currentFrame);
+
+  // A hash lookup once it is built, and it keeps the pipeline from being destroyed while the frame uses it
+  graphicsPipeline = pipelineFactory.get(scenePipelineKey);
+
+  // Take ownership of everything the transfer queue finished uploading since the last frame
+  uint64_t uploadWait = uploadEngine.acquireOnGraphics(commandBuffer);
+
+  // The slot's previous frame has finished, its part of the ring is free again. Everything is allocated
+  // before the ring is bound, growing it rewrites the descriptor set.
+  uint32_t drawCount = gpuCulling ? 1 : sceneDrawCount;
+  glm::mat4 viewProjection = cameraViewProjection();
+  frameRing.beginFrame(currentFrame);
+  frameRing.allocate<CameraData>(1, cameraOffset)->viewProjection = viewProjection;
+  frameObjects = frameRing.allocate<ObjectData>(drawCount, objectsOffset);
+
+  if (gpuCulling)
+  {
+    PROFILE_GPU_SCOPE(commandBuffer, "frustumCulling");
+    culler.record(commandBuffer, currentFrame, viewProjection, occlusionCulling);
+  }
+
+  {
+    PROFILE_GPU_SCOPE(commandBuffer, "mainRenderPass");
+    if (recordThreads == 0)
+    {
+      beginSceneRendering(commandBuffer, imageIndex, false);
+      recordSceneDraws(commandBuffer, 0, drawCount);
+    }else{
+      // The render pass only holds secondaries, the draws are recorded on the recorder threads
+      beginSceneRendering(commandBuffer, imageIndex, true);
+      VkCommandBufferInheritanceRenderingInfo inheritanceRendering{};
+      inheritanceRendering.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+      inheritanceRendering.colorAttachmentCount = 1;
+      inheritanceRendering.pColorAttachmentFormats = &swapChainImageFromat;
+      inheritanceRendering.depthAttachmentFormat = depthFormat;
+      inheritanceRendering.rasterizationSamples = msaaSamples;
+      const auto& secondaries = dynamicRendering
+        ? recorder.record(currentFrame, VK_NULL_HANDLE, VK_NULL_HANDLE, drawCount, recordSceneDraws, &inheritanceRendering)
+        : recorder.record(currentFrame, renderPass, swapChainFramebuffers[imageIndex], drawCount, recordSceneDraws);
+      vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaries.size()), secondaries.data());
+    }
+    endSceneRendering(commandBuffer, imageIndex);
+  }
+  if (gpuCulling)
+  {
+    culler.recordReadback(commandBuffer, currentFrame);
+    // For the next frame's occlusion test. Built even with --no-occlusion, the culling pass's
+    // descriptor set points at it either way.
+    PROFILE_GPU_SCOPE(commandBuffer, "depthPyramid");
+    depthPyramid.build(commandBuffer, currentFrame);
+  }
+
+  PROFILE_END_GPU_FRAME(commandBuffer);
+  if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+    throw std::runtime_error("failed to record command buffer.");
+
+  return uploadWait;
+}
+
+// Submits the command buffer of the current frame. The semaphores are optional, headless frames have neither.
+void submitFrame(uint64_t uploadWait, uint64_t computeWait, VkSemaphore waitSemaphore, VkSemaphore signalSemaphore)
+{
+  std::vector<VkSemaphore> waitSemaphores;
+  std::vector<VkPipelineStageFlags> waitStages;
+  std::vector<uint64_t> waitValues; // Ignored for binary semaphores, but there has to be one per wait
+  if (waitSemaphore != VK_NULL_HANDLE)
+  {
+    waitSemaphores.push_back(waitSemaphore);
+    waitStages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+    waitValues.push_back(0);
+  }
+  if (uploadWait)
+  {
+    waitSemaphores.push_back(uploadEngine.timelineSemaphore());
+    waitStages.push_back(UploadEngine::CONSUMER_STAGES);
+    waitValues.push_back(uploadWait);
+  }
+  if (computeWait)
+  {
+    // Where the shaders would read the particles
+    waitSemaphores.push_back(asyncCompute.timelineSemaphore());
+    waitStages.push_back(VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
+    waitValues.push_back(computeWait);
+  }
+
+  // The frame signals its number on frameTimeline, and the present semaphore if there is one
+  uint64_t frame = submittedFrames + 1;
+  VkSemaphore signalSemaphores[] = {frameTimeline, signalSemaphore};
+  uint64_t signalValues[] = {frame, 0};
+  uint32_t signalCount = signalSemaphore != VK_NULL_HANDLE ? 2 : 1;
+
+  VkTimelineSemaphoreSubmitInfo timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size());
+  timelineInfo.pWaitSemaphoreValues = waitValues.data();
+  timelineInfo.signalSemaphoreValueCount = signalCount;
+  timelineInfo.pSignalSemaphoreValues = signalValues;
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+  submitInfo.pWaitSemaphores = waitSemaphores.data();
+  submitInfo.pWaitDstStageMask = waitStages.data();
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+  submitInfo.signalSemaphoreCount = signalCount;
+  submitInfo.pSignalSemaphores = signalSemaphores;
+
+  {
+    PROFILE_SCOPE("queueSubmit");
+    PROFILE_SUBMIT(currentFrame);
+    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+      throw std::runtime_error("failed to submit draw command buffer.");
+  }
+  frameSlotNumbers[currentFrame] = submittedFrames = frame;
+}
+
+// Submits this frame's simulation step and returns the compute timeline value the frame waits for
+uint64_t submitCompute()
+{
+  if (!computeLoad)
+    return 0;
+  PROFILE_SCOPE("submitCompute");
+  uint64_t previous = asyncCompute.lastValue();
+  uint64_t current = asyncCompute.submit(currentFrame, computeLoad);
+  return serializeCompute ? current : previous;
+}
+
+// Counters of the most recently completed frame with --gpu-cull
+GpuCuller::Stats lastCullStats;
+
+// Blocks until the GPU has finished the given frame. Frames already known to be done cost
+// nothing, otherwise the counter is read first and only waited on if it is behind. Either way
+// completedFrames moves up to everything that has finished, not just the frame asked for.
+void waitForFrame(uint64_t frame)
+{
+  if (frame <= completedFrames)
+    return;
+  frameSyncCalls++;
+  if (vkGetSemaphoreCounterValue(Device, frameTimeline, &completedFrames) != VK_SUCCESS)
+    throw std::runtime_error("failed to read frame timeline.");
+  if (frame <= completedFrames)
+    return;
+
+  VkSemaphoreWaitInfo waitInfo{};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &frameTimeline;
+  waitInfo.pValues = &frame;
+  frameSyncCalls++;
+  // On device loss the frame never finishes, nothing it uses may be handed out again
+  if (vkWaitSemaphores(Device, &waitInfo, UINT64_MAX) != VK_SUCCESS)
+    throw std::runtime_error("failed to wait for frame.");
+  completedFrames = frame;
+}
+
+// Wait until the GPU is done with the frame that last used this slot. With N frames in flight
+// this only blocks when the CPU is N frames ahead.
+void waitForFrameSlot()
+{
+  PROFILE_SCOPE("waitForFrameSlot");
+  waitForFrame(frameSlotNumbers[currentFrame]);
+  pipelineFactory.beginFrame(submittedFrames + 1, completedFrames);
+  bindless.collect(completedFrames);
+  if (gpuCulling && frameSlotNumbers[currentFrame])
+    lastCullStats = culler.getStats(currentFrame);
+}
+
+void destroyFinishedSwapChains()
+{
+  auto finished = [](const RetiredSwapChain& retired) { return retired.lastFrame <= completedFrames; };
+  for (const auto& retired : retiredSwapChains)
+  {
+    if (finished(retired))
+      destroyRetiredSwapChain(retired);
+  }
+  retiredSwapChains.erase(std::remove_if(retiredSwapChains.begin(), retiredSwapChains.end(), finished), retiredSwapChains.end());
+}
+
+// Builds a new swap chain for the current window size without waiting for the device. The old
+// swap chain is handed to the driver as oldSwapchain and retired together with its views,
+// framebuffers and semaphores. Frames that are still in flight keep using them, they are
+// destroyed in destroyFinishedSwapChains once those frames are done.
+void recreateSwapChain()
+{
+  PROFILE_SCOPE("recreateSwapChain");
+
+  // A minimized window has no size, there is nothing to render to until it comes back
+  int width = 0, height = 0;
+  glfwGetFramebufferSize(window, &width, &height);
+  while ((width == 0 || height == 0) && !glfwWindowShouldClose(window))
+  {
+    glfwWaitEvents();
+    glfwGetFramebufferSize(window, &width, &height);
+  }
+  framebufferResized = false;
+
+  // The presentation engine may still hold the last semaphores after their frames are done,
+  // give it one more round of frame slots before destroying them.
+  RetiredSwapChain retired{};
+  retired.swapChain = swapChain;
+  retired.imageViews = swapChainImageViews;
+  retired.framebuffers = swapChainFramebuffers;
+  retired.renderFinishedSemaphores = renderFinishedSemaphores;
+  retired.depthImage = depthImage;
+  retired.depthImageView = depthImageView;
+  retired.depthImageMemory = depthImageMemory;
+  retired.msaaColorImage = msaaColorImage;
+  retired.msaaColorImageView = msaaColorImageView;
+  retired.msaaColorImageMemory = msaaColorImageMemory;
+  if (gpuCulling)
+    retired.depthPyramid = depthPyramid.release();
+  retired.lastFrame = submittedFrames + framesInFlight;
+  retiredSwapChains.push_back(retired);
+
+  createSwapChain({static_cast<uint32_t>(width), static_cast<uint32_t>(height)});
+  createImageViews();
+  createDepthResources();
+  createFrameBuffers();
+  createSwapChainSyncObjects();
+  swapChainRecreations++;
+}
+
+// Records the latency of every present that has reached the display since the last call
+void collectPresentLatencies()
+{
+  while (presentWaitEnabled && !pendingPresents.empty())
+  {
+    const PendingPresent& pending = pendingPresents.front();
+    // Ids belong to a swap chain, once it is replaced we can't ask about them anymore
+    if (pending.swapChain == swapChain)
+    {
+      if (pfnWaitForPresentKHR(Device, swapChain, pending.id, 0) != VK_SUCCESS)
+        break;
+      inputLatencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pending.inputTime).count());
+    }
+    pendingPresents.pop_front();
+  }
+}
+
+// Low latency pacing: don't start on a frame before the previous one is on screen. Nothing
+// queues up in front of the display and the input sampled next is as fresh as it can be.
+void throttleToDisplay()
+{
+  PROFILE_SCOPE("waitForPresent");
+  if (presentWaitEnabled)
+  {
+    if (lastPresentId && lastPresentSwapChain == swapChain)
+    {
+      // An out of date swap chain is recreated by the next acquire
+      VkResult result = pfnWaitForPresentKHR(Device, swapChain, lastPresentId, UINT64_MAX);
+      if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR && result != VK_ERROR_OUT_OF_DATE_KHR)
+        throw std::runtime_error("failed to wait for present.");
+    }
+  }else{
+    // The closest we get without present wait is to let the GPU run dry
+    waitForFrame(submittedFrames);
+  }
+}
+
+// Input is read as late as possible, right before recording, so the frame reflects the freshest state
+void sampleInput()
+{
+  PROFILE_SCOPE("sampleInput");
+  glfwPollEvents();
+
+  InputSample sample;
+  glfwGetCursorPos(window, &sample.cursorX, &sample.cursorY);
+  sample.dragging = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+  sample.time = std::chrono::steady_clock::now();
+
+  if (sample.dragging && latestInput.dragging && swapChainExtent.width && swapChainExtent.height)
+  {
+    sceneOffset[0] += 2.0f * (float) (sample.cursorX - latestInput.cursorX) / swapChainExtent.width;
+    sceneOffset[1] += 2.0f * (float) (sample.cursorY - latestInput.cursorY) / swapChainExtent.height;
+  }
+  latestInput = sample;
+}
+
+// CPU time the last frame spent recording and submitting its command buffer
+double lastRecordSubmitMs = 0;
+
+void drawFrame()
 {
-  glm::mat4 matrix;
-  glm::vec4 vec;
-  auto test = matrix * vec;
+  PROFILE_SCOPE("drawFrame");
+
+  waitForFrameSlot();
+  destroyFinishedSwapChains();
+  if (lowLatency)
+    throttleToDisplay();
+  collectPresentLatencies();
+
+  uint32_t imageIndex;
+  VkResult result;
+  {
+    PROFILE_SCOPE("acquireNextImage");
+    result = vkAcquireNextImageKHR(Device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+  }
+  if (result == VK_ERROR_OUT_OF_DATE_KHR)
+  {
+    // Nothing was acquired and the semaphore is untouched, try again next frame with a new swap chain
+    recreateSwapChain();
+    return;
+  }
+  if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+    throw std::runtime_error("failed to acquire swap chain image.");
+
+  // If there are more frames in flight than swapchain images (or images are returned out of order)
+  // the image can still be rendered to by an older frame.
+  waitForFrame(imageFrames[imageIndex]);
+  imageFrames[imageIndex] = submittedFrames + 1;
+
+  // Before recording, so the compute queue has work while this frame is recorded
+  uint64_t computeWait = submitCompute();
+  sampleInput();
+  auto recordStart = std::chrono::steady_clock::now();
+  vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+  uint64_t uploadWait = recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+
+  VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[imageIndex]};
+  submitFrame(uploadWait, computeWait, imageAvailableSemaphores[currentFrame], signalSemaphores[0]);
+  lastRecordSubmitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - recordStart).count();
+
+  // The frame number doubles as the present id
+  uint64_t presentId = submittedFrames;
+  VkPresentIdKHR presentIdInfo{};
+  presentIdInfo.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+  presentIdInfo.swapchainCount = 1;
+  presentIdInfo.pPresentIds = &presentId;
+
+  VkPresentInfoKHR presentInfo{};
+  presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+  presentInfo.pNext = presentWaitEnabled ? &presentIdInfo : nullptr;
+  presentInfo.waitSemaphoreCount = 1;
+  presentInfo.pWaitSemaphores = signalSemaphores;
+  presentInfo.swapchainCount = 1;
+  presentInfo.pSwapchains = &swapChain;
+  presentInfo.pImageIndices = &imageIndex;
+
+  {
+    PROFILE_SCOPE("queuePresent");
+    result = vkQueuePresentKHR(presentQueue, &presentInfo);
+  }
+  currentFrame = (currentFrame + 1) % framesInFlight;
+  if (presentWaitEnabled)
+  {
+    lastPresentId = presentId;
+    lastPresentSwapChain = swapChain;
+    pendingPresents.push_back(PendingPresent{presentId, swapChain, latestInput.time});
+  }
+
+  if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized)
+    recreateSwapChain();
+  else if (result != VK_SUCCESS)
+    throw std::runtime_error("failed to present swap chain image.");
+}
+
+void drawFrameHeadless()
+{
+  PROFILE_SCOPE("drawFrame");
+
+  // Same pacing as drawFrame, but the frame slot owns its image so there is nothing to acquire or present.
+  waitForFrameSlot();
+
+  uint32_t imageIndex = currentFrame;
+  uint64_t computeWait = submitCompute();
+  auto recordStart = std::chrono::steady_clock::now();
+  vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+  uint64_t uploadWait = recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+  submitFrame(uploadWait, computeWait, VK_NULL_HANDLE, VK_NULL_HANDLE);
+  lastRecordSubmitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - recordStart).count();
+
+  currentFrame = (currentFrame + 1) % framesInFlight;
+}
+
+VkCommandBuffer beginSingleTimeCommands()
+{
+  VkCommandBufferAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandPool = commandPool;
+  allocInfo.commandBufferCount = 1;
+
+  VkCommandBuffer commandBuffer;
+  if (vkAllocateCommandBuffers(Device, &allocInfo, &commandBuffer) != VK_SUCCESS)
+    throw std::runtime_error("failed to allocate command buffer.");
+
+  VkCommandBufferBeginInfo beginInfo{};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+  return commandBuffer;
+}
+
+void endSingleTimeCommands(VkCommandBuffer commandBuffer)
+{
+  vkEndCommandBuffer(commandBuffer);
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &commandBuffer;
+
+  vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+  vkQueueWaitIdle(graphicsQueue);
+
+  vkFreeCommandBuffers(Device, commandPool, 1, &commandBuffer);
+}
+
+void writeImageToDisk(VkImage image, const std::string& path)
+{
+  // Copy the image into a host visible buffer and dump it as a binary PPM
+  const VkDeviceSize imageSize = (VkDeviceSize) swapChainExtent.width * swapChainExtent.height * 4;
+
+  // Host visible memory stays mapped, cached memory is a lot faster to read from the CPU
+  VkBuffer stagingBuffer;
+  DeviceAllocation stagingMemory;
+  memoryAllocator.createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                               stagingBuffer, stagingMemory, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+
+  VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+  // The render pass left the image in TRANSFER_SRC_OPTIMAL, we only need the color writes to be visible
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+  VkBufferImageCopy region{};
+  region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.imageExtent = {swapChainExtent.width, swapChainExtent.height, 1};
+  vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, stagingBuffer, 1, &region);
+
+  VkBufferMemoryBarrier hostBarrier{};
+  hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  hostBarrier.buffer = stagingBuffer;
+  hostBarrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                       0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+
+  endSingleTimeCommands(commandBuffer);
+
+  const void* data = stagingMemory.mapped;
+  std::ofstream file(path, std::ios::binary);
+  if (file.is_open())
+  {
+    file << "P6\n" << swapChainExtent.width << " " << swapChainExtent.height << "\n255\n";
+    const uint8_t* pixels = static_cast<const uint8_t*>(data);
+    for (uint32_t i = 0; i < swapChainExtent.width * swapChainExtent.height; ++i)
+      file.write(reinterpret_cast<const char*>(pixels + i * 4), 3); // Drop alpha, the format is RGBA
+    std::cout << "Wrote " << path << std::endl;
+  }else{
+    std::cerr << "failed to open " << path << " for writing" << std::endl;
+  }
+
+  memoryAllocator.destroyBuffer(stagingBuffer, stagingMemory);
+}
+
+// Keeps track of how many frames we push through per second so different frames in flight
+// counts can be compared on the same machine.
+struct FrameStats
+{
+  using clock = std::chrono::steady_clock;
+  clock::time_point start;
+  clock::time_point lastReport;
+  uint64_t totalFrames = 0;
+  uint64_t framesSinceReport = 0;
+  size_t latenciesReported = 0;
+  uint64_t hostAllocationsReported = 0; // hostAllocator's total count at the last report
+};
+
+// Input to present latency of the presents since index first, only measurable with present wait
+void printInputLatency(std::ostream& out, size_t first = 0)
+{
+  if (!presentWaitEnabled)
+  {
+    out << "input to present latency n/a (no VK_KHR_present_wait)";
+    return;
+  }
+  if (first >= inputLatencies.size())
+  {
+    out << "input to present latency n/a (nothing presented yet)";
+    return;
+  }
+
+  std::vector<double> latencies(inputLatencies.begin() + first, inputLatencies.end());
+  std::sort(latencies.begin(), latencies.end());
+  double sum = 0;
+  for (double latency : latencies)
+    sum += latency;
+  out << std::fixed << std::setprecision(2) << "input to present latency avg " << sum / latencies.size()
+      << " ms, p99 " << latencies[std::min(latencies.size() - 1, (size_t) (0.99 * latencies.size()))] << " ms"
+      << std::defaultfloat;
+}
+
+std::string pacingDescription()
+{
+  if (headless)
+    return "headless";
+  return std::string(presentModeName(swapChainPresentMode)) + ", " + std::to_string(swapChainImages.size()) + " images" +
+         (lowLatency ? ", low latency" : "");
+}
+
+void reportFrameStats(FrameStats& stats, bool final)
+{
+  auto now = FrameStats::clock::now();
+  if (final)
+  {
+    double seconds = std::chrono::duration<double>(now - stats.start).count();
+    if (stats.totalFrames && seconds > 0)
+    {
+      std::cout << "Sustained throughput with " << framesInFlight << " frame(s) in flight (" << pacingDescription() << "): "
+                << stats.totalFrames / seconds << " fps, "
+                << 1000.0 * seconds / stats.totalFrames << " ms/frame ("
+                << stats.totalFrames << " frames in " << seconds << " s)";
+      if (!headless)
+      {
+        std::cout << ", ";
+        printInputLatency(std::cout);
+      }
+      std::cout << std::endl;
+    }
+    if (stats.totalFrames)
+      std::cout << "Frame sync: " << static_cast<double>(frameSyncCalls) / stats.totalFrames
+                << " calls per frame on the frame timeline" << std::endl;
+    frameRing.printStats(std::cout);
+    printAttachmentReport(std::cout);
+    if (computeLoad)
+      asyncCompute.printStats(std::cout);
+    hostAllocator.printStats(std::cout, startupHostAllocations, stats.totalFrames);
+    PROFILE_PRINT_STATS(std::cout);
+    return;
+  }
+
+  double seconds = std::chrono::duration<double>(now - stats.lastReport).count();
+  if (seconds < 1.0)
+    return;
+
+  const FrameRing::Stats& ringStats = frameRing.getStats();
+  uint64_t hostAllocations = hostAllocator.snapshot().total.allocations;
+  std::cout << "[" << framesInFlight << " in flight] "
+            << stats.framesSinceReport / seconds << " fps, "
+            << 1000.0 * seconds / stats.framesSinceReport << " ms/frame, "
+            << (ringStats.frames ? ringStats.bytes / ringStats.frames : 0) << " B/frame of frame data, "
+            << static_cast<double>(hostAllocations - stats.hostAllocationsReported) / stats.framesSinceReport
+            << " host allocations/frame";
+  if (presentWaitEnabled)
+  {
+    std::cout << ", ";
+    printInputLatency(std::cout, stats.latenciesReported);
+  }
+  if (gpuCulling)
+    std::cout << ", drawn " << lastCullStats.drawn << " culled " << lastCullStats.frustumCulled << " frustum / "
+              << lastCullStats.occlusionCulled << " occlusion";
+  std::cout << std::endl;
+  PROFILE_PRINT_STATS(std::cout);
+  stats.lastReport = now;
+  stats.framesSinceReport = 0;
+  stats.latenciesReported = inputLatencies.size();
+  stats.hostAllocationsReported = hostAllocations;
+}
+
+bool shouldExit(const FrameStats& stats)
+{
+  if (frameLimit && stats.totalFrames >= frameLimit)
+    return true;
+  return !headless && glfwWindowShouldClose(window);
+}
+
+void renderFrame()
+{
+  // drawFrame polls the window events itself, as late as it can (see sampleInput)
+  if (headless)
+    drawFrameHeadless();
+  else
+    drawFrame();
+}
+
+void mainLoop()
+{
+  FrameStats stats{};
+  stats.start = stats.lastReport = FrameStats::clock::now();
+  stats.hostAllocationsReported = startupHostAllocations.total.allocations;
+
+  while (!shouldExit(stats))
+  {
+    renderFrame();
+
+    if (stats.totalFrames == 0)
+      std::cout << "Time to first frame: "
+                << std::chrono::duration<double, std::milli>(FrameStats::clock::now() - programStart).count()
+                << " ms (" << (initThreads ? "parallel" : "serial") << " init)" << std::endl;
+
+    stats.totalFrames++;
+    stats.framesSinceReport++;
+    reportFrameStats(stats, false);
+  }
+
+  // Operations in drawFrame are asynchronous, wait for them before we start destroying things.
+  vkDeviceWaitIdle(Device);
+  reportFrameStats(stats, true);
+
+  if (headless && !readbackPath.empty() && stats.totalFrames)
+  {
+    uint32_t lastImage = (currentFrame + framesInFlight - 1) % framesInFlight;
+    writeImageToDisk(swapChainImages[lastImage], readbackPath);
+  }
+}
+
+// CPU time of every frame in ms. beforeFrame runs ahead of each frame and counts towards it.
+std::vector<double> timeFrames(uint64_t frames, const std::function<void()>& beforeFrame = {})
+{
+  std::vector<double> times;
+  times.reserve(frames);
+  for (uint64_t i = 0; i < frames; ++i)
+  {
+    auto start = std::chrono::steady_clock::now();
+    if (beforeFrame)
+      beforeFrame();
+    renderFrame();
+    times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  return times;
+}
+
+void printFrameTimes(const char* label, std::vector<double> times)
+{
+  if (times.empty())
+    return;
+
+  std::sort(times.begin(), times.end());
+  double sum = 0;
+  for (double t : times)
+    sum += t;
+  auto percentile = [&](double p) { return times[std::min(times.size() - 1, (size_t) (p * times.size()))]; };
+
+  std::cout << "  " << std::left << std::setw(28) << label << std::right << std::fixed << std::setprecision(3)
+            << " avg " << sum / times.size() << " ms, p50 " << percentile(0.5) << " ms, p99 " << percentile(0.99)
+            << " ms, max " << times.back() << " ms" << std::defaultfloat << std::endl;
+}
+
+// Churns through randomly sized buffers twice, once through memoryAllocator and once with a
+// vkAllocateMemory per buffer: create all of them, destroy every other one, create those again
+// (now into a fragmented heap) and destroy everything.
+void benchmarkAllocator()
+{
+  using clock = std::chrono::steady_clock;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+  // The driver limit applies to the baseline, leave some room for what the program already allocated
+  uint64_t count = benchCount;
+  uint64_t allocationLimit = properties.limits.maxMemoryAllocationCount > 256 ? properties.limits.maxMemoryAllocationCount - 256 : 0;
+  if (count > allocationLimit)
+  {
+    std::cout << "Capping --bench-count at " << allocationLimit << " (maxMemoryAllocationCount "
+              << properties.limits.maxMemoryAllocationCount << ")" << std::endl;
+    count = allocationLimit;
+  }
+
+  // 256 B to 2 MB, evenly spread on a log scale like real meshes and uniform buffers tend to be
+  std::mt19937 rng(1234);
+  std::uniform_int_distribution<int> exponent(8, 20);
+  std::vector<VkDeviceSize> sizes(count);
+  for (auto& size : sizes)
+  {
+    size = 1ull << exponent(rng);
+    size += rng() % size;
+  }
+
+  std::vector<VkBuffer> buffers(count);
+  std::vector<DeviceAllocation> allocations(count);
+  std::vector<VkDeviceMemory> memories(count);
+  const VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+  auto subCreate = [&](uint64_t i) {
+    memoryAllocator.createBuffer(sizes[i], usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffers[i], allocations[i]);
+  };
+  auto subDestroy = [&](uint64_t i) {
+    memoryAllocator.destroyBuffer(buffers[i], allocations[i]);
+  };
+  auto directCreate = [&](uint64_t i) {
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = sizes[i];
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(Device, &bufferInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_BUFFER), &buffers[i]) != VK_SUCCESS)
+      throw std::runtime_error("failed to create buffer.");
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(Device, buffers[i], &memRequirements);
+
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = memRequirements.size;
+    allocInfo.memoryTypeIndex = memoryAllocator.findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    if (vkAllocateMemory(Device, &allocInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_DEVICE_MEMORY), &memories[i]) != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate buffer memory.");
+    vkBindBufferMemory(Device, buffers[i], memories[i], 0);
+  };
+  auto directDestroy = [&](uint64_t i) {
+    vkDestroyBuffer(Device, buffers[i], hostAllocator.callbacks(VK_OBJECT_TYPE_BUFFER));
+    vkFreeMemory(Device, memories[i], hostAllocator.callbacks(VK_OBJECT_TYPE_DEVICE_MEMORY));
+  };
+
+  auto churn = [&](const char* name, auto create, auto destroy, bool printStats) {
+    auto phase = [&](uint64_t first, uint64_t step, auto f) {
+      auto start = clock::now();
+      uint64_t n = 0;
+      for (uint64_t i = first; i < count; i += step, ++n)
+        f(i);
+      double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+      return std::make_pair(ms, n);
+    };
+    auto report = [](const char* phaseName, std::pair<double, uint64_t> result) {
+      std::cout << "    " << std::left << std::setw(12) << phaseName << std::right << std::fixed << std::setprecision(2)
+                << std::setw(10) << result.first << " ms" << std::setw(10)
+                << (result.second ? 1000.0 * result.first / result.second : 0.0) << " us/buffer" << std::defaultfloat << "\n";
+    };
+
+    std::cout << "  " << name << "\n";
+    report("create", phase(0, 1, create));
+    report("free half", phase(1, 2, destroy));
+    if (printStats)
+    {
+      auto stats = memoryAllocator.stats();
+      std::cout << "    fragmentation after freeing half: " << 100.0 * stats.fragmentation() << "% ("
+                << stats.largestFreeBlock / 1048576.0 << " MiB largest of " << stats.freeBytes / 1048576.0 << " MiB free)\n";
+    }
+    report("recreate", phase(1, 2, create));
+    if (printStats)
+      memoryAllocator.printStats(std::cout);
+    report("free all", phase(0, 1, destroy));
+  };
+
+  std::cout << "Allocator benchmark, " << count << " buffers" << std::endl;
+  churn("sub-allocated", subCreate, subDestroy, true);
+  churn("vkAllocateMemory per buffer", directCreate, directDestroy, false);
+}
+
+// Renders the same number of frames with and without streaming --bench-count KiB per frame
+// through the upload engine. Best run with --headless, otherwise vsync hides the frame cost.
+void benchmarkUploads()
+{
+  using clock = std::chrono::steady_clock;
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const VkDeviceSize bytesPerFrame = benchCount * 1024;
+  const VkDeviceSize targetSize = std::max<VkDeviceSize>(bytesPerFrame, 64ull << 20);
+
+  VkBuffer target;
+  DeviceAllocation targetMemory;
+  memoryAllocator.createBuffer(targetSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, target, targetMemory);
+
+  std::vector<uint8_t> source(bytesPerFrame);
+  for (size_t i = 0; i < source.size(); ++i)
+    source[i] = static_cast<uint8_t>(i * 31);
+
+  std::cout << "Upload benchmark, " << bytesPerFrame / 1048576.0 << " MiB per frame, " << frames << " frames, "
+            << (uploadEngine.hasDedicatedQueue() ? "dedicated transfer queue" : "no dedicated transfer queue") << std::endl;
+
+  auto idle = timeFrames(frames);
+
+  VkDeviceSize cursor = 0;
+  auto start = clock::now();
+  auto uploading = timeFrames(frames, [&]{
+    if (cursor + bytesPerFrame > targetSize)
+      cursor = 0;
+    uploadEngine.uploadBuffer(target, cursor, source.data(), bytesPerFrame);
+    uploadEngine.flush();
+    cursor += bytesPerFrame;
+  });
+  uploadEngine.wait(uploadEngine.flush());
+  double seconds = std::chrono::duration<double>(clock::now() - start).count();
+  vkDeviceWaitIdle(Device);
+
+  printFrameTimes("frames without uploads", idle);
+  printFrameTimes("frames while uploading", uploading);
+  std::cout << "  upload throughput " << frames * bytesPerFrame / seconds / 1e6 << " MB/s" << std::endl;
+  uploadEngine.printStats(std::cout);
+
+  memoryAllocator.destroyBuffer(target, targetMemory);
+}
+
+// Records a --bench-count draw scene split over 1, 2, 4, ... jobs up to --record-threads and
+// reports how recording time scales. Each job runs on its own thread with its own command pool.
+void benchmarkRecording()
+{
+  if (recordThreads == 0)
+    throw std::runtime_error("--bench record needs --record-threads above 0.");
+
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  sceneDrawCount = static_cast<uint32_t>(benchCount);
+
+  std::vector<uint32_t> jobCounts;
+  for (uint32_t jobs = 1; jobs < recordThreads; jobs *= 2)
+    jobCounts.push_back(jobs);
+  jobCounts.push_back(recordThreads);
+
+  std::cout << "Recording benchmark, " << sceneDrawCount << " draws, " << frames << " frames per thread count" << std::endl;
+  double singleThreadMs = 0;
+  for (uint32_t jobs : jobCounts)
+  {
+    recorder.setMaxJobs(jobs);
+    double totalMs = 0;
+    for (uint64_t i = 0; i < frames; ++i)
+    {
+      renderFrame();
+      totalMs += recorder.lastRecordMs;
+    }
+    double averageMs = totalMs / frames;
+    if (jobs == 1)
+      singleThreadMs = averageMs;
+
+    double speedup = averageMs > 0 ? singleThreadMs / averageMs : 0;
+    std::cout << "  " << std::setw(3) << jobs << " thread(s): " << std::fixed << std::setprecision(3)
+              << averageMs << " ms recording, " << std::setprecision(2) << speedup << "x speedup, "
+              << 100.0 * speedup / jobs << "% efficiency" << std::defaultfloat << std::endl;
+  }
+  vkDeviceWaitIdle(Device);
+  recorder.setMaxJobs(recordThreads);
+}
+
+// Resizes the window every frame and compares the frame times against the same number of
+// frames at a fixed size. The worst frame is what a user would notice while dragging the window.
+void benchmarkResize()
+{
+  if (headless)
+    throw std::runtime_error("--bench resize needs a window.");
+
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  std::cout << "Resize benchmark, " << frames << " frames" << std::endl;
+
+  auto steady = timeFrames(frames);
+
+  uint64_t recreationsBefore = swapChainRecreations;
+  uint64_t frame = 0;
+  auto resizing = timeFrames(frames, [&]{
+    int step = static_cast<int>(frame++ % 16);
+    glfwSetWindowSize(window, WIDTH - 200 + step * 25, HEIGHT - 150 + step * 20);
+  });
+  glfwSetWindowSize(window, WIDTH, HEIGHT);
+  vkDeviceWaitIdle(Device);
+
+  printFrameTimes("fixed size", steady);
+  printFrameTimes("resize storm", resizing);
+  std::cout << "  " << swapChainRecreations - recreationsBefore << " swap chain recreations, "
+            << retiredSwapChains.size() << " still waiting for retirement" << std::endl;
+}
+
+// Runs the scene in every supported present mode, with and without low latency pacing, and
+// prints throughput next to the input to present latency.
+void benchmarkLatency()
+{
+  if (headless)
+    throw std::runtime_error("--bench latency needs a window.");
+
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const auto originalMode = requestedPresentMode;
+  const bool originalLowLatency = lowLatency;
+  SwapCahinSupportDetails support = querySwapChainSupportDetails(physicalDevice);
+
+  std::cout << "Latency benchmark, " << frames << " frames per mode"
+            << (presentWaitEnabled ? "" : ", no VK_KHR_present_wait so latency can't be measured") << std::endl;
+  for (VkPresentModeKHR mode : {VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+                                VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR})
+  {
+    if (std::find(support.presentModes.begin(), support.presentModes.end(), mode) == support.presentModes.end())
+      continue;
+
+    for (bool pacing : {false, true})
+    {
+      requestedPresentMode = mode;
+      lowLatency = pacing;
+      recreateSwapChain();
+      timeFrames(10); // Let the new swap chain settle
+
+      collectPresentLatencies();
+      inputLatencies.clear();
+      auto start = std::chrono::steady_clock::now();
+      timeFrames(frames);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (presentWaitEnabled && lastPresentSwapChain == swapChain)
+        pfnWaitForPresentKHR(Device, swapChain, lastPresentId, UINT64_MAX);
+      collectPresentLatencies();
+
+      std::cout << "  " << std::left << std::setw(36) << pacingDescription() << std::right
+                << std::fixed << std::setprecision(1) << std::setw(8) << frames / seconds << " fps, " << std::defaultfloat;
+      printInputLatency(std::cout);
+      std::cout << std::endl;
+    }
+  }
+
+  requestedPresentMode = originalMode;
+  lowLatency = originalLowLatency;
+  recreateSwapChain();
+  vkDeviceWaitIdle(Device);
+}
+
+// Draws 1, 10, 100, ... up to a million instances with a single draw and
+// reports what the CPU pays to record and submit them next to the GPU time per instance. The CPU side
+// should stay flat, that is the point of instancing. GPU times need a build with ENABLE_PROFILER.
+void benchmarkInstances()
+{
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const uint64_t maxInstances = 1000000;
+  const uint32_t originalInstances = instanceCount;
+  const uint32_t originalDraws = sceneDrawCount;
+  sceneDrawCount = 1;
+
+  std::cout << "Instancing benchmark, " << frames << " frames per instance count" << std::endl;
+  double baseCpuMs = 0, baseGpuMs = 0;
+  for (uint64_t count = 1; count <= maxInstances; count *= 10)
+  {
+    vkDeviceWaitIdle(Device);
+    destroyInstanceBuffer();
+    instanceCount = static_cast<uint32_t>(count);
+    createInstanceBuffer();
+    timeFrames(10); // Picks up the upload and fills the frames in flight
+
+    PROFILE_RESET_STATS();
+    double cpuMs = 0;
+    for (uint64_t i = 0; i < frames; ++i)
+    {
+      renderFrame();
+      cpuMs += lastRecordSubmitMs;
+    }
+    vkDeviceWaitIdle(Device);
+    timeFrames(framesInFlight); // The profiler reads GPU timestamps back when a frame slot comes around again
+    cpuMs /= frames;
+    double gpuMs = PROFILE_GPU_FRAME_MS();
+    if (count == 1)
+    {
+      baseCpuMs = cpuMs;
+      baseGpuMs = gpuMs;
+    }
+
+    std::cout << "  " << std::setw(8) << count << " instances: " << std::fixed << std::setprecision(3)
+              << cpuMs << " ms record+submit";
+    if (gpuMs > 0)
+      std::cout << ", " << gpuMs << " ms gpu, " << std::setprecision(2) << gpuMs * 1e6 / count << " ns/instance";
+    if (gpuMs > 0 && count > 1)
+      std::cout << " (" << (gpuMs - baseGpuMs) * 1e6 / (count - 1) << " ns marginal)";
+    if (count > 1)
+      std::cout << ", cpu +" << std::setprecision(3) << (cpuMs - baseCpuMs) * 1e3 << " us over 1 instance";
+    std::cout << std::defaultfloat << std::endl;
+  }
+
+  vkDeviceWaitIdle(Device);
+  destroyInstanceBuffer();
+  instanceCount = originalInstances;
+  sceneDrawCount = originalDraws;
+  createInstanceBuffer();
+}
+
+// Grows the object count from a thousand to a million and culls it on the GPU, once with the whole
+// scene in view and once zoomed in so most of it is outside. The CPU frame time should not move with
+// either the total or the visible count, only the GPU time does.
+void benchmarkCulling()
+{
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const uint32_t originalInstances = instanceCount;
+  const float originalZoom = cameraZoom;
+
+  std::cout << "Culling benchmark, " << frames << " frames per object count" << std::endl;
+  for (uint32_t count = 1000; count <= 1000000; count *= 10)
+  {
+    vkDeviceWaitIdle(Device);
+    destroyInstanceBuffer();
+    instanceCount = count;
+    createInstanceBuffer();
+
+    for (float zoom : {1.0f, 4.0f})
+    {
+      cameraZoom = zoom;
+      timeFrames(10);
+
+      PROFILE_RESET_STATS();
+      double frameMs = 0, recordMs = 0;
+      for (uint64_t i = 0; i < frames; ++i)
+      {
+        auto start = std::chrono::steady_clock::now();
+        renderFrame();
+        frameMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        recordMs += lastRecordSubmitMs;
+      }
+      timeFrames(framesInFlight); // Collects the GPU timestamps of the measured frames
+      vkDeviceWaitIdle(Device);
+      uint32_t visible = culler.getStats((currentFrame + framesInFlight - 1) % framesInFlight).drawn;
+
+      double gpuMs = PROFILE_GPU_FRAME_MS();
+      std::cout << "  " << std::setw(8) << visible << " / " << std::setw(7) << count << " visible (zoom "
+                << zoom << "): " << std::fixed << std::setprecision(3) << frameMs / frames << " ms cpu frame, "
+                << recordMs / frames << " ms record+submit";
+      if (gpuMs > 0)
+        std::cout << ", " << gpuMs << " ms gpu";
+      std::cout << std::defaultfloat << std::endl;
+    }
+  }
+
+  vkDeviceWaitIdle(Device);
+  destroyInstanceBuffer();
+  instanceCount = originalInstances;
+  cameraZoom = originalZoom;
+  createInstanceBuffer();
+}
+
+// Renders a --bench-count object scene stacked in 8 layers, where only the front layer can be
+// seen, with and without the occlusion test. Frustum culling is on in both runs.
+void benchmarkOcclusion()
+{
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const uint32_t originalInstances = instanceCount;
+  const uint32_t originalLayers = sceneLayers;
+  const bool originalOcclusion = occlusionCulling;
+
+  vkDeviceWaitIdle(Device);
+  destroyInstanceBuffer();
+  instanceCount = static_cast<uint32_t>(std::max<uint64_t>(1, benchCount));
+  sceneLayers = 8;
+  createInstanceBuffer();
+
+  std::cout << "Occlusion benchmark, " << instanceCount << " objects in " << sceneLayers << " layers, "
+            << frames << " frames each" << std::endl;
+  for (bool occlusion : {false, true})
+  {
+    occlusionCulling = occlusion;
+    timeFrames(10); // The pyramid of the first frame is built from nothing
+
+    PROFILE_RESET_STATS();
+    auto times = timeFrames(frames);
+    timeFrames(framesInFlight);
+    vkDeviceWaitIdle(Device);
+    GpuCuller::Stats stats = culler.getStats((currentFrame + framesInFlight - 1) % framesInFlight);
+
+    printFrameTimes(occlusion ? "frustum + occlusion" : "frustum only", times);
+    std::cout << "    drawn " << stats.drawn << ", frustum culled " << stats.frustumCulled
+              << ", occlusion culled " << stats.occlusionCulled;
+    double gpuMs = PROFILE_GPU_FRAME_MS();
+    if (gpuMs > 0)
+      std::cout << ", " << std::fixed << std::setprecision(3) << gpuMs << " ms gpu" << std::defaultfloat;
+    std::cout << std::endl;
+  }
+
+  vkDeviceWaitIdle(Device);
+  destroyInstanceBuffer();
+  instanceCount = originalInstances;
+  sceneLayers = originalLayers;
+  occlusionCulling = originalOcclusion;
+  createInstanceBuffer();
+}
+
+// Reports what the active rendering path costs: the render pass and framebuffer objects it keeps
+// per swap chain, how long rebuilding them with the swap chain takes and the CPU time to record a
+// frame. Run it once with and once without --dynamic-rendering to compare the two paths.
+void benchmarkRendering()
+{
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const uint64_t rebuilds = 50;
+  std::cout << "Rendering benchmark, " << (dynamicRendering ? "dynamic rendering" : "render pass") << ", "
+            << frames << " frames, " << rebuilds << (headless ? " render target rebuilds" : " swap chain recreations") << std::endl;
+  std::cout << "  " << (renderPass != VK_NULL_HANDLE) << " render pass(es), " << swapChainFramebuffers.size()
+            << " framebuffer(s) for " << swapChainImages.size() << " images" << std::endl;
+
+  timeFrames(10);
+  std::vector<double> recordTimes;
+  timeFrames(frames, [&]{ recordTimes.push_back(lastRecordSubmitMs); });
+  recordTimes.erase(recordTimes.begin()); // Recorded by the warm up
+  printFrameTimes("record + submit", recordTimes);
+
+  // Headless there is no swap chain, only the part that differs between the paths is rebuilt:
+  // the image views and the framebuffers on top of them.
+  std::vector<double> rebuildTimes;
+  for (uint64_t i = 0; i < rebuilds; ++i)
+  {
+    if (headless)
+    {
+      vkDeviceWaitIdle(Device);
+      for (auto framebuffer : swapChainFramebuffers)
+        vkDestroyFramebuffer(Device, framebuffer, hostAllocator.callbacks(VK_OBJECT_TYPE_FRAMEBUFFER));
+      for (auto imageView : swapChainImageViews)
+        vkDestroyImageView(Device, imageView, hostAllocator.callbacks(VK_OBJECT_TYPE_IMAGE_VIEW));
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (headless)
+    {
+      createImageViews();
+      createFrameBuffers();
+    }else{
+      recreateSwapChain();
+    }
+    rebuildTimes.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    timeFrames(1);
+  }
+  vkDeviceWaitIdle(Device);
+  printFrameTimes(headless ? "render target rebuild" : "swap chain recreation", rebuildTimes);
+}
+
+// Asks for --bench-count pipelines picked at random from material permutations of the scene
+// pipeline: once building every miss on the spot, once with all permutations prefetched on the
+// build threads first. The slowest get() is the hitch a frame would see. Both passes start with
+// an empty factory but a driver cache that has seen every permutation, so only the factory differs.
+void benchmarkPipelines()
+{
+  using clock = std::chrono::steady_clock;
+  std::vector<PipelineKey> variants;
+  for (BlendMode blend : {BlendMode::Opaque, BlendMode::Alpha, BlendMode::Additive})
+    for (VkCullModeFlags cullMode : {VK_CULL_MODE_NONE, VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_FRONT_BIT})
+      for (VkFrontFace frontFace : {VK_FRONT_FACE_CLOCKWISE, VK_FRONT_FACE_COUNTER_CLOCKWISE})
+        for (VkCompareOp compare : {VK_COMPARE_OP_LESS, VK_COMPARE_OP_LESS_OR_EQUAL})
+          for (bool depthWrite : {true, false})
+          {
+            PipelineKey key = scenePipelineKey;
+            key.blend = blend;
+            key.cullMode = cullMode;
+            key.frontFace = frontFace;
+            key.depthCompare = compare;
+            key.depthWrite = depthWrite;
+            variants.push_back(key);
+          }
+
+  std::mt19937 random(1234);
+  std::uniform_int_distribution<size_t> pick(0, variants.size() - 1);
+  std::vector<size_t> requests(benchCount);
+  for (auto& request : requests)
+    request = pick(random);
+
+  std::cout << "Pipeline benchmark, " << requests.size() << " requests for " << variants.size() << " variants, LRU of "
+            << pipelineCapacity << ", " << pipelineBuildThreads << " build thread(s)" << std::endl;
+
+  vkDeviceWaitIdle(Device);
+  pipelineFactory.clear();
+  for (const auto& key : variants)
+    pipelineFactory.get(key);
+
+  for (bool prefetch : {false, true})
+  {
+    vkDeviceWaitIdle(Device);
+    pipelineFactory.clear();
+    auto start = clock::now();
+    if (prefetch)
+    {
+      for (const auto& key : variants)
+        pipelineFactory.prefetch(key);
+    }
+    std::vector<double> times;
+    times.reserve(requests.size());
+    for (size_t request : requests)
+    {
+      auto requestStart = clock::now();
+      pipelineFactory.get(variants[request]);
+      times.push_back(std::chrono::duration<double, std::milli>(clock::now() - requestStart).count());
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+    printFrameTimes(prefetch ? "prefetched" : "built on demand", times);
+    std::cout << "    " << totalMs << " ms in total, ";
+    pipelineFactory.printStats(std::cout);
+  }
+  vkDeviceWaitIdle(Device);
+}
+
+// Draws --bench-count triangles with a material each. Once bindless, the tables bound once per
+// command buffer and the material picked by push constant, and once binding a descriptor set
+// per draw the way a renderer without descriptor indexing would.
+void benchmarkBindless()
+{
+  if (gpuCulling)
+    throw std::runtime_error("--bench bindless records its draws on the CPU, it can't be combined with --gpu-cull.");
+
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const uint32_t originalDraws = sceneDrawCount;
+  const uint32_t originalMaterials = materialCount;
+  vkDeviceWaitIdle(Device);
+  destroyMaterials();
+  sceneDrawCount = materialCount = static_cast<uint32_t>(benchCount);
+  createMaterials();
+
+  // The baseline sets use the table layout with a single descriptor
+  VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, materialCount};
+  VkDescriptorPoolCreateInfo poolInfo{};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+  poolInfo.maxSets = materialCount;
+  poolInfo.poolSizeCount = 1;
+  poolInfo.pPoolSizes = &poolSize;
+  VkDescriptorPool perDrawPool;
+  if (vkCreateDescriptorPool(Device, &poolInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL), &perDrawPool) != VK_SUCCESS)
+    throw std::runtime_error("failed to create descriptor pool.");
+  for (uint32_t i = 0; i < materialCount; ++i)
+  {
+    perDrawMaterialSets.push_back(bindless.allocateSet(perDrawPool, BindlessHeap::BUFFERS, 1));
+    bindless.writeBuffer(perDrawMaterialSets.back(), 0, materialBuffers[i], 0, VK_WHOLE_SIZE);
+  }
+
+  std::cout << "Bindless benchmark, " << sceneDrawCount << " draws with a material each, " << frames << " frames, "
+            << bindless.getUsed(BindlessHeap::BUFFERS) << "/" << bindless.getCapacity(BindlessHeap::BUFFERS)
+            << " buffer slots in use" << std::endl;
+  for (bool perDraw : {false, true})
+  {
+    bindPerDraw = perDraw;
+    timeFrames(10);
+    descriptorBinds = 0;
+    std::vector<double> recordTimes;
+    timeFrames(frames, [&]{ recordTimes.push_back(lastRecordSubmitMs); });
+    recordTimes.erase(recordTimes.begin()); // Recorded by the warm up
+    printFrameTimes(perDraw ? "bind per draw" : "bindless", recordTimes);
+    std::cout << "    " << static_cast<double>(descriptorBinds) / frames << " descriptor set binds per frame, "
+              << static_cast<double>(descriptorBinds) / frames / sceneDrawCount << " per draw" << std::endl;
+  }
+  bindPerDraw = false;
+
+  vkDeviceWaitIdle(Device);
+  perDrawMaterialSets.clear();
+  vkDestroyDescriptorPool(Device, perDrawPool, hostAllocator.callbacks(VK_OBJECT_TYPE_DESCRIPTOR_POOL));
+  destroyMaterials();
+  sceneDrawCount = originalDraws;
+  materialCount = originalMaterials;
+  createMaterials();
+}
+
+// Composes the world matrices of --bench-count instances and tests their bounding spheres against
+// a perspective frustum, first with a glm::mat4 per object and then with the SoA kernels at every
+// instruction set the CPU has, on 1, 2, 4, ... threads up to --simd-threads.
+void benchmarkSimd()
+{
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const size_t count = static_cast<size_t>(std::max<uint64_t>(1, benchCount));
+
+  // A field of instances around the origin, seen from above at an angle so part of it is in view
+  InstanceSoA soa;
+  soa.resize(count);
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> position(-500.0f, 500.0f), scale(0.5f, 4.0f);
+  for (size_t i = 0; i < count; ++i)
+  {
+    soa.x[i] = position(random);
+    soa.y[i] = 0.05f * position(random);
+    soa.z[i] = position(random);
+    soa.scaleX[i] = scale(random);
+    soa.scaleY[i] = scale(random);
+    soa.scaleZ[i] = scale(random);
+    soa.radius[i] = 0.8f;
+  }
+  glm::mat4 parent = glm::rotate(glm::translate(glm::mat4(1.0f), glm::vec3(10.0f, 0.0f, -20.0f)), 0.3f, glm::vec3(0.0f, 1.0f, 0.0f));
+  glm::mat4 viewProjection = glm::perspectiveRH_ZO(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 1000.0f) *
+                             glm::lookAt(glm::vec3(0.0f, 150.0f, -300.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+  float parentScale = std::max({glm::length(glm::vec3(parent[0])), glm::length(glm::vec3(parent[1])), glm::length(glm::vec3(parent[2]))});
+
+  std::cout << "SIMD benchmark, " << count << " instances, " << frames << " frames, CPU supports "
+            << simdLevelName(detectSimdLevel()) << std::endl;
+
+  auto time = [&](const char* label, const std::function<size_t()>& frame) {
+    std::vector<double> times;
+    size_t visible = 0;
+    for (uint64_t i = 0; i < frames; ++i)
+    {
+      auto start = std::chrono::steady_clock::now();
+      visible = frame();
+      times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    printFrameTimes(label, times);
+    return visible;
+  };
+
+  // The baseline: one glm::mat4 per object, planes as in cull.comp
+  std::vector<glm::mat4> glmTransforms(count);
+  std::vector<uint8_t> glmVisible(count);
+  glm::mat4 rows = glm::transpose(viewProjection);
+  glm::vec4 planes[6] = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[2], rows[3] - rows[2]};
+  for (auto& plane : planes)
+    plane /= glm::length(glm::vec3(plane));
+  size_t glmCount = time("glm::mat4 per object", [&]{
+    size_t visible = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+      glm::vec3 scale(soa.scaleX[i], soa.scaleY[i], soa.scaleZ[i]);
+      glmTransforms[i] = parent * glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(soa.x[i], soa.y[i], soa.z[i])), scale);
+      glm::vec3 center(glmTransforms[i][3]);
+      float radius = soa.radius[i] * std::max({scale.x, scale.y, scale.z}) * parentScale;
+      bool inside = true;
+      for (const auto& plane : planes)
+        inside &= glm::dot(glm::vec3(plane), center) + plane.w >= -radius;
+      glmVisible[i] = inside;
+      visible += inside;
+    }
+    return visible;
+  });
+  std::cout << "    " << glmCount << " visible" << std::endl;
+
+  std::vector<uint32_t> jobCounts;
+  for (uint32_t jobs = 1; jobs < instanceKernels.getThreadCount(); jobs *= 2)
+    jobCounts.push_back(jobs);
+  jobCounts.push_back(std::max(1u, instanceKernels.getThreadCount()));
+
+  FrustumPlanes frustum = extractFrustumPlanes(&viewProjection[0][0]);
+  std::vector<glm::mat4> transforms(count);
+  std::vector<uint8_t> visible(count);
+  const SimdLevel originalLevel = instanceKernels.getLevel();
+  for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2})
+  {
+    if (level > detectSimdLevel())
+      break;
+    instanceKernels.setLevel(level);
+    for (uint32_t jobs : jobCounts)
+    {
+      instanceKernels.setMaxJobs(jobs);
+      std::string label = std::string(simdLevelName(level)) + " SoA, " + std::to_string(jobs) + " thread(s)";
+      size_t kernelCount = time(label.c_str(), [&]{
+        instanceKernels.composeTransforms(&parent[0][0], soa, &transforms[0][0][0], 16);
+        return instanceKernels.cullSpheres(&parent[0][0], frustum, soa, visible.data());
+      });
+
+      // FMA and the order of the additions round differently, spheres right on a plane may flip
+      float maxError = 0.0f;
+      size_t differences = 0;
+      for (size_t i = 0; i < count; ++i)
+      {
+        for (int c = 0; c < 4; ++c)
+          maxError = std::max(maxError, glm::length(transforms[i][c] - glmTransforms[i][c]));
+        differences += visible[i] != glmVisible[i];
+      }
+      std::cout << "    " << kernelCount << " visible, " << differences << " differ from glm, max matrix error " << maxError << std::endl;
+    }
+  }
+  instanceKernels.setLevel(originalLevel);
+  instanceKernels.setMaxJobs(instanceKernels.getThreadCount());
+}
+
+// Loads every shader the way startup used to, std::ifstream into a std::vector, and mapped through
+// ShaderCode, each once on its own and once followed by vkCreateShaderModule. Built with
+// -DEMBED_SHADERS the embedded arrays are timed as well. The files are in the page cache after
+// the first round, so this is the cost of the copies and calls, not of the disk.
+void benchmarkShaders()
+{
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  std::vector<const char*> paths;
+  size_t totalBytes = 0;
+  for (const ShaderSource* shader : {&vertShader, &fragShader, &cullShader, &pyramidShader, &simulateShader})
+  {
+    if (access(shader->path, R_OK) == 0)
+    {
+      paths.push_back(shader->path);
+      totalBytes += readFile(shader->path).size();
+    }
+  }
+  std::cout << "Shader loading benchmark, " << paths.size() << " shaders, " << totalBytes << " bytes, "
+            << frames << " rounds" << std::endl;
+
+  auto time = [&](const char* label, bool createModule, const std::function<ShaderCode(const char*, std::vector<char>&)>& load) {
+    std::vector<double> times;
+    for (uint64_t i = 0; i < frames; ++i)
+    {
+      auto start = std::chrono::steady_clock::now();
+      for (const char* path : paths)
+      {
+        std::vector<char> storage;
+        ShaderCode code = load(path, storage);
+        if (createModule)
+          vkDestroyShaderModule(Device, createShaderModule(code), hostAllocator.callbacks(VK_OBJECT_TYPE_SHADER_MODULE));
+      }
+      times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    printFrameTimes(label, times);
+  };
+
+  auto readIntoVector = [](const char* path, std::vector<char>& storage) {
+    storage = readFile(path);
+    return ShaderCode::view(reinterpret_cast<const uint32_t*>(storage.data()), storage.size(), path);
+  };
+  auto mapFile = [](const char* path, std::vector<char>&) { return ShaderCode::map(path); };
+  for (bool createModule : {false, true})
+  {
+    time(createModule ? "ifstream + vector, module" : "ifstream + vector", createModule, readIntoVector);
+    time(createModule ? "mmap, module" : "mmap", createModule, mapFile);
+#ifdef EMBED_SHADERS
+    time(createModule ? "embedded, module" : "embedded", createModule, [](const char* path, std::vector<char>&) { return loadShaderCode(path); });
+#endif
+  }
+}
+
+// Frame times of the scene with the --compute-load simulation next to it: without the simulation,
+// overlapped with the rendering on the compute queue, serialized with it on the compute queue, and
+// submitted to the graphics queue. The difference between overlapped and serialized is what the
+// second queue buys, it needs a device with a compute family of its own.
+void benchmarkCompute()
+{
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  std::cout << "Async compute benchmark, " << frames << " frames, " << asyncCompute.getParticleCount() << " particles x "
+            << computeLoad << " iterations per frame, " << (dedicatedComputeQueue ? "separate compute family" : "no separate compute family")
+            << std::endl;
+
+  const uint32_t load = computeLoad;
+  const bool serialize = serializeCompute;
+  auto measure = [&](const char* label, uint32_t iterations, bool serialized, bool singleQueue) {
+    computeLoad = iterations;
+    serializeCompute = serialized;
+    selectComputeQueue(singleQueue);
+    timeFrames(10);
+    auto times = timeFrames(frames);
+    vkDeviceWaitIdle(Device);
+    printFrameTimes(label, times);
+  };
+
+  measure("no compute", 0, false, singleQueueCompute);
+  if (dedicatedComputeQueue)
+  {
+    measure("overlapped", load, false, false);
+    measure("serialized", load, true, false);
+  }
+  measure("graphics queue", load, false, true);
+
+  computeLoad = load;
+  serializeCompute = serialize;
+  selectComputeQueue(singleQueueCompute);
+}
+
+// Everything that depends on the sample count: the render pass, the depth and multisampled color
+// images, the framebuffers and the scene pipeline. The images are shared by all frames, so this waits
+// for the device. Only the MSAA benchmark changes the sample count at runtime.
+void rebuildSceneTargets()
+{
+  vkDeviceWaitIdle(Device);
+  for (auto framebuffer : swapChainFramebuffers)
+    vkDestroyFramebuffer(Device, framebuffer, hostAllocator.callbacks(VK_OBJECT_TYPE_FRAMEBUFFER));
+  vkDestroyRenderPass(Device, renderPass, hostAllocator.callbacks(VK_OBJECT_TYPE_RENDER_PASS));
+  destroyDepthResources();
+
+  msaaSamples = chooseMsaaSamples();
+  createRenderPass();
+  createDepthResources();
+  createFrameBuffers();
+  scenePipelineKey.renderPass = renderPass;
+  scenePipelineKey.samples = msaaSamples;
+}
+
+// Frame times and attachment memory of the scene without MSAA and at 4x and 8x, lowered to what the
+// device supports. The attachment report after each run shows the load and store traffic and, on
+// devices with lazily allocated memory, how much of the multisampled attachments was ever committed.
+void benchmarkMsaa()
+{
+  if (gpuCulling)
+    throw std::runtime_error("--bench msaa can't be combined with --gpu-cull, the depth pyramid needs single sampled depth.");
+
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  std::cout << "MSAA benchmark, " << frames << " frames per sample count, "
+            << (dynamicRendering ? "dynamic rendering" : "render pass") << std::endl;
+
+  const uint32_t requested = requestedMsaaSamples;
+  for (uint32_t samples : {1u, 4u, 8u})
+  {
+    requestedMsaaSamples = samples;
+    rebuildSceneTargets();
+    timeFrames(10); // Builds the pipeline for the new sample count
+    auto times = timeFrames(frames);
+    vkDeviceWaitIdle(Device);
+    printAttachmentReport(std::cout);
+    std::string label = std::to_string(msaaSamples) + "x MSAA";
+    printFrameTimes(label.c_str(), times);
+  }
+  requestedMsaaSamples = requested;
+  rebuildSceneTargets();
+}
+
+// CPU cost of pacing frames, without any rendering: --bench-count empty submits on the graphics
+// queue, framesInFlight deep. Once paced with a fence per frame slot (wait, reset, submit with the
+// fence) and once with one timeline semaphore the way waitForFrame does it (read the counter, wait
+// only if it is behind, signal the frame number).
+void benchmarkSync()
+{
+  const uint64_t frames = std::max<uint64_t>(framesInFlight, benchCount);
+  std::cout << "Frame sync benchmark, " << frames << " empty submits, " << framesInFlight << " frame(s) in flight" << std::endl;
+  vkDeviceWaitIdle(Device);
+
+  using clock = std::chrono::steady_clock;
+  auto report = [&](const char* label, clock::duration total, clock::duration sync, uint64_t calls, size_t objects) {
+    auto perFrame = [&](clock::duration time) { return std::chrono::duration<double, std::nano>(time).count() / frames; };
+    std::cout << "  " << std::left << std::setw(10) << label << std::right << std::fixed << std::setprecision(0)
+              << std::setw(8) << perFrame(total) << " ns/frame, " << std::setw(8) << perFrame(sync) << " ns/frame in sync calls, "
+              << std::setprecision(2) << static_cast<double>(calls) / frames << " calls/frame, " << objects << " object(s)"
+              << std::defaultfloat << std::endl;
+  };
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+  {
+    std::vector<VkFence> fences(framesInFlight);
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    for (auto& fence : fences)
+    {
+      if (vkCreateFence(Device, &fenceInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_FENCE), &fence) != VK_SUCCESS)
+        throw std::runtime_error("failed to create benchmark fence.");
+    }
+
+    clock::duration sync{};
+    uint64_t calls = 0;
+    auto start = clock::now();
+    for (uint64_t i = 0; i < frames; ++i)
+    {
+      VkFence fence = fences[i % framesInFlight];
+      auto syncStart = clock::now();
+      vkWaitForFences(Device, 1, &fence, VK_TRUE, UINT64_MAX);
+      vkResetFences(Device, 1, &fence);
+      sync += clock::now() - syncStart;
+      calls += 2;
+      if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, fence) != VK_SUCCESS)
+        throw std::runtime_error("failed to submit benchmark batch.");
+    }
+    vkQueueWaitIdle(graphicsQueue);
+    report("fences", clock::now() - start, sync, calls, fences.size());
+
+    for (auto fence : fences)
+      vkDestroyFence(Device, fence, hostAllocator.callbacks(VK_OBJECT_TYPE_FENCE));
+  }
+
+  {
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &typeInfo;
+    VkSemaphore timeline;
+    if (vkCreateSemaphore(Device, &semaphoreInfo, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE), &timeline) != VK_SUCCESS)
+      throw std::runtime_error("failed to create benchmark timeline semaphore.");
+
+    uint64_t signalValue = 0;
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &signalValue;
+    VkSubmitInfo timelineSubmit = submitInfo;
+    timelineSubmit.pNext = &timelineInfo;
+    timelineSubmit.signalSemaphoreCount = 1;
+    timelineSubmit.pSignalSemaphores = &timeline;
+
+    clock::duration sync{};
+    uint64_t calls = 0;
+    uint64_t completed = 0;
+    auto start = clock::now();
+    for (uint64_t frame = 1; frame <= frames; ++frame)
+    {
+      uint64_t reuse = frame > framesInFlight ? frame - framesInFlight : 0;
+      auto syncStart = clock::now();
+      if (reuse > completed)
+      {
+        vkGetSemaphoreCounterValue(Device, timeline, &completed);
+        calls++;
+        if (reuse > completed)
+        {
+          VkSemaphoreWaitInfo waitInfo{};
+          waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+          waitInfo.semaphoreCount = 1;
+          waitInfo.pSemaphores = &timeline;
+          waitInfo.pValues = &reuse;
+          if (vkWaitSemaphores(Device, &waitInfo, UINT64_MAX) != VK_SUCCESS)
+            throw std::runtime_error("failed to wait for frame.");
+          calls++;
+          completed = reuse;
+        }
+      }
+      sync += clock::now() - syncStart;
+      signalValue = frame;
+      if (vkQueueSubmit(graphicsQueue, 1, &timelineSubmit, VK_NULL_HANDLE) != VK_SUCCESS)
+        throw std::runtime_error("failed to submit benchmark batch.");
+    }
+    vkQueueWaitIdle(graphicsQueue);
+    report("timeline", clock::now() - start, sync, calls, 1);
+
+    vkDestroySemaphore(Device, timeline, hostAllocator.callbacks(VK_OBJECT_TYPE_SEMAPHORE));
+  }
+}
+
+// Frame times with validation messages coming from the frames: written in the callback, handed to
+// the writer thread, and handed over while repeating a single message ID. The messages are
+// injected with vkSubmitDebugUtilsMessageEXT and take the same path through the layer as its
+// own. --bench-count messages in total, spread over the frames.
+void benchmarkLogging()
+{
+  if (!enableValidationLayers)
+    throw std::runtime_error("--bench logging needs the validation layers (an NDEBUG build).");
+  auto submitMessage = (PFN_vkSubmitDebugUtilsMessageEXT) vkGetInstanceProcAddr(Instance, "vkSubmitDebugUtilsMessageEXT");
+  if (!submitMessage)
+    throw std::runtime_error("failed to find vkSubmitDebugUtilsMessageEXT.");
+
+  const uint64_t frames = frameLimit ? frameLimit : 300;
+  const uint64_t messagesPerFrame = std::max<uint64_t>(1, benchCount / frames);
+  std::cout << "Logging benchmark, " << frames << " frames, " << messagesPerFrame << " messages per frame" << std::endl;
+
+  timeFrames(10);
+  auto quiet = timeFrames(frames);
+
+  auto measure = [&](const char* label, DebugLog::Mode mode, bool repeated) {
+    debugLog.start(mode);
+    DebugLog::Stats before = debugLog.getStats();
+    uint64_t next = 0;
+    char text[128];
+    auto times = timeFrames(frames, [&]{
+      for (uint64_t i = 0; i < messagesPerFrame; ++i, ++next)
+      {
+        std::snprintf(text, sizeof(text), "Benchmark message %llu", static_cast<unsigned long long>(next));
+        VkDebugUtilsMessengerCallbackDataEXT data{};
+        data.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CALLBACK_DATA_EXT;
+        data.pMessageIdName = repeated ? "benchmark-repeated" : "benchmark";
+        data.messageIdNumber = repeated ? 0 : static_cast<int32_t>(next);
+        data.pMessage = text;
+        submitMessage(Instance, VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT, VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT, &data);
+      }
+    });
+    vkDeviceWaitIdle(Device);
+    debugLog.stop(); // The writer catches up outside the measured frames
+    DebugLog::Stats after = debugLog.getStats();
+    printFrameTimes(label, times);
+    std::cout << "    " << after.written - before.written << " written, " << after.deduplicated - before.deduplicated
+              << " repeats, " << after.dropped - before.dropped << " dropped" << std::endl;
+  };
+
+  printFrameTimes("no messages", quiet);
+  measure("sync", DebugLog::Mode::Sync, false);
+  // Before the distinct IDs fill the deduplication table
+  measure("async, one repeated ID", DebugLog::Mode::Async, true);
+  measure("async", DebugLog::Mode::Async, false);
+  debugLog.start(debugLogMode);
+}
+
+// Starts up and tears down --startup-bench times and reports the distribution of every stage.
+// The first run fills the pipeline cache and the driver's own caches, the others start warm.
+void benchmarkStartup()
+{
+  startupRuns.clear();
+  for (uint32_t i = 0; i < startupBenchRuns; ++i)
+  {
+    try{
+      if (!headless)
+        initWindow();
+      initVulkan();
+    }catch(const std::exception& e){
+      std::cerr << e.what() << std::endl;
+      return;
+    }
+    cleanup();
+  }
+
+  std::cout << "Startup benchmark, " << startupRuns.size() << " runs (" << (enableValidationLayers ? "with" : "without")
+            << " validation layers)" << std::endl;
+  std::vector<double> totals;
+  for (const auto& run : startupRuns)
+    totals.push_back(run.totalMs);
+  printFrameTimes("initVulkan", totals);
+
+  // Every run builds the same graph, so stage i is the same stage in all of them
+  const auto& stages = startupRuns.front().stages;
+  std::vector<std::vector<double>> stageTimes(stages.size());
+  for (const auto& run : startupRuns)
+  {
+    for (size_t i = 0; i < stages.size(); ++i)
+      stageTimes[i].push_back(run.stages[i].second);
+  }
+  for (size_t i = 0; i < stages.size(); ++i)
+    printFrameTimes(stages[i].first, stageTimes[i]);
+
+  if (startupReportPath.empty())
+    return;
+  std::ofstream file(startupReportPath);
+  if (!file.is_open())
+  {
+    std::cerr << "failed to open " << startupReportPath << std::endl;
+    return;
+  }
+  auto writeSamples = [&](const std::vector<double>& samples) {
+    file << "[";
+    for (size_t i = 0; i < samples.size(); ++i)
+      file << (i ? "," : "") << samples[i];
+    file << "]";
+  };
+  file << std::fixed << std::setprecision(3);
+  file << "{\n  \"runs\":" << startupRuns.size() << ",\n  \"validationLayers\":" << (enableValidationLayers ? "true" : "false")
+       << ",\n  \"totalMs\":";
+  writeSamples(totals);
+  file << ",\n  \"stages\":[";
+  for (size_t i = 0; i < stages.size(); ++i)
+  {
+    file << (i ? "," : "") << "\n    {\"name\":\"" << stages[i].first << "\",\"ms\":";
+    writeSamples(stageTimes[i]);
+    file << "}";
+  }
+  file << "]\n}\n";
+  std::cout << "Wrote startup distribution to " << startupReportPath << std::endl;
+}
+
+void runBenchmark()
+{
+  if (benchmark == "alloc")
+    benchmarkAllocator();
+  else if (benchmark == "upload")
+    benchmarkUploads();
+  else if (benchmark == "record")
+    benchmarkRecording();
+  else if (benchmark == "resize")
+    benchmarkResize();
+  else if (benchmark == "latency")
+    benchmarkLatency();
+  else if (benchmark == "instances")
+    benchmarkInstances();
+  else if (benchmark == "cull")
+    benchmarkCulling();
+  else if (benchmark == "occlusion")
+    benchmarkOcclusion();
+  else if (benchmark == "rendering")
+    benchmarkRendering();
+  else if (benchmark == "pipelines")
+    benchmarkPipelines();
+  else if (benchmark == "bindless")
+    benchmarkBindless();
+  else if (benchmark == "simd")
+    benchmarkSimd();
+  else if (benchmark == "shaders")
+    benchmarkShaders();
+  else if (benchmark == "logging")
+    benchmarkLogging();
+  else if (benchmark == "sync")
+    benchmarkSync();
+  else if (benchmark == "compute")
+    benchmarkCompute();
+  else if (benchmark == "msaa")
+    benchmarkMsaa();
+  else
+    throw std::runtime_error("unknown benchmark " + benchmark + ".");
+}
+
+void run()
+{
+  debugLog.start(debugLogMode);
+  if (startupBenchRuns)
+  {
+    benchmarkStartup();
+    return;
+  }
+
+  try{
+    if (!headless)
+      initWindow();
+    initVulkan();
+  }catch(const std::exception& e){
+    std::cerr << e.what() << std::endl;
+    return;
+  }
+
+  try{
+    if (benchmark.empty())
+      mainLoop();
+    else
+      runBenchmark();
+  }catch(const std::exception& e){
+    std::cerr << e.what() << std::endl;
+    vkDeviceWaitIdle(Device);
+  }
+  cleanup();
+  debugLog.stop();
+  if (enableValidationLayers)
+    debugLog.printStats(std::cout);
+}
+
+bool parseArguments(int argc, char* argv[])
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc)
+    {
+      int count = std::atoi(argv[++i]);
+      if (count < 1 || count > (int) MAX_FRAMES_IN_FLIGHT)
+      {
+        std::cerr << "--frames-in-flight must be between 1 and " << MAX_FRAMES_IN_FLIGHT << std::endl;
+        return false;
+      }
+      framesInFlight = static_cast<uint32_t>(count);
+    }else if (std::strcmp(argv[i], "--headless") == 0){
+      headless = true;
+    }else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc){
+      frameLimit = std::strtoull(argv[++i], nullptr, 10);
+    }else if (std::strcmp(argv[i], "--readback") == 0 && i + 1 < argc){
+      readbackPath = argv[++i];
+    }else if (std::strcmp(argv[i], "--pipeline-cache") == 0 && i + 1 < argc){
+      pipelineCachePath = argv[++i];
+    }else if (std::strcmp(argv[i], "--pipeline-lru") == 0 && i + 1 < argc){
+      pipelineCapacity = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--pipeline-threads") == 0 && i + 1 < argc){
+      pipelineBuildThreads = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--serial-init") == 0){
+      initThreads = 0;
+    }else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+      tracePath = argv[++i];
+    }else if (std::strcmp(argv[i], "--draws") == 0 && i + 1 < argc){
+      sceneDrawCount = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--instances") == 0 && i + 1 < argc){
+      instanceCount = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--materials") == 0 && i + 1 < argc){
+      materialCount = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--gpu-cull") == 0){
+      gpuCulling = true;
+    }else if (std::strcmp(argv[i], "--no-occlusion") == 0){
+      occlusionCulling = false;
+    }else if (std::strcmp(argv[i], "--layers") == 0 && i + 1 < argc){
+      sceneLayers = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--zoom") == 0 && i + 1 < argc){
+      cameraZoom = static_cast<float>(std::atof(argv[++i]));
+    }else if (std::strcmp(argv[i], "--dynamic-rendering") == 0){
+      dynamicRenderingRequested = true;
+    }else if (std::strcmp(argv[i], "--msaa") == 0 && i + 1 < argc){
+      int samples = std::atoi(argv[++i]);
+      if (samples < 1 || samples > 64 || (samples & (samples - 1)))
+      {
+        std::cerr << "--msaa must be one of 1, 2, 4, 8, 16, 32, 64" << std::endl;
+        return false;
+      }
+      requestedMsaaSamples = static_cast<uint32_t>(samples);
+    }else if (std::strcmp(argv[i], "--compute-load") == 0 && i + 1 < argc){
+      computeLoad = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--serialize-compute") == 0){
+      serializeCompute = true;
+    }else if (std::strcmp(argv[i], "--single-queue-compute") == 0){
+      singleQueueCompute = true;
+    }else if (std::strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc){
+      recordThreads = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--simd") == 0 && i + 1 < argc){
+      const char* name = argv[++i];
+      bool known = false;
+      for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2})
+      {
+        if (std::strcmp(name, simdLevelName(level)) == 0)
+        {
+          simdLevel = level;
+          known = true;
+        }
+      }
+      if (!known)
+      {
+        std::cerr << "--simd must be one of scalar, sse, avx2" << std::endl;
+        return false;
+      }
+    }else if (std::strcmp(argv[i], "--simd-threads") == 0 && i + 1 < argc){
+      simdThreads = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--present-mode") == 0 && i + 1 < argc){
+      const char* name = argv[++i];
+      for (VkPresentModeKHR mode : {VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR,
+                                    VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR})
+      {
+        if (std::strcmp(name, presentModeName(mode)) == 0)
+          requestedPresentMode = mode;
+      }
+      if (!requestedPresentMode)
+      {
+        std::cerr << "--present-mode must be one of immediate, mailbox, fifo, fifo-relaxed" << std::endl;
+        return false;
+      }
+    }else if (std::strcmp(argv[i], "--swapchain-images") == 0 && i + 1 < argc){
+      requestedImageCount = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--low-latency") == 0){
+      lowLatency = true;
+    }else if (std::strcmp(argv[i], "--log") == 0 && i + 1 < argc){
+      const char* name = argv[++i];
+      if (std::strcmp(name, "sync") == 0)
+        debugLogMode = DebugLog::Mode::Sync;
+      else if (std::strcmp(name, "async") == 0)
+        debugLogMode = DebugLog::Mode::Async;
+      else
+      {
+        std::cerr << "--log must be one of sync, async" << std::endl;
+        return false;
+      }
+    }else if (std::strcmp(argv[i], "--log-level") == 0 && i + 1 < argc){
+      const char* name = argv[++i];
+      const char* names[] = {"verbose", "info", "warning", "error"};
+      const VkDebugUtilsMessageSeverityFlagBitsEXT severities[] = {
+        VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT, VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT,
+        VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT, VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT};
+      bool known = false;
+      for (int level = 0; level < 4; ++level)
+      {
+        if (std::strcmp(name, names[level]) == 0)
+        {
+          debugLog.setMinSeverity(severities[level]);
+          known = true;
+        }
+      }
+      if (!known)
+      {
+        std::cerr << "--log-level must be one of verbose, info, warning, error" << std::endl;
+        return false;
+      }
+    }else if (std::strcmp(argv[i], "--startup-report") == 0 && i + 1 < argc){
+      startupReportPath = argv[++i];
+    }else if (std::strcmp(argv[i], "--startup-bench") == 0 && i + 1 < argc){
+      startupBenchRuns = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+    }else if (std::strcmp(argv[i], "--bench") == 0 && i + 1 < argc){
+      benchmark = argv[++i];
+    }else if (std::strcmp(argv[i], "--bench-count") == 0 && i + 1 < argc){
+      benchCount = std::strtoull(argv[++i], nullptr, 10);
+    }else{
+      std::cerr << "Unknown argument: " << argv[i] << "\n"
+                << "Usage: " << argv[0] << " [--frames-in-flight 1-" << MAX_FRAMES_IN_FLIGHT << "]"
+                << " [--headless] [--frames N] [--readback file.ppm] [--pipeline-cache file] [--pipeline-lru N] [--pipeline-threads N] [--serial-init] [--trace file.json] [--startup-report file.json] [--startup-bench N]"
+                << " [--draws N] [--instances N] [--materials N] [--gpu-cull] [--no-occlusion] [--layers N] [--zoom F] [--dynamic-rendering] [--msaa 1|2|4|8] [--compute-load N] [--serialize-compute] [--single-queue-compute] [--record-threads N] [--simd scalar|sse|avx2] [--simd-threads N]"
+                << " [--present-mode immediate|mailbox|fifo|fifo-relaxed] [--swapchain-images N] [--low-latency] [--log sync|async] [--log-level verbose|info|warning|error]"
+                << " [--bench alloc|upload|record|resize|latency|instances|cull|occlusion|rendering|pipelines|bindless|simd|shaders|logging|sync|compute|msaa] [--bench-count N]" << std::endl;
+      return false;
+    }
+  }
+
+  // The culling benchmarks need the device features of the culling path
+  if (benchmark == "cull" || benchmark == "occlusion")
+    gpuCulling = true;
+  // The compute benchmark needs something to overlap
+  if (benchmark == "compute" && computeLoad == 0)
+    computeLoad = 1000;
+  // The depth pyramid samples the depth image, it can't be multisampled
+  if (gpuCulling && requestedMsaaSamples > 1)
+  {
+    std::cerr << "--msaa doesn't work together with --gpu-cull, ignoring it" << std::endl;
+    requestedMsaaSamples = 1;
+  }
+
+  // There is no window to close in headless mode
+  if (headless && frameLimit == 0)
+    frameLimit = 1000;
+  if (!headless && !readbackPath.empty())
+    std::cerr << "--readback is only supported together with --headless, ignoring it" << std::endl;
+
+  return true;
+}
+
+int main( int argc, char* argv[])
+{
+  programStart = std::chrono::steady_clock::now();
+
+  if (!parseArguments(argc, argv))
+    return 1;
 
   run();
 